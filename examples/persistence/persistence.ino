@@ -1,4 +1,4 @@
-// Demo for using persistence flag and readPacketSlice()
+// Demo for using persistence flag and ENC28J60Reader
 //
 // License: GPLv2
 
@@ -26,24 +26,18 @@ static void my_callback (byte status, word off, word len) {
 
     if (nextSeq != ether.getSequenceNumber()) { Serial.print(F("<IGNORE DUPLICATE(?) PACKET>")); return; }
 
-    uint16_t payloadlength = ether.getTcpPayloadLength();
-    int16_t chunk_size   = BUFFERSIZE-off-1;
-    int16_t char_written = 0;
-    int16_t char_in_buf  = chunk_size < payloadlength ? chunk_size : payloadlength;
-
-    while (char_written < payloadlength) {
-        Serial.write((char*) Ethernet::buffer+off,char_in_buf);
-        char_written += char_in_buf;
-
-        char_in_buf = ether.readPacketSlice((char*) Ethernet::buffer+off,chunk_size,off+char_written);
-    }
+    // the reply may be longer than the buffer, stream it from the chip in chunks
+    ENC28J60Reader reader = ether.tcpPayloadReader();
+    uint16_t chunk;
+    while ((chunk = reader.read(Ethernet::buffer + off, BUFFERSIZE - off)) > 0)
+        Serial.write((char*) Ethernet::buffer + off, chunk);
 
     nextSeq += ether.getTcpPayloadLength();
 }
 
 void setup () {
     Serial.begin(57600);
-    Serial.println(F("\n[Persistence+readPacketSlice]"));
+    Serial.println(F("\n[Persistence+ENC28J60Reader]"));
 
     // Change 'SS' to your Slave Select pin, if you arn't using the default pin
     if (ether.begin(sizeof Ethernet::buffer, mymac, SS) == 0)
@@ -100,7 +100,7 @@ void loop () {
 
  // added from: http://jeelabs.net/boards/7/topics/2241
  int freeCount = stash.freeCount();
-    if (freeCount <= 3) {   Stash::initMap(56); }
+    if (freeCount <= 3) {   Stash::initMap(ether.scratchPages()); }
   }
 
    const char* reply = ether.tcpReply(session);
@@ -0,0 +1,194 @@
+// Minimal Arduino core for building EtherCard on a Linux host.
+//
+// Copyright: GPL V2
+
+#include "Arduino.h"
+#include "avr/eeprom.h"
+
+HardwareSerial Serial;
+
+static uint64_t clockNanos;
+static void (*interruptHandlers[2])();
+static uint8_t eeprom[E2END + 1];
+
+uint64_t hostClockNanos () {
+    return clockNanos;
+}
+
+void hostClockAdvance (uint64_t ns) {
+    clockNanos += ns;
+}
+
+void hostInterrupt (uint8_t num) {
+    if (num < 2 && interruptHandlers[num])
+        interruptHandlers[num]();
+}
+
+void attachInterrupt (uint8_t num, void (*isr)(), int /* mode */) {
+    if (num < 2)
+        interruptHandlers[num] = isr;
+}
+
+void detachInterrupt (uint8_t num) {
+    if (num < 2)
+        interruptHandlers[num] = 0;
+}
+
+void pinMode (uint8_t /* pin */, uint8_t /* mode */) {
+}
+
+void digitalWrite (uint8_t /* pin */, uint8_t /* val */) {
+}
+
+int digitalRead (uint8_t /* pin */) {
+    return HIGH;
+}
+
+unsigned long millis () {
+    return clockNanos / 1000000;
+}
+
+unsigned long micros () {
+    return clockNanos / 1000;
+}
+
+void delay (unsigned long ms) {
+    clockNanos += (uint64_t) ms * 1000000;
+}
+
+void delayMicroseconds (unsigned int us) {
+    clockNanos += (uint64_t) us * 1000;
+}
+
+uint8_t eeprom_read_byte (const uint8_t* addr) {
+    return eeprom[(uintptr_t) addr & E2END];
+}
+
+void eeprom_write_byte (uint8_t* addr, uint8_t value) {
+    eeprom[(uintptr_t) addr & E2END] = value;
+}
+
+static char* reverse (char* str, char* end) {
+    for (char* p = str; p < --end; ++p) {
+        char c = *p;
+        *p = *end;
+        *end = c;
+    }
+    return str;
+}
+
+char* ltoa (long value, char* str, int base) {
+    unsigned long v = value < 0 && base == 10 ? -(unsigned long) value : (unsigned long) value;
+    char* p = str;
+    do {
+        uint8_t d = v % base;
+        *p++ = d < 10 ? '0' + d : 'a' + d - 10;
+        v /= base;
+    } while (v != 0);
+    if (value < 0 && base == 10)
+        *p++ = '-';
+    *p = 0;
+    return reverse(str, p);
+}
+
+char* itoa (int value, char* str, int base) {
+    return ltoa(value, str, base);
+}
+
+char* dtostrf (double value, signed char width, unsigned char prec, char* str) {
+    sprintf(str, "%*.*f", width, prec, value);
+    return str;
+}
+
+size_t Print::write (const uint8_t* buf, size_t len) {
+    size_t n = 0;
+    while (len--)
+        n += write(*buf++);
+    return n;
+}
+
+size_t Print::print (const __FlashStringHelper* s) {
+    return print(reinterpret_cast<const char*>(s));
+}
+
+size_t Print::print (const char* s) {
+    return write((const uint8_t*) s, strlen(s));
+}
+
+size_t Print::print (char c) {
+    return write((uint8_t) c);
+}
+
+size_t Print::print (unsigned char n, int base) {
+    return printNumber(n, base);
+}
+
+size_t Print::print (int n, int base) {
+    return print((long) n, base);
+}
+
+size_t Print::print (unsigned int n, int base) {
+    return printNumber(n, base);
+}
+
+size_t Print::print (long n, int base) {
+    if (n < 0 && base == 10)
+        return print('-') + printNumber(-(unsigned long) n, base);
+    return printNumber(n, base);
+}
+
+size_t Print::print (unsigned long n, int base) {
+    return printNumber(n, base);
+}
+
+size_t Print::printNumber (unsigned long n, int base) {
+    char buf[8 * sizeof(long) + 1];
+    char* p = buf + sizeof buf - 1;
+    *p = 0;
+    do {
+        uint8_t d = n % base;
+        *--p = d < 10 ? '0' + d : 'A' + d - 10;
+        n /= base;
+    } while (n != 0);
+    return print(p);
+}
+
+size_t Print::println () {
+    return print("\r\n");
+}
+
+size_t Print::println (const __FlashStringHelper* s) {
+    return print(s) + println();
+}
+
+size_t Print::println (const char* s) {
+    return print(s) + println();
+}
+
+size_t Print::println (char c) {
+    return print(c) + println();
+}
+
+size_t Print::println (unsigned char n, int base) {
+    return print(n, base) + println();
+}
+
+size_t Print::println (int n, int base) {
+    return print(n, base) + println();
+}
+
+size_t Print::println (unsigned int n, int base) {
+    return print(n, base) + println();
+}
+
+size_t Print::println (long n, int base) {
+    return print(n, base) + println();
+}
+
+size_t Print::println (unsigned long n, int base) {
+    return print(n, base) + println();
+}
+
+size_t HardwareSerial::write (uint8_t b) {
+    return fputc(b, stdout) == EOF ? 0 : 1;
+}
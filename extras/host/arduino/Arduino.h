@@ -0,0 +1,127 @@
+// Minimal Arduino core for building EtherCard on a Linux host.
+// Only what the library itself uses is provided; time is simulated and
+// advanced by the ENC28J60 model (SPI traffic) and by delay().
+//
+// Copyright: GPL V2
+
+#ifndef Arduino_h
+#define Arduino_h
+
+#include <ctype.h>
+#include <math.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "avr/pgmspace.h"
+
+typedef uint8_t byte;
+typedef bool boolean;
+typedef unsigned int word;
+
+#define HIGH 0x1
+#define LOW  0x0
+
+#define INPUT  0x0
+#define OUTPUT 0x1
+#define INPUT_PULLUP 0x2
+
+#define CHANGE  1
+#define FALLING 2
+#define RISING  3
+
+#define DEC 10
+#define HEX 16
+#define OCT 8
+#define BIN 2
+
+// pin numbers of an Arduino Uno, only used as default arguments
+static const uint8_t SS   = 10;
+static const uint8_t MOSI = 11;
+static const uint8_t MISO = 12;
+static const uint8_t SCK  = 13;
+
+#define bit(b) (1UL << (b))
+#define bitRead(value, b) (((value) >> (b)) & 0x01)
+#define bitSet(value, b) ((value) |= (1UL << (b)))
+#define bitClear(value, b) ((value) &= ~(1UL << (b)))
+#define bitWrite(value, b, v) ((v) ? bitSet(value, b) : bitClear(value, b))
+
+#define lowByte(w) ((uint8_t) ((w) & 0xff))
+#define highByte(w) ((uint8_t) ((w) >> 8))
+
+void pinMode (uint8_t pin, uint8_t mode);
+void digitalWrite (uint8_t pin, uint8_t val);
+int digitalRead (uint8_t pin);
+
+unsigned long millis ();
+unsigned long micros ();
+void delay (unsigned long ms);
+void delayMicroseconds (unsigned int us);
+
+// external interrupts of an Uno: pin 2 is interrupt 0, pin 3 is interrupt 1
+#define digitalPinToInterrupt(p) ((p) == 2 ? 0 : (p) == 3 ? 1 : -1)
+void attachInterrupt (uint8_t num, void (*isr)(), int mode);
+void detachInterrupt (uint8_t num);
+
+// there is only one thread of execution on the host, so these are no-ops
+inline void cli () {}
+inline void sei () {}
+inline void noInterrupts () {}
+inline void interrupts () {}
+
+char* itoa (int value, char* str, int base);
+char* ltoa (long value, char* str, int base);
+char* dtostrf (double value, signed char width, unsigned char prec, char* str);
+
+class __FlashStringHelper;
+#define F(s) (reinterpret_cast<const __FlashStringHelper*>(PSTR(s)))
+
+class Print {
+public:
+    virtual size_t write (uint8_t b) = 0;
+    virtual size_t write (const uint8_t* buf, size_t len);
+    virtual ~Print () {}
+
+    size_t print (const __FlashStringHelper* s);
+    size_t print (const char* s);
+    size_t print (char c);
+    size_t print (unsigned char n, int base = DEC);
+    size_t print (int n, int base = DEC);
+    size_t print (unsigned int n, int base = DEC);
+    size_t print (long n, int base = DEC);
+    size_t print (unsigned long n, int base = DEC);
+
+    size_t println ();
+    size_t println (const __FlashStringHelper* s);
+    size_t println (const char* s);
+    size_t println (char c);
+    size_t println (unsigned char n, int base = DEC);
+    size_t println (int n, int base = DEC);
+    size_t println (unsigned int n, int base = DEC);
+    size_t println (long n, int base = DEC);
+    size_t println (unsigned long n, int base = DEC);
+
+private:
+    size_t printNumber (unsigned long n, int base);
+};
+
+class HardwareSerial : public Print {
+public:
+    void begin (unsigned long /* baud */) {}
+    virtual size_t write (uint8_t b);
+    using Print::write;
+};
+
+extern HardwareSerial Serial;
+
+// host build only: simulated time base shared with the ENC28J60 model
+uint64_t hostClockNanos ();
+void hostClockAdvance (uint64_t ns);
+
+// host build only: run the handler attached to an external interrupt, if any
+void hostInterrupt (uint8_t num);
+
+#endif
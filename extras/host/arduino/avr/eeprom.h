@@ -0,0 +1,15 @@
+// Emulated 1 KB EEPROM for the host build.
+//
+// Copyright: GPL V2
+
+#ifndef _AVR_EEPROM_H_
+#define _AVR_EEPROM_H_
+
+#include <stdint.h>
+
+#define E2END 0x3FF
+
+uint8_t eeprom_read_byte (const uint8_t* addr);
+void eeprom_write_byte (uint8_t* addr, uint8_t value);
+
+#endif
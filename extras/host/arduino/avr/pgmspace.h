@@ -0,0 +1,25 @@
+// Program space access for the host build; flash and RAM are the same here.
+//
+// Copyright: GPL V2
+
+#ifndef __PGMSPACE_H_
+#define __PGMSPACE_H_
+
+#include <stdint.h>
+#include <string.h>
+
+#define PROGMEM
+#define PGM_P const char*
+#define PSTR(s) (s)
+
+#define pgm_read_byte(addr) (*(const uint8_t*) (addr))
+#define pgm_read_word(addr) (*(const uint16_t*) (addr))
+
+#define memcpy_P memcpy
+#define strlen_P strlen
+#define strncpy_P strncpy
+#define strcpy_P strcpy
+#define strcmp_P strcmp
+#define strncmp_P strncmp
+
+#endif
@@ -0,0 +1,988 @@
+// Packet processing benchmark for the host build.
+//
+// Runs the unmodified stack against the ENC28J60 model and reports, per
+// frame, the SPI bytes and transactions, the simulated bus time and the wall
+// time spent in packetReceive() + packetLoop(). Run it under perf to profile
+// the stack itself:
+//
+//   perf record ./ethercard_bench 100000 http
+//
+// With --irq the stack receives through the INT pin, see enableInterrupt().
+// With --drain N the sketch calls packetLoopDrain(N) instead of packetLoop().
+// With --layout sink|web|client the chip buffer uses one of the layout presets.
+// With --filters the receive filters are generated by enableFilters().
+// With --buffer N the stack only gets N bytes of the data buffer.
+// "GET /stream" is served like "GET /multi", but with packetSendSegments().
+// "beacon" sends a UDP beacon with sendUdp(), "template" the same one stored
+// in chip memory by udpTemplate(), which needs a layout with a heap (sink).
+// "park" keeps the last datagrams of varying size in the enc_malloc() heap,
+// which needs a layout with a heap (pool). "bigudp" datagrams are read with
+// udpPayloadReader(), so they are answered with any --buffer size.
+// "bigpage" fetches pages of up to 10 KB sent by httpServerStream(), "lossybig"
+// the same over a lossy network, "shutbig" with a browser which shuts its window
+// and tells it is open again only when probed, "busybig" over the lossy network
+// with a broadcast in every loop the browser is quiet.
+// "sessions" runs three clientTcpReq() sessions to two servers at once.
+// "lossy" and "lossyweb" lose TCP segments of the client and of the server,
+// which have to be retransmitted. With --layout pool the server resends copies
+// kept in the heap, run "lossyweb" alone for that as "park" fills the heap.
+// The exit status is 1 if a page came corrupt or stalled, a server segment out
+// of sequence or over the MSS, or a client session failed.
+//
+// Copyright: GPL V2
+
+#include <EtherCard.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "enc28j60_model.h"
+#include "netpeer.h"
+
+uint8_t Ethernet::buffer[1500];
+
+static const uint8_t mymac[] = { 0x74,0x69,0x69,0x2D,0x30,0x31 };
+static const uint8_t myip[] = { 192,168,1,203 };
+static const uint8_t gwip[] = { 192,168,1,1 };
+static const uint8_t peermac[] = { 0x02,0x00,0x00,0x00,0x00,0x01 };
+static const uint8_t peerip[] = { 192,168,1,10 };
+static const uint8_t collectormac[] = { 0x02,0x00,0x00,0x00,0x00,0x03 };
+static const uint8_t collectorip[] = { 192,168,1,11 };
+#if ETHERCARD_INTERFACES > 1
+// a second interface on another subnet, with a host behind it
+static const uint8_t mac2[] = { 0x74,0x69,0x69,0x2D,0x30,0x32 };
+static const uint8_t ip2[] = { 10,0,0,1 };
+static const uint8_t mask2[] = { 255,255,255,0 };
+static const uint8_t peer2mac[] = { 0x02,0x00,0x00,0x00,0x00,0x02 };
+static const uint8_t peer2ip[] = { 10,0,0,20 };
+#endif
+
+static const char page[] PROGMEM =
+    "HTTP/1.0 200 OK\r\n"
+    "Content-Type: text/html\r\n"
+    "Pragma: no-cache\r\n"
+    "\r\n"
+    "<title>EtherCard host bench</title>"
+    "<h1>Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do "
+    "eiusmod tempor incididunt ut labore et dolore magna aliqua. Ut enim ad "
+    "minim veniam, quis nostrud exercitation ullamco laboris nisi ut aliquip "
+    "ex ea commodo consequat. Duis aute irure dolor in reprehenderit in "
+    "voluptate velit esse cillum dolore eu fugiat nulla pariatur.</h1>";
+
+// served by httpServerStream() as if it were in flash, filled in by main()
+static char bigPage[10240];
+static const char footerText[] =
+    "<p>Served from the ENC28J60 scratch memory by the DMA engine, "
+    "it never passes through the data buffer.</p>";
+
+static ENC28J60Model chip;
+static NetPeer peer (peermac, peerip);
+static NetPeer collector (collectormac, collectorip);
+#if ETHERCARD_INTERFACES > 1
+static ENC28J60Model chip2;
+static NetPeer peer2 (peer2mac, peer2ip);
+#endif
+static uint32_t udpCount;
+static uint8_t drainFrames;
+static uint8_t footer;
+static uint16_t footerLen;
+static uint8_t beacon;          // 1: sendUdp(), 2: udpTemplateSend(), 3: packetSendAsync() in the next loop
+static uint32_t beaconSeq;
+static ENC28J60Template beaconTmpl;
+static const char beaconMsg[] = "beacon seq=....";
+
+static uint64_t udpLatency;      // sum of micros() from arrival to callback
+
+static void udpHandler (uint16_t, uint8_t*, uint16_t, const char*, uint16_t) {
+    ++udpCount;
+    udpLatency += micros() - ether.packetTime();
+}
+
+// stream a datagram from the chip in small chunks and check its UDP checksum,
+// pseudo header included; valid ones are answered
+static void bigHandler (uint16_t, uint8_t*, uint16_t, const char*, uint16_t) {
+    uint16_t udpLen = ether.udpPayloadReader().remaining() + 8;
+    ENC28J60Reader reader (ETH_HEADER_LEN + 12, 2 * IP_LEN + udpLen);
+    uint8_t chunk[64];
+    while (reader.read(chunk, sizeof chunk))
+        ;
+    uint32_t sum = reader.checksum() + IP_PROTO_UDP_V + udpLen;
+    if ((uint16_t) (sum + (sum >> 16)) == 0xFFFF)
+        ether.makeUdpReply("ok", 2, 1339);
+}
+
+// park each datagram in chip memory, releasing the oldest of the last 8
+static uint16_t parked[8];
+static uint8_t parkNext;
+static uint32_t parkFailed;
+
+static void parkHandler (uint16_t, uint8_t*, uint16_t, const char* data, uint16_t len) {
+    ether.enc_free(parked[parkNext]);
+    parked[parkNext] = ether.enc_malloc(len);
+    if (parked[parkNext])
+        ether.memcpy_to_enc(parked[parkNext], (void*) data, len);
+    else
+        ++parkFailed;
+    parkNext = (parkNext + 1) % 8;
+}
+
+// the INT pin of the model is wired to pin 2
+static void intPinFell (void*) {
+    hostInterrupt(digitalPinToInterrupt(2));
+}
+
+// completions reported by packetSendAsync()
+static uint32_t asyncSent;
+static uint32_t asyncFailed;
+static uint8_t asyncToken;
+
+static void asyncDone (uint8_t, bool sent) {
+    if (sent)
+        ++asyncSent;
+    else
+        ++asyncFailed;
+}
+
+static uint64_t wallNanos () {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// produce the big page for httpServerStream(), it ends where the page does
+static uint16_t bigFill (uint8_t, uint16_t offset, uint8_t* buf, uint16_t len) {
+    if (offset >= sizeof bigPage)
+        return 0;
+    if (len > sizeof bigPage - offset)
+        len = sizeof bigPage - offset;
+    memcpy_P(buf, bigPage + offset, len);
+    return len;
+}
+
+// one turn of a typical sketch loop(), serving a web page on port 80;
+// "GET /multi" gets the page in several segments like examples/multipacket,
+// "GET /big" and "GET /bigfill" a 10 KB page, "GET /footer" a Stash, streamed
+static void sketchLoop () {
+    uint16_t pos = drainFrames ? ether.packetLoopDrain(drainFrames)
+                   : ether.packetLoop(ether.packetReceive());
+    if (beacon) {
+        // the sequence number is the only part of the beacon which changes
+        ++beaconSeq;
+        if (beacon == 3) {
+            // any frame will do, the peer addresses one to itself
+            peer.udp(peermac, peerip, 5001, 5001, beaconMsg, sizeof beaconMsg - 1);
+            memcpy(ether.buffer, peer.frame, peer.frameLen);
+            asyncToken = ether.packetSendAsync(peer.frameLen, asyncDone);
+        } else if (beacon == 2 && beaconTmpl.start) {
+            ether.udpTemplateSend(beaconTmpl, sizeof beaconMsg - 5, &beaconSeq, 4);
+        } else {
+            char msg[sizeof beaconMsg];
+            memcpy(msg, beaconMsg, sizeof msg);
+            memcpy(msg + sizeof msg - 5, &beaconSeq, 4);
+            ether.sendUdp(msg, sizeof msg - 1, 1337, peerip, 5001);
+        }
+        beacon = 0;
+    }
+    if (pos && strncmp("GET /bigfill", (char*) Ethernet::buffer + pos, 12) == 0) {
+        ether.httpServerStream(bigFill);
+    } else if (pos && strncmp("GET /big", (char*) Ethernet::buffer + pos, 8) == 0) {
+        const ENC28J60Segment source = { ENC28J60Segment::FLASH, 0, sizeof bigPage, bigPage };
+        ether.httpServerStream(source);
+    } else if (pos && strncmp("GET /footer", (char*) Ethernet::buffer + pos, 11) == 0) {
+        const ENC28J60Segment source = { ENC28J60Segment::STASH, footer, footerLen, 0 };
+        ether.httpServerStream(source);
+    } else if (pos && strncmp("GET /stream", (char*) Ethernet::buffer + pos, 11) == 0) {
+        // the page comes straight from flash, the last segment adds a Stash
+        ENC28J60Segment segs[] = {
+            { ENC28J60Segment::FLASH, 0, sizeof page - 1, page },
+            { ENC28J60Segment::STASH, footer, footerLen, 0 },
+        };
+        ether.httpServerReplyAck();
+        for (uint8_t n = 0; n < 4; ++n)
+            ether.httpServerReplySegments(segs, n < 3 ? 1 : 2, n < 3 ? TCP_FLAGS_ACK_V
+                                          : TCP_FLAGS_ACK_V | TCP_FLAGS_FIN_V);
+    } else if (pos && strncmp("GET /multi", (char*) Ethernet::buffer + pos, 10) == 0) {
+        ether.httpServerReplyAck();
+        for (uint8_t n = 0; n < 4; ++n) {
+            memcpy_P(ether.tcpOffset(), page, sizeof page - 1);
+            ether.httpServerReply_with_flags(sizeof page - 1, n < 3 ? TCP_FLAGS_ACK_V
+                                             : TCP_FLAGS_ACK_V | TCP_FLAGS_FIN_V);
+        }
+    } else if (pos) {
+        BufferFiller bfill = ether.tcpOffset();
+        bfill.emit_raw_p(page, sizeof page - 1);
+        ether.httpServerReply(bfill.position());
+    }
+#if ETHERCARD_INTERFACES > 1
+    ether.selectInterface(1);
+    ether.packetLoop(ether.packetReceive());
+    ether.selectInterface(0);
+#endif
+}
+
+typedef void (*Scenario)(uint32_t i);
+
+static void idle (uint32_t) {
+}
+
+static void flap (uint32_t i) {
+    chip.setLink(i & 1);
+}
+
+static void arp (uint32_t) {
+    peer.arpRequest(myip);
+    chip.receive(peer.frame, peer.frameLen);
+}
+
+static void ping64 (uint32_t i) {
+    peer.icmpEcho(mymac, myip, 56, i);
+    chip.receive(peer.frame, peer.frameLen);
+}
+
+static void ping1k (uint32_t i) {
+    peer.icmpEcho(mymac, myip, 1000, i);
+    chip.receive(peer.frame, peer.frameLen);
+}
+
+// every 16th request arrives in a corrupt receive ring, which must recover
+static void corrupt (uint32_t i) {
+    ping64(i);
+    if ((i & 15) == 15)
+        chip.corruptLastFrame();
+}
+
+static void udp (uint32_t) {
+    static const char msg[] = "temperature=21.5";
+    peer.udp(mymac, myip, 5000, 1337, msg, sizeof msg - 1);
+    chip.receive(peer.frame, peer.frameLen);
+}
+
+static void bigudp (uint32_t i) {
+    static char msg[1400];
+    memset(msg, 'a' + i % 26, sizeof msg);
+    peer.udp(mymac, myip, 5000, 1339, msg, sizeof msg);
+    chip.receive(peer.frame, peer.frameLen);
+}
+
+static void park (uint32_t i) {
+    static char msg[400];
+    uint16_t len = 20 + (i * 97) % (sizeof msg - 20);
+    memset(msg, 'a' + i % 26, len);
+    peer.udp(mymac, myip, 5000, 1338, msg, len);
+    chip.receive(peer.frame, peer.frameLen);
+}
+
+// more frames than the sketch loop handles by default, e.g. a sensor storm;
+// in full duplex the sender holds back while it is being paused
+static void burst (uint32_t i) {
+    for (uint8_t n = 0; n < 32 && !chip.partnerPausing(); ++n)
+        udp(i);
+}
+
+static void broadcast (uint32_t) {
+    static const uint8_t bcast[] = { 192,168,1,255 };
+    static const uint8_t allOnes[] = { 0xFF,0xFF,0xFF,0xFF,0xFF,0xFF };
+    static const char msg[] = "NetBIOS name query, not for us";
+    peer.udp(allOnes, bcast, 137, 137, msg, sizeof msg - 1);
+    chip.receive(peer.frame, peer.frameLen);
+}
+
+// SSDP style traffic: every other datagram goes to a group the sketch joined
+static void mcast (uint32_t i) {
+    static const uint8_t groups[2][4] = { { 239,255,255,250 }, { 239,1,2,3 } };
+    static const char msg[] = "NOTIFY * HTTP/1.1";
+    const uint8_t* group = groups[i & 1];
+    const uint8_t mac[] = { 0x01, 0x00, 0x5E, (uint8_t) (group[1] & 0x7F), group[2], group[3] };
+    peer.udp(mac, group, 1900, 1337, msg, sizeof msg - 1);
+    chip.receive(peer.frame, peer.frameLen);
+}
+
+static void syn (uint32_t i) {
+    peer.tcp(mymac, myip, 30000 + (i & 0x3FF), 80, 1000, 0,
+             TCP_FLAGS_SYN_V, 0, 0, 1460);
+    chip.receive(peer.frame, peer.frameLen);
+}
+
+static void http (uint32_t i) {
+    static const char get[] = "GET / HTTP/1.0\r\nHost: 192.168.1.203\r\n\r\n";
+    peer.tcp(mymac, myip, 40000 + (i & 0x3FF), 80, 1001, 0x000A0001,
+             TCP_FLAGS_ACK_V | TCP_FLAGS_PUSH_V, get, sizeof get - 1);
+    chip.receive(peer.frame, peer.frameLen);
+}
+
+static void multi (uint32_t i) {
+    static const char get[] = "GET /multi HTTP/1.0\r\nHost: 192.168.1.203\r\n\r\n";
+    peer.tcp(mymac, myip, 40000 + (i & 0x3FF), 80, 1001, 0x000A0001,
+             TCP_FLAGS_ACK_V | TCP_FLAGS_PUSH_V, get, sizeof get - 1);
+    chip.receive(peer.frame, peer.frameLen);
+}
+
+static void stream (uint32_t i) {
+    static const char get[] = "GET /stream HTTP/1.0\r\nHost: 192.168.1.203\r\n\r\n";
+    peer.tcp(mymac, myip, 40000 + (i & 0x3FF), 80, 1001, 0x000A0001,
+             TCP_FLAGS_ACK_V | TCP_FLAGS_PUSH_V, get, sizeof get - 1);
+    chip.receive(peer.frame, peer.frameLen);
+}
+
+// four browsers with overlapping connections: each one in turn sends SYN,
+// then ACK and GET, then ACK and FIN for the page, all with proper numbers
+static const uint16_t CLIENT_PORT = 50000;
+static uint32_t serverNext[4];  // sequence number the next server segment must have
+static uint32_t outOfSequence;
+static const uint16_t clientMss[4] = { 1460, 1460, 1460, 64 }; // the last one takes the page in pieces
+static uint32_t overMss;
+
+static uint16_t get16 (const uint8_t* p) {
+    return p[0] << 8 | p[1];
+}
+
+static uint32_t get32 (const uint8_t* p) {
+    return (uint32_t) get16(p) << 16 | get16(p + 2);
+}
+
+// segments of the "sessions" client which the servers still have to answer
+struct ClientSegment {
+    NetPeer* server;
+    uint16_t serverPort;
+    uint16_t clientPort;
+    uint32_t seq;       // sequence number following the segment
+    uint8_t flags;      // SYN for the SYN, PUSH for the request, FIN for the FIN
+};
+static const uint32_t SERVER_ISN = 7000;
+static const char sessionReply[] = "HTTP/1.0 200 OK\r\n\r\nok";
+static ClientSegment answers[16];
+static uint8_t answerHead, answerTail;
+static uint32_t sessionRequests, sessionAnswers, sessionFailures;
+static uint8_t sessionPeak;
+static uint8_t lossEvery;       // the servers miss every Nth segment of the client, 0 for none
+static uint32_t clientSegments, clientLost;
+
+static uint8_t sessionResult (uint8_t, uint8_t status, uint16_t, uint16_t) {
+    if (status == 0)
+        ++sessionAnswers;
+    else
+        ++sessionFailures;
+    return 0;
+}
+
+static uint16_t sessionFill (uint8_t fd) {
+    BufferFiller bfill = ether.tcpOffset();
+    bfill.emit_p(PSTR("POST /telemetry HTTP/1.0\r\n\r\nsession=$D"), fd);
+    return bfill.position();
+}
+
+// remember the SYNs, requests and FINs of the "sessions" client for their servers
+static void clientSent (const uint8_t* ip, const uint8_t* tcp) {
+    uint16_t dlen = get16(ip + 2) - 20 - (tcp[12] >> 4) * 4;
+    uint8_t flags = tcp[13] & (TCP_FLAGS_SYN_V | TCP_FLAGS_FIN_V);
+    if ((!flags && dlen == 0) ||
+            (uint8_t) (answerTail - answerHead) == sizeof answers / sizeof answers[0])
+        return;
+    if (lossEvery && ++clientSegments % lossEvery == 0) {
+        ++clientLost;
+        return;
+    }
+    ClientSegment& a = answers[answerTail++ % (sizeof answers / sizeof answers[0])];
+    a.server = memcmp(ip + 16, collectorip, IP_LEN) == 0 ? &collector : &peer;
+    a.serverPort = get16(tcp + 2);
+    a.clientPort = get16(tcp);
+    a.seq = get32(tcp + 4) + dlen + (flags ? 1 : 0);
+    a.flags = dlen ? TCP_FLAGS_PUSH_V : flags;
+}
+
+// answer the oldest segment of the "sessions" client
+static void sessionAnswer () {
+    if (answerHead == answerTail)
+        return;
+    const ClientSegment& a = answers[answerHead++ % (sizeof answers / sizeof answers[0])];
+    if (a.flags == TCP_FLAGS_SYN_V)
+        a.server->tcp(mymac, myip, a.serverPort, a.clientPort, SERVER_ISN, a.seq,
+                      TCP_FLAGS_SYN_V | TCP_FLAGS_ACK_V, 0, 0, 1460);
+    else if (a.flags == TCP_FLAGS_PUSH_V)
+        a.server->tcp(mymac, myip, a.serverPort, a.clientPort, SERVER_ISN + 1, a.seq,
+                      TCP_FLAGS_ACK_V | TCP_FLAGS_PUSH_V | TCP_FLAGS_FIN_V,
+                      sessionReply, sizeof sessionReply - 1);
+    else
+        a.server->tcp(mymac, myip, a.serverPort, a.clientPort,
+                      SERVER_ISN + sizeof sessionReply, a.seq, TCP_FLAGS_ACK_V, 0, 0);
+    chip.receive(a.server->frame, a.server->frameLen);
+}
+
+// one browser after the other fetches the page over a lossy network, where
+// every third segment of the server with data or FIN gets lost; the browser
+// repeats its request when no reply came for 3 s, a loop takes 100 ms
+static const uint16_t LOSSY_PORT = 20000;
+static uint16_t lossyPort = LOSSY_PORT;
+static uint8_t lossyPhase;          // 0: connect, 1: SYN sent, 2: request sent
+static uint8_t lossyWait;           // loops since the last step
+static bool lossySynAck, lossyReply;
+static uint32_t lossyServerNext;    // sequence number of the next server byte
+static uint32_t lossyServerSegments, lossyPages;
+
+// the server side of the "lossyweb" browser; returns false if the segment got lost
+static bool lossyServerSent (const uint8_t* ip, const uint8_t* tcp) {
+    uint16_t dlen = get16(ip + 2) - 20 - (tcp[12] >> 4) * 4;
+    uint8_t flags = tcp[13];
+    if (flags & TCP_FLAGS_SYN_V) {
+        lossyServerNext = get32(tcp + 4) + 1;
+        lossySynAck = true;
+    } else if (dlen || (flags & TCP_FLAGS_FIN_V)) {
+        if (++lossyServerSegments % 3 == 0)
+            return false;
+        if (get32(tcp + 4) == lossyServerNext) {
+            lossyServerNext += dlen + ((flags & TCP_FLAGS_FIN_V) ? 1 : 0);
+            lossyReply = lossyReply || (flags & TCP_FLAGS_FIN_V);
+        }
+    }
+    return true;
+}
+
+// one browser after the other fetches "/big", "/bigfill" and "/footer", the
+// last one with an MSS of 40; it acknowledges what arrived in order once per
+// loop, so a loop is a round trip
+static const uint16_t BIG_PORT = 21000;
+static uint16_t bigPort = BIG_PORT;
+static uint8_t bigPhase;            // 0: connect, 1: SYN sent, 2: request sent
+static uint32_t bigStart;           // loop of the SYN
+static uint32_t bigLastAck;         // what the browser acknowledged last
+static bool bigSynAck, bigFin;
+static uint32_t bigServerNext;      // sequence number of the next server byte
+static uint32_t bigReceived;        // bytes of the page received in order
+static uint32_t bigPages;
+static uint8_t bigLossEvery;        // every Nth segment with data or FIN gets lost, 0 for none
+static uint32_t bigSegments;
+static uint8_t bigScenario;         // 0: "bigpage", 1: "lossybig", 2: "shutbig", 3: "busybig"
+static uint8_t bigShut;             // loops left with the window of the browser shut
+static bool bigShutDone;            // the window was shut once during this page
+static bool bigProbed;              // data arrived while the window was shut
+static uint32_t bigProbes;
+static struct BigStats {
+    uint32_t pages, loops, corrupt, stalled, lost;
+} bigStats[4];                      // of "bigpage", "lossybig", "shutbig" and "busybig"
+
+// the page the browser asks for
+static const char* bigExpected () {
+    return bigPages % 3 == 2 ? footerText : bigPage;
+}
+
+static uint16_t bigExpectedLen () {
+    return bigPages % 3 == 2 ? sizeof footerText - 1 : sizeof bigPage;
+}
+
+// the server side of the "bigpage" browser: take what arrives in order and
+// compare it with the page; returns false if the segment got lost
+static bool bigServerSent (const uint8_t* ip, const uint8_t* tcp) {
+    uint16_t dlen = get16(ip + 2) - 20 - (tcp[12] >> 4) * 4;
+    uint8_t flags = tcp[13];
+    BigStats& stats = bigStats[bigScenario];
+    if (bigShutDone && (bigShut || bigProbed) && dlen) {
+        ++bigProbes; // beyond the shut window, not taken
+        bigProbed = true;
+        return true;
+    }
+    if (bigLossEvery && (dlen || (flags & TCP_FLAGS_FIN_V)) && ++bigSegments % bigLossEvery == 0) {
+        ++stats.lost;
+        return false;
+    }
+    if (flags & TCP_FLAGS_SYN_V) {
+        bigServerNext = get32(tcp + 4) + 1;
+        bigSynAck = true;
+    } else if (get32(tcp + 4) == bigServerNext && (dlen || (flags & TCP_FLAGS_FIN_V))) {
+        const uint8_t* data = tcp + (tcp[12] >> 4) * 4;
+        if (bigReceived + dlen > bigExpectedLen() ||
+                memcmp(data, bigExpected() + bigReceived, dlen) != 0)
+            ++stats.corrupt;
+        bigReceived += dlen;
+        bigServerNext += dlen + ((flags & TCP_FLAGS_FIN_V) ? 1 : 0);
+        bigFin = flags & TCP_FLAGS_FIN_V;
+    }
+    return true;
+}
+
+// check the server side of the "clients" connections, then hand the frame to the peer
+static void transmitted (const uint8_t* frame, uint16_t len, void* ctx) {
+    const uint8_t* ip = frame + ETH_HEADER_LEN;
+    const uint8_t* tcp = ip + 20;
+    if (len > ETH_HEADER_LEN + 40 && ip[9] == IP_PROTO_TCP_V && tcp[0] == 11)
+        clientSent(ip, tcp); // 2816-3071 are client ports
+    if (len > ETH_HEADER_LEN + 40 && ip[9] == IP_PROTO_TCP_V && get16(tcp) == 80 &&
+            get16(tcp + 2) == lossyPort && !lossyServerSent(ip, tcp))
+        return;
+    if (len > ETH_HEADER_LEN + 40 && ip[9] == IP_PROTO_TCP_V && get16(tcp) == 80 &&
+            get16(tcp + 2) == bigPort && !bigServerSent(ip, tcp))
+        return;
+    if (len > ETH_HEADER_LEN + 40 && ip[9] == IP_PROTO_TCP_V && get16(tcp) == 80 &&
+            get16(tcp + 2) >= CLIENT_PORT && get16(tcp + 2) < CLIENT_PORT + 0x1000) {
+        uint8_t c = (get16(tcp + 2) - CLIENT_PORT) % 4;
+        uint32_t seq = get32(tcp + 4);
+        uint8_t flags = tcp[13];
+        uint16_t dlen = get16(ip + 2) - 20 - (tcp[12] >> 4) * 4;
+        if (!(flags & TCP_FLAGS_SYN_V) && seq != serverNext[c])
+            ++outOfSequence;
+        if (dlen > clientMss[c])
+            ++overMss;
+        serverNext[c] = seq + dlen + ((flags & (TCP_FLAGS_SYN_V | TCP_FLAGS_FIN_V)) ? 1 : 0);
+    }
+    NetPeer::receive(frame, len, ctx);
+}
+
+static void clients (uint32_t i) {
+    static const char get[] = "GET / HTTP/1.0\r\nHost: 192.168.1.203\r\n\r\n";
+    uint8_t c = i % 4;
+    ether.packetFlush(); // the browser has seen all the server sent so far
+    uint16_t port = CLIENT_PORT + ((i / 12 * 4 + c) & 0xFFF);
+    switch (i / 4 % 3) {
+    case 0:
+        peer.tcp(mymac, myip, port, 80, 5000, 0, TCP_FLAGS_SYN_V, 0, 0, clientMss[c]);
+        break;
+    case 1:
+        peer.tcp(mymac, myip, port, 80, 5001, serverNext[c],
+                 TCP_FLAGS_ACK_V | TCP_FLAGS_PUSH_V, get, sizeof get - 1);
+        break;
+    default:
+        peer.tcp(mymac, myip, port, 80, 5001 + sizeof get - 1, serverNext[c],
+                 TCP_FLAGS_ACK_V | TCP_FLAGS_FIN_V, 0, 0);
+    }
+    chip.receive(peer.frame, peer.frameLen);
+}
+
+// one step of the "bigpage" browser
+static void bigfetch (uint32_t i) {
+    static const char* const gets[] = {
+        "GET /big HTTP/1.0\r\n\r\n", "GET /bigfill HTTP/1.0\r\n\r\n", "GET /footer HTTP/1.0\r\n\r\n"
+    };
+    const char* get = gets[bigPages % 3];
+    BigStats& stats = bigStats[bigScenario];
+    ether.packetFlush();
+    if (i == 0 && bigPhase) {
+        // a new scenario, the browser gives up on the page of the previous one
+        bigPort = BIG_PORT + (bigPort + 1 - BIG_PORT) % 1000;
+        bigPhase = 0;
+    }
+    if (bigPhase == 0) {
+        bigSynAck = bigFin = false;
+        bigShutDone = bigProbed = false;
+        bigShut = 0;
+        bigReceived = 0;
+        peer.tcp(mymac, myip, bigPort, 80, 9000, 0, TCP_FLAGS_SYN_V, 0, 0,
+                 bigPages % 3 == 2 ? 40 : 1460);
+        bigPhase = 1;
+        bigStart = i;
+    } else if (bigPhase == 1 && bigSynAck) {
+        peer.tcp(mymac, myip, bigPort, 80, 9001, bigServerNext,
+                 TCP_FLAGS_ACK_V | TCP_FLAGS_PUSH_V, get, strlen(get));
+        bigPhase = 2;
+        bigLastAck = bigServerNext;
+    } else if (bigPhase == 2 && bigFin) {
+        peer.tcp(mymac, myip, bigPort, 80, 9001 + strlen(get), bigServerNext,
+                 TCP_FLAGS_ACK_V | TCP_FLAGS_FIN_V, 0, 0);
+        if (bigReceived != bigExpectedLen())
+            ++stats.corrupt;
+        ++bigPages;
+        ++stats.pages;
+        stats.loops += i - bigStart;
+        bigPort = BIG_PORT + (bigPort + 1 - BIG_PORT) % 1000;
+        bigPhase = 0;
+    } else if (bigPhase == 2 && bigShutDone && (bigShut || bigProbed)) {
+        // the window opens silently, only a probe learns of it
+        if (bigShut)
+            --bigShut;
+        if (!bigProbed)
+            return;
+        bigProbed = false;
+        peer.window = bigShut ? 0 : 8192;
+        peer.tcp(mymac, myip, bigPort, 80, 9001 + strlen(get), bigServerNext,
+                 TCP_FLAGS_ACK_V, 0, 0);
+        peer.window = 8192;
+        bigLastAck = bigServerNext;
+    } else if (bigPhase == 2 && bigServerNext != bigLastAck) {
+        if (bigScenario == 2 && !bigShutDone) {
+            bigShutDone = true;
+            bigShut = 40;
+            peer.window = 0;
+        }
+        peer.tcp(mymac, myip, bigPort, 80, 9001 + strlen(get), bigServerNext,
+                 TCP_FLAGS_ACK_V, 0, 0);
+        peer.window = 8192;
+        bigLastAck = bigServerNext;
+    } else {
+        if (i - bigStart == 1000) {
+            ++stats.stalled;
+            bigPort = BIG_PORT + (bigPort + 1 - BIG_PORT) % 1000;
+            bigPhase = 0;
+        }
+        return;
+    }
+    chip.receive(peer.frame, peer.frameLen);
+}
+
+static void bigpage (uint32_t i) {
+    bigScenario = 0;
+    bigLossEvery = 0;
+    bigfetch(i);
+}
+
+// the same over a lossy network, where every seventh segment of the server
+// with data or FIN gets lost; a loop takes 50 ms
+static void lossybig (uint32_t i) {
+    delay(50);
+    bigScenario = 1;
+    bigLossEvery = 7;
+    bigfetch(i);
+}
+
+// the same where other traffic keeps the stack from ever being idle, so that it
+// has to run its retransmission timers between frames
+static void busybig (uint32_t i) {
+    delay(50);
+    bigScenario = 3;
+    bigLossEvery = 7;
+    bigfetch(i);
+    if (!chip.pendingFrames())
+        broadcast(i);
+}
+
+// the browser shuts its window after the first data of a page for 4 s, the
+// server has to probe it to learn that it opened again; a loop takes 100 ms
+static void shutbig (uint32_t i) {
+    delay(100);
+    bigScenario = 2;
+    bigLossEvery = 0;
+    bigfetch(i);
+}
+
+// every twelfth loop the sketch posts telemetry to two collectors and polls a
+// config server, all three sessions at once; in between the servers answer,
+// first with SYN and ACK, then with the reply and FIN, then with the last ACK
+static void sessions (uint32_t i) {
+    ether.packetFlush(); // the servers have seen all the sketch sent so far
+    lossEvery = 0;
+    if (i % 12 == 0) {
+        ether.clientTcpReq(sessionResult, sessionFill, 80, peerip);
+        ether.clientTcpReq(sessionResult, sessionFill, 80, collectorip);
+        ether.clientTcpReq(sessionResult, sessionFill, 8080, peerip);
+        sessionRequests += 3;
+    } else {
+        sessionAnswer();
+    }
+    if (ether.tcpClientSessions() > sessionPeak)
+        sessionPeak = ether.tcpClientSessions();
+}
+
+// the same servers on a lossy network: they miss every fifth segment of the
+// client, which has to send it again; a loop takes 50 ms
+static void lossy (uint32_t i) {
+    static const uint8_t* const ips[] = { peerip, collectorip, peerip };
+    delay(50);
+    ether.packetFlush();
+    lossEvery = 5;
+    if (i % 12 == 0) {
+        ether.clientTcpReq(sessionResult, sessionFill, i % 36 == 24 ? 8080 : 80, ips[i / 12 % 3]);
+        ++sessionRequests;
+    } else {
+        sessionAnswer();
+    }
+}
+
+static void lossyweb (uint32_t) {
+    static const char get[] = "GET / HTTP/1.0\r\nHost: 192.168.1.203\r\n\r\n";
+    delay(100);
+    ether.packetFlush();
+    lossEvery = 0;
+    sessionAnswer(); // what is left of the "lossy" sessions
+    if (lossyPhase == 0) {
+        lossySynAck = lossyReply = false;
+        peer.tcp(mymac, myip, lossyPort, 80, 9000, 0, TCP_FLAGS_SYN_V, 0, 0, 1460);
+        lossyPhase = 1;
+        lossyWait = 0;
+    } else if (lossyPhase == 1 && lossySynAck) {
+        peer.tcp(mymac, myip, lossyPort, 80, 9001, lossyServerNext,
+                 TCP_FLAGS_ACK_V | TCP_FLAGS_PUSH_V, get, sizeof get - 1);
+        lossyPhase = 2;
+        lossyWait = 0;
+    } else if (lossyPhase == 2 && lossyReply) {
+        peer.tcp(mymac, myip, lossyPort, 80, 9001 + sizeof get - 1, lossyServerNext,
+                 TCP_FLAGS_ACK_V | TCP_FLAGS_FIN_V, 0, 0);
+        ++lossyPages;
+        lossyPort = LOSSY_PORT + (lossyPort + 1 - LOSSY_PORT) % 1000;
+        lossyPhase = 0;
+    } else if (++lossyWait == 30) {
+        if (lossyPhase == 2)
+            peer.tcp(mymac, myip, lossyPort, 80, 9001, lossyServerNext,
+                     TCP_FLAGS_ACK_V | TCP_FLAGS_PUSH_V, get, sizeof get - 1);
+        else
+            lossyPhase = 0;
+        lossyWait = 0;
+        if (lossyPhase == 0)
+            return;
+    } else {
+        return;
+    }
+    chip.receive(peer.frame, peer.frameLen);
+}
+
+// beacons are periodic, the previous one is long gone when the next is due
+static void sendBeacon (uint32_t) {
+    delay(1);
+    beacon = 1;
+}
+
+static void sendTemplate (uint32_t) {
+    delay(1);
+    beacon = 2;
+}
+
+#if ETHERCARD_INTERFACES > 1
+// a datagram from the first subnet to a host on the second one
+static void route (uint32_t i) {
+    peer.udp(mymac, peer2ip, 4000, 5001, &i, sizeof i);
+    chip.receive(peer.frame, peer.frameLen);
+}
+#endif
+
+// every tenth frame runs into a late collision, see --retries
+static void sendAsync (uint32_t i) {
+    delay(1);
+    if (i % 10 == 0)
+        chip.lateCollisions(1);
+    beacon = 3;
+}
+
+static const struct {
+    const char* name;
+    const ENC28J60Layout* layout;
+} layouts[] = {
+    { "default", &ENC28J60::layoutDefault },
+    { "sink",    &ENC28J60::layoutSensorSink },
+    { "web",     &ENC28J60::layoutWebServer },
+    { "client",  &ENC28J60::layoutHttpClient },
+    { "pool",    &ENC28J60::layoutBufferPool },
+};
+
+static const struct {
+    const char* name;
+    Scenario inject;
+} scenarios[] = {
+    { "idle",      idle },
+    { "flap",      flap },
+    { "arp",       arp },
+    { "ping64",    ping64 },
+    { "ping1k",    ping1k },
+    { "corrupt",   corrupt },
+    { "udp",       udp },
+    { "burst",     burst },
+    { "broadcast", broadcast },
+    { "mcast",     mcast },
+    { "syn",       syn },
+    { "http",      http },
+    { "multi",     multi },
+    { "stream",    stream },
+    { "bigpage",   bigpage },
+    { "clients",   clients },
+    { "sessions",  sessions },
+    { "beacon",    sendBeacon },
+    { "template",  sendTemplate },
+    { "async",     sendAsync },
+    { "park",      park },
+    { "bigudp",    bigudp },
+    { "lossy",     lossy },
+    { "lossyweb",  lossyweb },
+    { "lossybig",  lossybig },
+    { "shutbig",   shutbig },
+    { "busybig",   busybig },
+#if ETHERCARD_INTERFACES > 1
+    { "route",     route },
+#endif
+};
+
+static void run (const char* name, Scenario inject, uint32_t iterations) {
+    // start with an empty receive ring, whatever the previous scenario left
+    while (chip.pendingFrames())
+        sketchLoop();
+    chip.resetStats();
+    peer.replies = 0;
+    peer.badChecksums = 0;
+    memset(&ether.rxStats, 0, sizeof ether.rxStats);
+    memset(&ether.filterStats, 0, sizeof ether.filterStats);
+    uint64_t bus = 0, wall = 0;
+    for (uint32_t i = 0; i < iterations; ++i) {
+        inject(i);
+        uint64_t b0 = hostClockNanos(), w0 = wallNanos();
+        sketchLoop();
+        wall += wallNanos() - w0;
+        bus += hostClockNanos() - b0;
+    }
+    chip.setLink(true);
+    ether.packetFlush();
+#if ETHERCARD_INTERFACES > 1
+    ether.selectInterface(1);
+    ether.packetFlush();
+    ether.selectInterface(0);
+#endif
+    const ENC28J60Model::Stats& s = chip.stats();
+    printf("%-10s %8u %9.1f %8.1f %10.1f %10.1f %8u %8u %8u %8u %8u %8u\n", name, iterations,
+           (double) s.spiBytes / iterations, (double) s.transactions / iterations,
+           bus / 1000.0 / iterations, (double) wall / iterations,
+           s.rxDropped + s.rxFiltered, peer.replies, peer.badChecksums,
+           ether.rxStats.overflows + ether.rxStats.resets, ether.filterStats.misses,
+           s.pauseFrames);
+}
+
+int main (int argc, char** argv) {
+    bool irq = false;
+    bool filters = false;
+    uint8_t retries = 0;
+    uint16_t bufferSize = sizeof Ethernet::buffer;
+    const ENC28J60Layout* layout = &ENC28J60::layoutDefault;
+    while (argc > 1 && strncmp(argv[1], "--", 2) == 0) {
+        if (strcmp(argv[1], "--irq") == 0)
+            irq = true;
+        else if (strcmp(argv[1], "--filters") == 0)
+            filters = true;
+        else if (strcmp(argv[1], "--retries") == 0 && argc > 2) {
+            retries = strtoul(argv[2], 0, 0);
+            --argc;
+            ++argv;
+        }
+        else if (strcmp(argv[1], "--buffer") == 0 && argc > 2) {
+            bufferSize = strtoul(argv[2], 0, 0);
+            if (bufferSize > sizeof Ethernet::buffer)
+                bufferSize = sizeof Ethernet::buffer;
+            --argc;
+            ++argv;
+        } else if (strcmp(argv[1], "--drain") == 0 && argc > 2) {
+            drainFrames = strtoul(argv[2], 0, 0);
+            --argc;
+            ++argv;
+        } else if (strcmp(argv[1], "--layout") == 0 && argc > 2) {
+            layout = 0;
+            for (size_t n = 0; n < sizeof layouts / sizeof layouts[0]; ++n)
+                if (strcmp(argv[2], layouts[n].name) == 0)
+                    layout = layouts[n].layout;
+            if (!layout) {
+                fprintf(stderr, "unknown layout %s\n", argv[2]);
+                return 1;
+            }
+            --argc;
+            ++argv;
+        }
+        --argc;
+        ++argv;
+    }
+    uint32_t iterations = argc > 1 ? strtoul(argv[1], 0, 0) : 1000;
+    const char* only = argc > 2 ? argv[2] : 0;
+
+    ENC28J60::setTransport(&chip);
+    chip.onTransmit(transmitted, &peer);
+    if (ether.begin(bufferSize, mymac, SS, *layout) == 0) {
+        fprintf(stderr, "failed to initialise the ENC28J60 model\n");
+        return 1;
+    }
+    ether.setLateCollisionRetries(retries);
+    if (irq) {
+        chip.onInterrupt(intPinFell);
+        ether.enableInterrupt(2);
+    }
+    ether.staticSetup(myip, gwip);
+    ether.udpServerListenOnPort(udpHandler, 1337);
+    ether.udpServerListenOnPort(parkHandler, 1338);
+    ether.udpServerListenOnPort(bigHandler, 1339);
+    static const char header[] = "HTTP/1.0 200 OK\r\nContent-Type: text/plain\r\n\r\n";
+    memcpy(bigPage, header, sizeof header - 1);
+    for (size_t n = sizeof header - 1; n < sizeof bigPage; ++n)
+        bigPage[n] = n % 64 == 63 ? '\n' : 'a' + n % 26;
+    Stash stash;
+    footer = stash.create();
+    stash.print(footerText);
+    stash.save();
+    footerLen = stash.size();
+
+    ether.udpPrepare(1337, peerip, 5001);
+    memcpy(ether.buffer + ETH_HEADER_LEN + sizeof(IpHeader) + sizeof(UdpHeader), beaconMsg, sizeof beaconMsg - 1);
+    beaconTmpl = ether.udpTemplate(sizeof beaconMsg - 1);
+
+    static const uint8_t ssdp[] = { 239,255,255,250 };
+    ether.joinMulticastGroup(ssdp);
+    if (filters)
+        ether.enableFilters();
+
+#if ETHERCARD_INTERFACES > 1
+    // forwarded frames count as replies; the host behind the second
+    // interface announces itself so the first datagram finds its MAC
+    ether.selectInterface(1);
+    ENC28J60::setTransport(&chip2);
+    chip2.onTransmit(NetPeer::receive, &peer);
+    ether.begin(bufferSize, mac2, SS, *layout);
+    ether.staticSetup(ip2, 0, 0, mask2);
+    ether.selectInterface(0);
+    ether.enableForwarding();
+    peer2.arpReply(mac2, ip2);
+    chip2.receive(peer2.frame, peer2.frameLen);
+#endif
+
+    // the stack looks for the gateway first; answer it so later loops stay quiet
+    sketchLoop();
+    peer.arpReply(mymac, myip);
+    memcpy(peer.frame + ETH_HEADER_LEN + 14, gwip, IP_LEN);
+    chip.receive(peer.frame, peer.frameLen);
+    sketchLoop();
+    // so do the servers of the "sessions" client
+    peer.arpReply(mymac, myip);
+    chip.receive(peer.frame, peer.frameLen);
+    sketchLoop();
+    collector.arpReply(mymac, myip);
+    chip.receive(collector.frame, collector.frameLen);
+    sketchLoop();
+
+    printf("%-10s %8s %9s %8s %10s %10s %8s %8s %8s %8s %8s %8s\n", "scenario", "frames",
+           "spiB/frm", "txn/frm", "bus us/frm", "wall ns", "dropped", "replies", "badsum",
+           "rxerr", "misses", "pause");
+    for (size_t n = 0; n < sizeof scenarios / sizeof scenarios[0]; ++n)
+        if (!only || strcmp(only, scenarios[n].name) == 0)
+            run(scenarios[n].name, scenarios[n].inject, iterations);
+    printf("heap: %u bytes free, largest block %u, %u fragments, %u datagrams not parked\n",
+           ether.enc_freemem(), ether.enc_maxfree(), ether.enc_fragments(), parkFailed);
+    const ENC28J60::TxStats& tx = ether.txStats;
+    printf("tx: %u frames, %u errors, %u timeouts, %u sampled, %u bytes, %u collisions",
+           tx.frames, tx.errors, tx.timeouts, tx.sampled, (unsigned) tx.bytes, tx.collisions);
+#if ETHERCARD_TX_WAITS
+    printf(", waits");
+    for (uint8_t n = 0; n < sizeof tx.waits / sizeof tx.waits[0]; ++n)
+        printf(" %u", tx.waits[n]);
+#endif
+    printf("\n");
+    if (asyncSent + asyncFailed || asyncToken)
+        printf("async: %u sent, %u failed, last frame %s\n", asyncSent, asyncFailed,
+               ether.packetSendPending(asyncToken) ? "pending" : "done");
+    printf("tcp: %u connections open, %u server segments out of sequence, %u over the MSS\n",
+           ether.tcpServerConnections(), outOfSequence, overMss);
+    if (sessionRequests)
+        printf("client: %u requests, %u answered, %u failed, at most %u sessions open, %u segments lost\n",
+               sessionRequests, sessionAnswers, sessionFailures, sessionPeak, clientLost);
+    static const char* const bigNames[] = { "bigpage", "lossybig", "shutbig", "busybig" };
+    for (uint8_t n = 0; n < 4; ++n)
+        if (bigStats[n].pages || bigStats[n].stalled)
+            printf("%s: %u pages, %.1f loops each, %u corrupt, %u stalled, %u segments lost\n",
+                   bigNames[n], bigStats[n].pages,
+                   bigStats[n].pages ? (double) bigStats[n].loops / bigStats[n].pages : 0.0,
+                   bigStats[n].corrupt, bigStats[n].stalled, bigStats[n].lost);
+    if (bigProbes)
+        printf("shutbig: %u segments beyond the shut window\n", bigProbes);
+    if (lossyServerSegments)
+        printf("lossyweb: %u pages, %u server segments lost\n",
+               lossyPages, lossyServerSegments / 3);
+    if (udpCount)
+        printf("udp: %u datagrams, %.1f us from arrival to callback\n",
+               udpCount, (double) udpLatency / udpCount);
+#if ETHERCARD_INTERFACES > 1
+    printf("forwarding: %u forwarded, %u dropped\n",
+           (unsigned) ether.forwardStats.forwarded, (unsigned) ether.forwardStats.dropped);
+#endif
+    uint32_t broken = outOfSequence + overMss + sessionFailures;
+    for (uint8_t n = 0; n < 4; ++n)
+        broken += bigStats[n].corrupt + bigStats[n].stalled;
+    if (broken) {
+        fprintf(stderr, "%u failures\n", broken);
+        return 1;
+    }
+    return 0;
+}
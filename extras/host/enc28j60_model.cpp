@@ -0,0 +1,738 @@
+// Software model of the Microchip ENC28J60 for host builds.
+// Register map, reset values and buffer semantics follow the ENC28J60
+// data sheet (DS39662) and the Rev. B7 errata.
+//
+// Copyright: GPL V2
+
+#include "enc28j60_model.h"
+
+// common registers, present in every bank
+#define EIE             0x1B
+#define EIR             0x1C
+#define ESTAT           0x1D
+#define ECON2           0x1E
+#define ECON1           0x1F
+// bank 0
+#define ERDPTL          0x00
+#define EWRPTL          0x02
+#define ETXSTL          0x04
+#define ETXNDL          0x06
+#define ERXSTL          0x08
+#define ERXNDL          0x0A
+#define ERXRDPTL        0x0C
+#define ERXWRPTL        0x0E
+#define EDMASTL         0x10
+#define EDMANDL         0x12
+#define EDMADSTL        0x14
+#define EDMACSL         0x16
+// bank 1
+#define EHT0            0x00
+#define EPMM0           0x08
+#define EPMCSL          0x10
+#define EPMOL           0x14
+#define ERXFCON         0x18
+#define EPKTCNT         0x19
+// bank 2
+#define MACON1          0x00
+#define MACON3          0x02
+#define MAMXFLL         0x0A
+#define MICMD           0x12
+#define MIREGADR        0x14
+#define MIWRL           0x16
+#define MIWRH           0x17
+#define MIRDL           0x18
+#define MIRDH           0x19
+// bank 3
+#define EBSTCON         0x07
+#define EBSTCSL         0x08
+#define MISTAT          0x0A
+#define EREVID          0x12
+#define ECOCON          0x15
+#define EFLOCON         0x17
+#define EPAUSL          0x18
+#define EPAUSH          0x19
+
+#define EIR_PKTIF       0x40
+#define EIR_DMAIF       0x20
+#define EIR_LINKIF      0x10
+#define EIR_TXIF        0x08
+#define EIR_TXERIF      0x02
+#define EIR_RXERIF      0x01
+#define EIE_INTIE       0x80
+#define ESTAT_INT       0x80
+#define ESTAT_CLKRDY    0x01
+#define ECON2_AUTOINC   0x80
+#define ECON2_PKTDEC    0x40
+#define ECON2_PWRSV     0x20
+#define ECON1_TXRST     0x80
+#define ECON1_RXRST     0x40
+#define ECON1_DMAST     0x20
+#define ECON1_CSUMEN    0x10
+#define ECON1_TXRTS     0x08
+#define ECON1_RXEN      0x04
+#define MACON1_MARXEN   0x01
+#define MACON3_PADCFG0  0x20
+#define MACON3_TXCRCEN  0x10
+#define MACON3_FULDPX   0x01
+#define EFLOCON_FCEN    0x03
+#define MICMD_MIIRD     0x01
+#define MISTAT_BUSY     0x01
+#define EBSTCON_TMSEL   0x0C
+#define EBSTCON_TME     0x02
+#define EBSTCON_BISTST  0x01
+#define ERXFCON_UCEN    0x80
+#define ERXFCON_ANDOR   0x40
+#define ERXFCON_PMEN    0x10
+#define ERXFCON_MPEN    0x08
+#define ERXFCON_HTEN    0x04
+#define ERXFCON_MCEN    0x02
+#define ERXFCON_BCEN    0x01
+
+#define PHCON1          0x00
+#define PHSTAT1         0x01
+#define PHID1           0x02
+#define PHID2           0x03
+#define PHCON2          0x10
+#define PHSTAT2         0x11
+#define PHIE            0x12
+#define PHIR            0x13
+#define PHLCON          0x14
+#define PHCON1_PDPXMD   0x0100
+#define PHSTAT1_LLSTAT  0x0004
+#define PHSTAT2_LSTAT   0x0400
+#define PHSTAT2_DPXSTAT 0x0200
+#define PHIE_PLNKIE     0x0010
+#define PHIE_PGEIE      0x0002
+#define PHIR_PLNKIF     0x0010
+#define PHIR_PGIF       0x0004
+
+#define RSV_RXOK        0x0080
+#define RSV_MULTICAST   0x0100
+#define RSV_BROADCAST   0x0200
+
+#define MIN_FRAMELEN    60      // without CRC
+#define WIRE_BYTE_NS    800     // 10 Mbit/s
+#define WIRE_OVERHEAD   (8 + 4 + 12) // preamble, CRC and inter packet gap
+#define DMA_BYTE_NS     80      // one byte per two instruction cycles at 25 MHz
+#define MII_NS          10240   // MII management operation
+
+static uint16_t checksum (const uint8_t* data, uint16_t len) {
+    uint32_t sum = 0;
+    for (uint16_t i = 0; i + 1 < len; i += 2)
+        sum += (data[i] << 8) | data[i+1];
+    if (len & 1)
+        sum += data[len-1] << 8;
+    while (sum >> 16)
+        sum = (sum & 0xFFFF) + (sum >> 16);
+    return ~sum;
+}
+
+static uint32_t crc32 (const uint8_t* data, uint16_t len) {
+    uint32_t crc = 0xFFFFFFFF;
+    while (len--) {
+        crc ^= *data++;
+        for (uint8_t i = 0; i < 8; ++i)
+            crc = (crc >> 1) ^ (crc & 1 ? 0xEDB88320 : 0);
+    }
+    return ~crc;
+}
+
+ENC28J60Model::ENC28J60Model () :
+    selected (false), txFailures (0), spiByteNanos (1000), txHandler (0), txContext (0),
+    intHandler (0), intContext (0), intLevel (false) {
+    powerOnReset();
+}
+
+void ENC28J60Model::powerOnReset () {
+    memset(mem, 0, sizeof mem);
+    memset(phy, 0, sizeof phy);
+    phy[PHSTAT1] = 0x1800;
+    phy[PHID1] = 0x0083;
+    phy[PHID2] = 0x1400;
+    phy[PHLCON] = 0x3422;
+    phy[PHSTAT2] = PHSTAT2_LSTAT;
+    resetStats();
+    systemReset();
+}
+
+// SPI "system reset" command; leaves the PHY and the buffer memory alone
+void ENC28J60Model::systemReset () {
+    memset(regs, 0, sizeof regs);
+    setReg16(0, ERDPTL, 0x05FA);
+    setReg16(0, ERXSTL, 0x05FA);
+    setReg16(0, ERXNDL, 0x1FFF);
+    setReg16(0, ERXRDPTL, 0x05FA);
+    reg(0, ECON2) = ECON2_AUTOINC;
+    reg(0, ESTAT) = ESTAT_CLKRDY;
+    reg(1, ERXFCON) = 0xA1;
+    setReg16(2, MAMXFLL, 0x0600);
+    reg(2, 0x08) = 0x0F; // MACLCON1
+    reg(2, 0x09) = 0x37; // MACLCON2
+    reg(3, EREVID) = 0x06;
+    reg(3, ECOCON) = 0x04;
+    reg(3, EPAUSH) = 0x10;
+    pktcnt = 0;
+    rxWritePtr = 0;
+    partnerPaused = false;
+    op = OP_NONE;
+    txBusy = dmaBusy = miiBusy = false;
+}
+
+uint8_t& ENC28J60Model::reg (uint8_t b, uint8_t addr) {
+    return addr >= EIE ? regs[0][addr] : regs[b][addr];
+}
+
+uint16_t ENC28J60Model::reg16 (uint8_t b, uint8_t addr) {
+    return reg(b, addr) | (reg(b, addr + 1) << 8);
+}
+
+void ENC28J60Model::setReg16 (uint8_t b, uint8_t addr, uint16_t value) {
+    reg(b, addr) = value;
+    reg(b, addr + 1) = value >> 8;
+}
+
+bool ENC28J60Model::isMacMii (uint8_t addr) const {
+    if (addr >= EIE)
+        return false;
+    switch (bank()) {
+    case 2:
+        return true;
+    case 3:
+        return addr <= 0x05 || addr == MISTAT;
+    }
+    return false;
+}
+
+void ENC28J60Model::onTransmit (TransmitHandler handler, void* ctx) {
+    txHandler = handler;
+    txContext = ctx;
+}
+
+void ENC28J60Model::corruptLastFrame () {
+    mem[rxLastFrame] ^= 0x5A;
+    mem[rxWrap(rxLastFrame + 1)] ^= 0x03;
+}
+
+void ENC28J60Model::onInterrupt (InterruptHandler handler, void* ctx) {
+    intHandler = handler;
+    intContext = ctx;
+}
+
+void ENC28J60Model::spiClock () {
+    ++counters.spiBytes;
+    hostClockAdvance(spiByteNanos);
+    tick();
+}
+
+void ENC28J60Model::select () {
+    selected = true;
+    op = OP_NONE;
+    opCount = 0;
+    ++counters.transactions;
+}
+
+void ENC28J60Model::deselect () {
+    selected = false;
+    op = OP_NONE;
+    updateInterrupt();
+}
+
+uint8_t ENC28J60Model::transfer (uint8_t data) {
+    spiClock();
+    if (!selected)
+        return 0xFF;
+
+    switch (op) {
+    case OP_NONE:
+        opArg = data & 0x1F;
+        if (data == 0xFF) {
+            systemReset();
+            op = OP_DONE;
+            break;
+        }
+        switch (data & 0xE0) {
+        case 0x00: op = OP_RCR; break;
+        case 0x20: op = OP_RBM; break;
+        case 0x40: op = OP_WCR; break;
+        case 0x60: op = OP_WBM; break;
+        case 0x80: op = OP_BFS; break;
+        case 0xA0: op = OP_BFC; break;
+        default:   op = OP_DONE; break;
+        }
+        break;
+    case OP_RCR:
+        // MAC and MII registers shift out a dummy byte first
+        if (++opCount == 1 && isMacMii(opArg))
+            return 0;
+        return readRegister(opArg);
+    case OP_RBM:
+        return readMemory();
+    case OP_WCR:
+        writeRegister(opArg, data);
+        op = OP_DONE;
+        break;
+    case OP_WBM:
+        writeMemory(data);
+        break;
+    case OP_BFS:
+        bitFieldSet(opArg, data);
+        op = OP_DONE;
+        break;
+    case OP_BFC:
+        bitFieldClear(opArg, data);
+        op = OP_DONE;
+        break;
+    case OP_DONE:
+        break;
+    }
+    return 0;
+}
+
+void ENC28J60Model::readBytes (uint16_t len, uint8_t* data) {
+    if (op != OP_RBM || !selected) {
+        ENC28J60Transport::readBytes(len, data);
+        return;
+    }
+    counters.spiBytes += len;
+    hostClockAdvance((uint64_t) len * spiByteNanos);
+    while (len--)
+        *data++ = readMemory();
+    tick();
+}
+
+void ENC28J60Model::writeBytes (uint16_t len, const uint8_t* data) {
+    if (op != OP_WBM || !selected) {
+        ENC28J60Transport::writeBytes(len, data);
+        return;
+    }
+    counters.spiBytes += len;
+    hostClockAdvance((uint64_t) len * spiByteNanos);
+    while (len--)
+        writeMemory(*data++);
+    tick();
+}
+
+uint8_t ENC28J60Model::readRegister (uint8_t addr) {
+    uint8_t b = bank();
+    switch (addr) {
+    case EIR: {
+        uint8_t v = reg(b, EIR) & ~(EIR_PKTIF | EIR_LINKIF);
+        if (pktcnt > 0)
+            v |= EIR_PKTIF;
+        if (phy[PHIR] & PHIR_PGIF)
+            v |= EIR_LINKIF;
+        return v;
+    }
+    case ESTAT:
+        return (reg(b, ESTAT) & ~ESTAT_INT) | (interruptAsserted() ? ESTAT_INT : 0);
+    }
+    if (b == 0 && addr == ERXWRPTL)
+        return rxWritePtr;
+    if (b == 0 && addr == ERXWRPTL + 1)
+        return rxWritePtr >> 8;
+    if (b == 1 && addr == EPKTCNT)
+        return pktcnt;
+    if (b == 3 && addr == MISTAT)
+        return miiBusy ? MISTAT_BUSY : 0;
+    return reg(b, addr);
+}
+
+void ENC28J60Model::writeRegister (uint8_t addr, uint8_t value) {
+    uint8_t b = bank();
+    switch (addr) {
+    case ECON1: {
+        uint8_t prev = reg(b, ECON1);
+        reg(b, ECON1) = value;
+        updateEcon1(prev);
+        return;
+    }
+    case ECON2:
+        reg(b, ECON2) = value;
+        updateEcon2();
+        return;
+    case EIR:
+        reg(b, EIR) = value & ~(EIR_PKTIF | EIR_LINKIF);
+        return;
+    case ESTAT:
+        return; // only cleared through BFC
+    }
+    if (b == 0 && (addr == ERXWRPTL || addr == ERXWRPTL + 1))
+        return;
+    if (b == 1 && addr == EPKTCNT)
+        return;
+    if (b == 3 && (addr == MISTAT || addr == EREVID))
+        return;
+
+    reg(b, addr) = value;
+
+    if (b == 0 && (addr == ERXSTL || addr == ERXSTL + 1))
+        rxWritePtr = reg16(0, ERXSTL);
+    if (b == 2 && addr == MICMD && (value & MICMD_MIIRD)) {
+        miiBusy = miiRead = true;
+        miiDoneAt = hostClockNanos() + MII_NS;
+    }
+    if (b == 2 && addr == MIWRH) {
+        miiBusy = true;
+        miiRead = false;
+        miiDoneAt = hostClockNanos() + MII_NS;
+    }
+    if (b == 3 && addr == EFLOCON && (reg(2, MACON3) & MACON3_FULDPX))
+        flowControl(value & EFLOCON_FCEN);
+    if (b == 3 && addr == EBSTCON && (value & EBSTCON_TME) && (value & EBSTCON_BISTST)) {
+        // self test fills the memory and computes its checksum instantly
+        for (uint16_t a = 0; a < sizeof mem; ++a)
+            mem[a] = (value & EBSTCON_TMSEL) == 0x04 ? (uint8_t) a : (uint8_t) random();
+        setReg16(3, EBSTCSL, checksum(mem, sizeof mem));
+        reg(3, EBSTCON) &= ~EBSTCON_BISTST;
+    }
+}
+
+void ENC28J60Model::bitFieldSet (uint8_t addr, uint8_t mask) {
+    writeRegister(addr, reg(bank(), addr) | mask);
+}
+
+void ENC28J60Model::bitFieldClear (uint8_t addr, uint8_t mask) {
+    if (addr == ESTAT) {
+        reg(bank(), ESTAT) &= ~mask | ESTAT_CLKRDY;
+        return;
+    }
+    writeRegister(addr, reg(bank(), addr) & ~mask);
+}
+
+void ENC28J60Model::updateEcon1 (uint8_t prev) {
+    uint8_t& econ1 = reg(0, ECON1);
+    if (econ1 & ECON1_TXRST) {
+        txBusy = false;
+        econ1 &= ~ECON1_TXRTS;
+        return;
+    }
+    if (econ1 & ECON1_RXRST) {
+        pktcnt = 0;
+        rxWritePtr = reg16(0, ERXSTL);
+        econ1 &= ~ECON1_RXEN;
+    }
+    if ((econ1 & ECON1_TXRTS) && !(prev & ECON1_TXRTS))
+        startTransmit();
+    if (!(econ1 & ECON1_TXRTS) && (prev & ECON1_TXRTS))
+        txBusy = false; // transmission aborted by the host
+    if ((econ1 & ECON1_DMAST) && !(prev & ECON1_DMAST))
+        startDma();
+}
+
+void ENC28J60Model::updateEcon2 () {
+    uint8_t& econ2 = reg(0, ECON2);
+    if (econ2 & ECON2_PKTDEC) {
+        if (pktcnt > 0)
+            --pktcnt;
+        econ2 &= ~ECON2_PKTDEC;
+    }
+}
+
+uint16_t ENC28J60Model::rxWrap (uint16_t addr) const {
+    uint16_t start = regs[0][ERXSTL] | (regs[0][ERXSTL + 1] << 8);
+    uint16_t end = regs[0][ERXNDL] | (regs[0][ERXNDL + 1] << 8);
+    if (addr > end && (uint16_t) (addr - end) <= end - start + 1)
+        addr -= end - start + 1;
+    return addr & 0x1FFF;
+}
+
+uint8_t ENC28J60Model::readMemory () {
+    uint16_t ptr = reg16(0, ERDPTL);
+    uint8_t value = mem[ptr & 0x1FFF];
+    if (ptr == reg16(0, ERXNDL))
+        ptr = reg16(0, ERXSTL);
+    else
+        ptr = (ptr + 1) & 0x1FFF;
+    setReg16(0, ERDPTL, ptr);
+    return value;
+}
+
+void ENC28J60Model::writeMemory (uint8_t value) {
+    uint16_t ptr = reg16(0, EWRPTL);
+    mem[ptr & 0x1FFF] = value;
+    setReg16(0, EWRPTL, (ptr + 1) & 0x1FFF);
+}
+
+void ENC28J60Model::tick () {
+    uint64_t now = hostClockNanos();
+    if (miiBusy && now >= miiDoneAt)
+        finishMii();
+    if (dmaBusy && now >= dmaDoneAt)
+        finishDma();
+    if (txBusy && now >= txDoneAt)
+        finishTransmit();
+    updateInterrupt();
+}
+
+void ENC28J60Model::finishMii () {
+    miiBusy = false;
+    uint8_t addr = reg(2, MIREGADR) & 0x1F;
+    if (miiRead) {
+        uint16_t value = phy[addr];
+        setReg16(2, MIRDL, value);
+        if (addr == PHIR)
+            phy[PHIR] &= ~(PHIR_PGIF | PHIR_PLNKIF);
+        if (addr == PHSTAT1 && (phy[PHSTAT2] & PHSTAT2_LSTAT))
+            phy[PHSTAT1] |= PHSTAT1_LLSTAT; // latching low bit re-arms on read
+        return;
+    }
+    uint16_t value = reg16(2, MIWRL);
+    switch (addr) {
+    case PHCON1:
+        phy[PHCON1] = value & ~0x8000;
+        phy[PHSTAT2] = (phy[PHSTAT2] & ~PHSTAT2_DPXSTAT) |
+                       (value & PHCON1_PDPXMD ? PHSTAT2_DPXSTAT : 0);
+        break;
+    case PHCON2:
+    case PHIE:
+    case PHLCON:
+        phy[addr] = value;
+        break;
+    }
+}
+
+void ENC28J60Model::setLink (bool up) {
+    tick();
+    bool was = phy[PHSTAT2] & PHSTAT2_LSTAT;
+    if (was == up)
+        return;
+    if (up)
+        phy[PHSTAT2] |= PHSTAT2_LSTAT;
+    else {
+        phy[PHSTAT2] &= ~PHSTAT2_LSTAT;
+        phy[PHSTAT1] &= ~PHSTAT1_LLSTAT;
+    }
+    phy[PHIR] |= PHIR_PLNKIF;
+    if ((phy[PHIE] & PHIE_PGEIE) && (phy[PHIE] & PHIE_PLNKIE))
+        phy[PHIR] |= PHIR_PGIF;
+    updateInterrupt();
+}
+
+bool ENC28J60Model::interruptAsserted () {
+    tick();
+    return interruptLevel();
+}
+
+bool ENC28J60Model::interruptLevel () {
+    uint8_t eie = reg(0, EIE);
+    if (!(eie & EIE_INTIE))
+        return false;
+    return (eie & readRegister(EIR) & 0x7F) != 0;
+}
+
+// the handler runs like an ISR, i.e. possibly in the middle of SPI traffic
+void ENC28J60Model::updateInterrupt () {
+    bool level = interruptLevel();
+    if (level && !intLevel && intHandler) {
+        intLevel = level;
+        intHandler(intContext);
+    }
+    intLevel = level;
+}
+
+void ENC28J60Model::startTransmit () {
+    uint16_t start = reg16(0, ETXSTL);
+    uint16_t end = reg16(0, ETXNDL);
+    uint16_t len = end > start ? end - start : 0;
+    if (len < MIN_FRAMELEN && (reg(2, MACON3) & MACON3_PADCFG0))
+        len = MIN_FRAMELEN;
+    txBusy = true;
+    txDoneAt = hostClockNanos() + (uint64_t) (len + WIRE_OVERHEAD) * WIRE_BYTE_NS;
+}
+
+void ENC28J60Model::finishTransmit () {
+    txBusy = false;
+    uint16_t start = reg16(0, ETXSTL);
+    uint16_t end = reg16(0, ETXNDL);
+    uint16_t len = end > start ? end - start : 0;
+    uint8_t frame[0x2000];
+    for (uint16_t i = 0; i < len; ++i)
+        frame[i] = mem[(start + 1 + i) & 0x1FFF];
+    if (len < MIN_FRAMELEN && (reg(2, MACON3) & MACON3_PADCFG0)) {
+        memset(frame + len, 0, MIN_FRAMELEN - len);
+        len = MIN_FRAMELEN;
+    }
+
+    // transmit status vector goes right behind the frame
+    uint8_t tsv[7];
+    memset(tsv, 0, sizeof tsv);
+    tsv[0] = len;
+    tsv[1] = len >> 8;
+    tsv[2] = 0x80; // done
+    if (frame[0] & 1)
+        tsv[3] |= memcmp(frame, "\xFF\xFF\xFF\xFF\xFF\xFF", 6) == 0 ? 0x02 : 0x01;
+    tsv[4] = len + 4;
+    tsv[5] = (len + 4) >> 8;
+    if (txFailures) {
+        tsv[2] = 0x01; // one collision, not done
+        tsv[3] |= 0x20; // late collision
+    }
+    for (uint8_t i = 0; i < sizeof tsv; ++i)
+        mem[(end + 1 + i) & 0x1FFF] = tsv[i];
+
+    reg(0, ECON1) &= ~ECON1_TXRTS;
+    reg(0, EIR) |= EIR_TXIF;
+    if (txFailures) {
+        --txFailures;
+        reg(0, EIR) |= EIR_TXERIF;
+        return;
+    }
+    ++counters.txFrames;
+    counters.txBytes += len;
+    if (txHandler)
+        txHandler(frame, len, txContext);
+}
+
+// Full duplex flow control: 01 sends one PAUSE frame, 10 keeps sending them
+// before the pause time runs out, 11 sends one with a zero time; 01 and 11
+// turn flow control off again. The link partner obeys them immediately.
+void ENC28J60Model::flowControl (uint8_t fcen) {
+    if (fcen == 0)
+        return;
+    ++counters.pauseFrames;
+    partnerPaused = fcen != 3 && reg16(3, EPAUSL) != 0;
+    if (fcen != 2)
+        reg(3, EFLOCON) &= ~EFLOCON_FCEN;
+}
+
+void ENC28J60Model::startDma () {
+    uint16_t start = reg16(0, EDMASTL);
+    uint16_t end = reg16(0, EDMANDL);
+    uint16_t rxEnd = reg16(0, ERXNDL);
+    uint16_t len = end >= start ? end - start + 1 :
+                   rxEnd - start + 1 + end - reg16(0, ERXSTL) + 1;
+    dmaBusy = true;
+    dmaDoneAt = hostClockNanos() + (uint64_t) len * DMA_BYTE_NS;
+}
+
+void ENC28J60Model::finishDma () {
+    dmaBusy = false;
+    uint16_t src = reg16(0, EDMASTL);
+    uint16_t end = reg16(0, EDMANDL);
+    uint8_t data[0x2000];
+    uint16_t len = 0;
+    for (;;) {
+        data[len++] = mem[src];
+        if (src == end || len == sizeof data)
+            break;
+        src = src == reg16(0, ERXNDL) ? reg16(0, ERXSTL) : (src + 1) & 0x1FFF;
+    }
+    if (reg(0, ECON1) & ECON1_CSUMEN) {
+        uint16_t sum = checksum(data, len);
+        reg(0, EDMACSL + 1) = sum >> 8;
+        reg(0, EDMACSL) = sum;
+    } else {
+        uint16_t dst = reg16(0, EDMADSTL);
+        for (uint16_t i = 0; i < len; ++i)
+            mem[(dst + i) & 0x1FFF] = data[i];
+    }
+    counters.dmaBytes += len;
+    reg(0, ECON1) &= ~ECON1_DMAST;
+    reg(0, EIR) |= EIR_DMAIF;
+}
+
+bool ENC28J60Model::acceptFrame (const uint8_t* frame, uint16_t len) {
+    uint8_t fcon = reg(1, ERXFCON);
+    uint8_t filters = fcon & (ERXFCON_UCEN | ERXFCON_PMEN | ERXFCON_MPEN |
+                              ERXFCON_HTEN | ERXFCON_MCEN | ERXFCON_BCEN);
+    if (filters == 0)
+        return true; // promiscuous
+
+    uint8_t mac[6] = {
+        reg(3, 0x04), reg(3, 0x05), reg(3, 0x02),
+        reg(3, 0x03), reg(3, 0x00), reg(3, 0x01)
+    };
+    bool broadcast = memcmp(frame, "\xFF\xFF\xFF\xFF\xFF\xFF", 6) == 0;
+    uint8_t matched = 0;
+    if (memcmp(frame, mac, 6) == 0)
+        matched |= ERXFCON_UCEN;
+    if (broadcast)
+        matched |= ERXFCON_BCEN;
+    if ((frame[0] & 1) && !broadcast)
+        matched |= ERXFCON_MCEN;
+    if (fcon & ERXFCON_HTEN) {
+        uint8_t ptr = (crc32(frame, 6) >> 23) & 0x3F;
+        if (reg(1, EHT0 + (ptr >> 3)) & (1 << (ptr & 7)))
+            matched |= ERXFCON_HTEN;
+    }
+    if (fcon & ERXFCON_PMEN) {
+        uint16_t offset = reg16(1, EPMOL);
+        uint8_t window[64];
+        uint8_t n = 0;
+        for (uint8_t i = 0; i < 64; ++i)
+            if ((reg(1, EPMM0 + (i >> 3)) & (1 << (i & 7))) && offset + i < len)
+                window[n++] = frame[offset + i];
+        if (n > 0 && checksum(window, n) == reg16(1, EPMCSL))
+            matched |= ERXFCON_PMEN;
+    }
+
+    if (fcon & ERXFCON_ANDOR)
+        return (matched & filters) == filters;
+    return (matched & filters) != 0;
+}
+
+uint16_t ENC28J60Model::rxFreeSpace () const {
+    uint16_t start = regs[0][ERXSTL] | (regs[0][ERXSTL + 1] << 8);
+    uint16_t end = regs[0][ERXNDL] | (regs[0][ERXNDL + 1] << 8);
+    uint16_t rdpt = regs[0][ERXRDPTL] | (regs[0][ERXRDPTL + 1] << 8);
+    if (rxWritePtr > rdpt)
+        return (end - start) - (rxWritePtr - rdpt);
+    if (rxWritePtr == rdpt)
+        return end - start;
+    return rdpt - rxWritePtr - 1;
+}
+
+bool ENC28J60Model::receive (const uint8_t* data, uint16_t len) {
+    tick();
+    if (!(reg(0, ECON1) & ECON1_RXEN) || !(reg(2, MACON1) & MACON1_MARXEN) ||
+            (reg(0, ECON2) & ECON2_PWRSV))
+        return false;
+
+    uint8_t frame[0x2000];
+    if (len > sizeof frame - 4)
+        return false;
+    memcpy(frame, data, len);
+    if (len < MIN_FRAMELEN) {
+        memset(frame + len, 0, MIN_FRAMELEN - len);
+        len = MIN_FRAMELEN;
+    }
+    if (!acceptFrame(frame, len)) {
+        ++counters.rxFiltered;
+        return false;
+    }
+
+    uint32_t crc = crc32(frame, len);
+    for (uint8_t i = 0; i < 4; ++i)
+        frame[len++] = crc >> (8 * i);
+
+    uint16_t need = 6 + len + (len & 1);
+    if (pktcnt == 0xFF || rxFreeSpace() < need) {
+        reg(0, EIR) |= EIR_RXERIF;
+        ++counters.rxDropped;
+        updateInterrupt();
+        return false;
+    }
+
+    uint16_t status = RSV_RXOK;
+    if (memcmp(frame, "\xFF\xFF\xFF\xFF\xFF\xFF", 6) == 0)
+        status |= RSV_BROADCAST;
+    else if (frame[0] & 1)
+        status |= RSV_MULTICAST;
+    uint16_t next = rxWrap(rxWritePtr + need);
+    uint8_t header[6] = {
+        (uint8_t) next, (uint8_t) (next >> 8),
+        (uint8_t) len, (uint8_t) (len >> 8),
+        (uint8_t) status, (uint8_t) (status >> 8)
+    };
+    uint16_t ptr = rxLastFrame = rxWritePtr;
+    for (uint8_t i = 0; i < sizeof header; ++i)
+        mem[rxWrap(ptr++)] = header[i];
+    for (uint16_t i = 0; i < len; ++i)
+        mem[rxWrap(ptr++)] = frame[i];
+    rxWritePtr = next;
+
+    ++pktcnt;
+    ++counters.rxFrames;
+    updateInterrupt();
+    return true;
+}
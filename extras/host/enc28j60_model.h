@@ -0,0 +1,175 @@
+// Software model of the Microchip ENC28J60 for host builds.
+//
+// The model sits behind the ENC28J60Transport interface and decodes the SPI
+// byte stream exactly like the chip does: control register banks, the 8 KB
+// buffer memory with the ERXST..ERXND receive ring, EPKTCNT, ECON1/ECON2/EIR
+// semantics, MII access to the PHY, the DMA copy/checksum engine and the
+// receive filters. Every SPI byte advances the simulated clock, so SPI bytes
+// and bus time per packet can be measured without hardware.
+//
+// Copyright: GPL V2
+/** @file */
+
+#ifndef ENC28J60_MODEL_H
+#define ENC28J60_MODEL_H
+
+#include <EtherCard.h>
+
+/** This class emulates an ENC28J60 on the host, see extras/host/README.md. */
+class ENC28J60Model : public ENC28J60Transport {
+public:
+    /** Counters collected by the model */
+    struct Stats {
+        uint32_t spiBytes;      ///< Bytes clocked over SPI, including opcodes
+        uint32_t transactions;  ///< Chip select assertions
+        uint32_t rxFrames;      ///< Frames accepted into the receive ring
+        uint32_t rxFiltered;    ///< Frames rejected by the receive filters
+        uint32_t rxDropped;     ///< Frames lost because the receive ring was full
+        uint32_t txFrames;      ///< Frames put on the wire
+        uint32_t txBytes;       ///< Bytes put on the wire, excluding CRC
+        uint32_t dmaBytes;      ///< Bytes processed by the DMA engine
+        uint32_t pauseFrames;   ///< PAUSE frames sent in full duplex, including those ending a pause
+    };
+
+    /** This type defines a handler which is called for every transmitted frame */
+    typedef void (*TransmitHandler)(const uint8_t* frame, uint16_t len, void* ctx);
+
+    /** This type defines a handler which is called when the INT pin falls */
+    typedef void (*InterruptHandler)(void* ctx);
+
+    ENC28J60Model ();
+
+    // ENC28J60Transport
+    virtual void select ();
+    virtual void deselect ();
+    virtual uint8_t transfer (uint8_t data);
+    virtual void readBytes (uint16_t len, uint8_t* data);
+    virtual void writeBytes (uint16_t len, const uint8_t* data);
+
+    /**   @brief  Power-on reset of the whole chip
+    */
+    void powerOnReset ();
+
+    /**   @brief  Offer a frame from the wire to the receiver
+    *     @param  frame Frame without CRC, frames shorter than 60 bytes get padded
+    *     @param  len Length of frame
+    *     @return <i>bool</i> True if the frame was written into the receive ring
+    */
+    bool receive (const uint8_t* frame, uint16_t len);
+
+    /**   @brief  Overwrite the next packet pointer of the last received frame, like a corrupt receive ring
+    */
+    void corruptLastFrame ();
+
+    /**   @brief  Register a handler for frames which finish transmission
+    */
+    void onTransmit (TransmitHandler handler, void* ctx = 0);
+
+    /**   @brief  Register a handler for falling edges of the INT pin, e.g. one that calls hostInterrupt()
+    */
+    void onInterrupt (InterruptHandler handler, void* ctx = 0);
+
+    /**   @brief  Change the PHY link state, raising the link change interrupt if enabled
+    */
+    void setLink (bool up);
+
+    /**   @brief  Let the next n transmissions end in a late collision, i.e. TXERIF without the frame
+    */
+    void lateCollisions (uint32_t n) { txFailures = n; }
+
+    /**   @brief  Time taken by one SPI byte, default 1000 ns (8 MHz SCK)
+    */
+    void setSpiByteNanos (uint32_t ns) { spiByteNanos = ns; }
+
+    /**   @brief  Complete DMA, MII and transmit operations whose time has come
+    */
+    void tick ();
+
+    /**   @brief  Level of the INT pin, true if asserted
+    */
+    bool interruptAsserted ();
+
+    /**   @brief  True while PAUSE frames told the link partner to hold back its frames
+    */
+    bool partnerPausing () const { return partnerPaused; }
+
+    /**   @brief  Number of frames waiting in the receive ring (EPKTCNT)
+    */
+    uint8_t pendingFrames () const { return pktcnt; }
+
+    /**   @brief  Direct access to the buffer memory, for inspection only
+    */
+    uint8_t peekMemory (uint16_t addr) const { return mem[addr & 0x1FFF]; }
+
+    const Stats& stats () const { return counters; }
+    void resetStats () { memset(&counters, 0, sizeof counters); }
+
+private:
+    enum Op { OP_NONE, OP_RCR, OP_RBM, OP_WCR, OP_WBM, OP_BFS, OP_BFC, OP_DONE };
+
+    uint8_t mem[0x2000];
+    uint8_t regs[4][0x20];
+    uint16_t phy[0x20];
+
+    uint8_t pktcnt;
+    uint16_t rxWritePtr;
+    uint16_t rxLastFrame;
+    bool partnerPaused;
+
+    bool selected;
+    Op op;
+    uint8_t opArg;
+    uint8_t opCount;
+
+    uint64_t txDoneAt;
+    uint64_t dmaDoneAt;
+    uint64_t miiDoneAt;
+    bool txBusy;
+    uint32_t txFailures;
+    bool dmaBusy;
+    bool miiBusy;
+    bool miiRead;
+
+    uint32_t spiBytes;
+    uint32_t spiByteNanos;
+
+    TransmitHandler txHandler;
+    void* txContext;
+    InterruptHandler intHandler;
+    void* intContext;
+    bool intLevel;
+
+    Stats counters;
+
+    uint8_t bank () const { return regs[0][0x1F] & 0x03; }
+    uint8_t& reg (uint8_t b, uint8_t addr);
+    uint16_t reg16 (uint8_t b, uint8_t addr);
+    void setReg16 (uint8_t b, uint8_t addr, uint16_t value);
+    bool isMacMii (uint8_t addr) const;
+
+    uint8_t readRegister (uint8_t addr);
+    void writeRegister (uint8_t addr, uint8_t value);
+    void bitFieldSet (uint8_t addr, uint8_t mask);
+    void bitFieldClear (uint8_t addr, uint8_t mask);
+    void updateEcon1 (uint8_t prev);
+    void updateEcon2 ();
+
+    uint8_t readMemory ();
+    void writeMemory (uint8_t value);
+    uint16_t rxWrap (uint16_t addr) const;
+
+    void spiClock ();
+    void systemReset ();
+    void startTransmit ();
+    void finishTransmit ();
+    void startDma ();
+    void finishDma ();
+    void finishMii ();
+    void flowControl (uint8_t fcen);
+    bool interruptLevel ();
+    void updateInterrupt ();
+    bool acceptFrame (const uint8_t* frame, uint16_t len);
+    uint16_t rxFreeSpace () const;
+};
+
+#endif
@@ -0,0 +1,168 @@
+// Remote station for host builds.
+//
+// Copyright: GPL V2
+
+#include "netpeer.h"
+
+static uint16_t ipChecksum (uint32_t sum, const uint8_t* data, uint16_t len) {
+    for (uint16_t i = 0; i + 1 < len; i += 2)
+        sum += (data[i] << 8) | data[i+1];
+    if (len & 1)
+        sum += data[len-1] << 8;
+    while (sum >> 16)
+        sum = (sum & 0xFFFF) + (sum >> 16);
+    return ~sum;
+}
+
+static void put16 (uint8_t* p, uint16_t v) {
+    p[0] = v >> 8;
+    p[1] = v;
+}
+
+static void put32 (uint8_t* p, uint32_t v) {
+    put16(p, v >> 16);
+    put16(p + 2, v);
+}
+
+// checksum over the IPv4 pseudo header plus the transport segment
+static void fillTransportChecksum (uint8_t* ip, uint8_t* csum, uint16_t len) {
+    uint32_t sum = ip[9] + len;
+    for (uint8_t i = 12; i < 20; i += 2)
+        sum += (ip[i] << 8) | ip[i+1];
+    put16(csum, 0);
+    put16(csum, ipChecksum(sum, ip + 20, len));
+}
+
+// true if the IPv4 header and TCP/UDP/ICMP checksums of a frame are correct
+static bool checksumsValid (const uint8_t* frame, uint16_t len) {
+    if (len < ETH_HEADER_LEN + 20 || frame[12] != 0x08 || frame[13] != 0x00)
+        return true;
+    const uint8_t* ip = frame + ETH_HEADER_LEN;
+    uint16_t ipLen = (ip[2] << 8) | ip[3];
+    if (ipChecksum(0, ip, 20) != 0 || ipLen < 20 || ETH_HEADER_LEN + ipLen > len)
+        return false;
+    uint16_t segLen = ipLen - 20;
+    uint32_t sum = 0;
+    if (ip[9] == IP_PROTO_TCP_V || ip[9] == IP_PROTO_UDP_V) {
+        sum = ip[9] + segLen;
+        for (uint8_t i = 12; i < 20; i += 2)
+            sum += (ip[i] << 8) | ip[i+1];
+        if (ip[9] == IP_PROTO_UDP_V && segLen >= 8 && ip[26] == 0 && ip[27] == 0)
+            return true; // no UDP checksum
+    } else if (ip[9] != IP_PROTO_ICMP_V)
+        return true;
+    return ipChecksum(sum, ip + 20, segLen) == 0;
+}
+
+NetPeer::NetPeer (const uint8_t* m, const uint8_t* i) :
+    frameLen (0), replyLen (0), replies (0), badChecksums (0), window (8192) {
+    memcpy(mac, m, ETH_LEN);
+    memcpy(ip, i, IP_LEN);
+}
+
+void NetPeer::receive (const uint8_t* data, uint16_t len, void* ctx) {
+    NetPeer* peer = (NetPeer*) ctx;
+    if (len > sizeof peer->reply)
+        len = sizeof peer->reply;
+    memcpy(peer->reply, data, len);
+    peer->replyLen = len;
+    ++peer->replies;
+    if (!checksumsValid(data, len))
+        ++peer->badChecksums;
+}
+
+uint16_t NetPeer::arpRequest (const uint8_t* targetIp) {
+    memset(frame, 0xFF, ETH_LEN);
+    memcpy(frame + ETH_SRC_MAC, mac, ETH_LEN);
+    put16(frame + 12, 0x0806);
+    uint8_t* a = frame + ETH_HEADER_LEN;
+    put16(a, 1);
+    put16(a + 2, 0x0800);
+    a[4] = ETH_LEN;
+    a[5] = IP_LEN;
+    put16(a + 6, 1);
+    memcpy(a + 8, mac, ETH_LEN);
+    memcpy(a + 14, ip, IP_LEN);
+    memset(a + 18, 0, ETH_LEN);
+    memcpy(a + 24, targetIp, IP_LEN);
+    return frameLen = ETH_HEADER_LEN + 28;
+}
+
+uint16_t NetPeer::arpReply (const uint8_t* dstMac, const uint8_t* dstIp) {
+    arpRequest(dstIp);
+    memcpy(frame, dstMac, ETH_LEN);
+    uint8_t* a = frame + ETH_HEADER_LEN;
+    put16(a + 6, 2);
+    memcpy(a + 18, dstMac, ETH_LEN);
+    return frameLen;
+}
+
+uint8_t* NetPeer::ipFrame (const uint8_t* dstMac, const uint8_t* dstIp,
+                           uint8_t protocol, uint16_t payloadLen) {
+    memcpy(frame, dstMac, ETH_LEN);
+    memcpy(frame + ETH_SRC_MAC, mac, ETH_LEN);
+    put16(frame + 12, 0x0800);
+    uint8_t* h = frame + ETH_HEADER_LEN;
+    memset(h, 0, 20);
+    h[0] = 0x45;
+    put16(h + 2, 20 + payloadLen);
+    h[6] = 0x40; // don't fragment
+    h[8] = 64;
+    h[9] = protocol;
+    memcpy(h + 12, ip, IP_LEN);
+    memcpy(h + 16, dstIp, IP_LEN);
+    put16(h + 10, ipChecksum(0, h, 20));
+    frameLen = ETH_HEADER_LEN + 20 + payloadLen;
+    return h;
+}
+
+uint16_t NetPeer::icmpEcho (const uint8_t* dstMac, const uint8_t* dstIp,
+                            uint16_t payloadLen, uint16_t seq) {
+    uint8_t* h = ipFrame(dstMac, dstIp, IP_PROTO_ICMP_V, 8 + payloadLen);
+    uint8_t* icmp = h + 20;
+    icmp[0] = ICMP_TYPE_ECHOREQUEST_V;
+    icmp[1] = 0;
+    put16(icmp + 2, 0);
+    put16(icmp + 4, 0x1234);
+    put16(icmp + 6, seq);
+    for (uint16_t i = 0; i < payloadLen; ++i)
+        icmp[8 + i] = i;
+    put16(icmp + 2, ipChecksum(0, icmp, 8 + payloadLen));
+    return frameLen;
+}
+
+uint16_t NetPeer::udp (const uint8_t* dstMac, const uint8_t* dstIp,
+                       uint16_t sport, uint16_t dport, const void* data, uint16_t len) {
+    uint8_t* h = ipFrame(dstMac, dstIp, IP_PROTO_UDP_V, 8 + len);
+    uint8_t* u = h + 20;
+    put16(u, sport);
+    put16(u + 2, dport);
+    put16(u + 4, 8 + len);
+    memcpy(u + 8, data, len);
+    fillTransportChecksum(h, u + 6, 8 + len);
+    return frameLen;
+}
+
+uint16_t NetPeer::tcp (const uint8_t* dstMac, const uint8_t* dstIp,
+                       uint16_t sport, uint16_t dport, uint32_t seq, uint32_t ack,
+                       uint8_t flags, const void* data, uint16_t len, uint16_t mss) {
+    uint8_t hlen = mss ? 24 : 20;
+    uint8_t* h = ipFrame(dstMac, dstIp, IP_PROTO_TCP_V, hlen + len);
+    uint8_t* t = h + 20;
+    memset(t, 0, hlen);
+    put16(t, sport);
+    put16(t + 2, dport);
+    put32(t + 4, seq);
+    put32(t + 8, ack);
+    t[12] = hlen << 2;
+    t[13] = flags;
+    put16(t + 14, window);
+    if (mss) {
+        t[20] = 2;
+        t[21] = 4;
+        put16(t + 22, mss);
+    }
+    memcpy(t + hlen, data, len);
+    fillTransportChecksum(h, t + 16, hlen + len);
+    return frameLen;
+}
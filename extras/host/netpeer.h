@@ -0,0 +1,48 @@
+// Remote station for host builds: composes frames addressed to the stack
+// under test and keeps the last frame the stack sent back.
+//
+// Copyright: GPL V2
+/** @file */
+
+#ifndef NETPEER_H
+#define NETPEER_H
+
+#include <EtherCard.h>
+
+/** This class represents a host on the simulated LAN which talks to the stack. */
+class NetPeer {
+public:
+    uint8_t mac[ETH_LEN];   ///< Hardware address of the peer
+    uint8_t ip[IP_LEN];     ///< IP address of the peer
+    uint8_t frame[1518];    ///< Last frame composed by the peer
+    uint16_t frameLen;      ///< Length of last composed frame
+    uint8_t reply[1518];    ///< Last frame received from the stack
+    uint16_t replyLen;      ///< Length of last received frame, 0 after clearReply()
+    uint32_t replies;       ///< Number of frames received from the stack
+    uint32_t badChecksums;  ///< Number of received frames with a wrong IP, ICMP, UDP or TCP checksum
+    uint16_t window;        ///< Receive window advertised in TCP segments
+
+    NetPeer (const uint8_t* mac, const uint8_t* ip);
+
+    /**   @brief  Handler for ENC28J60Model::onTransmit(), ctx must point to a NetPeer
+    */
+    static void receive (const uint8_t* frame, uint16_t len, void* ctx);
+
+    void clearReply () { replyLen = 0; }
+
+    uint16_t arpRequest (const uint8_t* targetIp);
+    uint16_t arpReply (const uint8_t* dstMac, const uint8_t* dstIp);
+    uint16_t icmpEcho (const uint8_t* dstMac, const uint8_t* dstIp,
+                       uint16_t payloadLen, uint16_t seq);
+    uint16_t udp (const uint8_t* dstMac, const uint8_t* dstIp,
+                  uint16_t sport, uint16_t dport, const void* data, uint16_t len);
+    uint16_t tcp (const uint8_t* dstMac, const uint8_t* dstIp,
+                  uint16_t sport, uint16_t dport, uint32_t seq, uint32_t ack,
+                  uint8_t flags, const void* data, uint16_t len, uint16_t mss = 0);
+
+private:
+    uint8_t* ipFrame (const uint8_t* dstMac, const uint8_t* dstIp,
+                      uint8_t protocol, uint16_t payloadLen);
+};
+
+#endif
@@ -10,51 +10,56 @@
 // 2010-05-19 <jc@wippler.nl>
 
 #include "EtherCard.h"
+#include "EtherUtil.h"
 #include <stdarg.h>
 #include <avr/eeprom.h>
 
 EtherCard ether;
 
-uint8_t EtherCard::mymac[ETH_LEN];  // my MAC address
-uint8_t EtherCard::myip[IP_LEN];   // my ip address
-uint8_t EtherCard::netmask[IP_LEN]; // subnet mask
-uint8_t EtherCard::broadcastip[IP_LEN]; // broadcast address
-uint8_t EtherCard::gwip[IP_LEN];   // gateway
-uint8_t EtherCard::dhcpip[IP_LEN]; // dhcp server
-uint8_t EtherCard::dnsip[IP_LEN];  // dns server
-uint8_t EtherCard::hisip[IP_LEN];  // ip address of remote host
-uint16_t EtherCard::hisport = HTTP_PORT; // tcp port to browse to
-bool EtherCard::using_dhcp = false;
-bool EtherCard::persist_tcp_connection = false;
-uint16_t EtherCard::delaycnt = 0; //request gateway ARP lookup
+#if ETHERCARD_INTERFACES > 1
+static EtherCard moreInterfaces[ETHERCARD_INTERFACES - 1];
+ENC28J60* ENC28J60::nic = &ether;
+
+ENC28J60* ENC28J60::chip (byte iface) {
+    return iface == 0 ? &ether : &moreInterfaces[iface - 1];
+}
+#else
+ENC28J60* const ENC28J60::nic = &ether;
+#endif
+
+bool EtherCard::forwarding_enabled = false;
+EtherCard::ForwardStats EtherCard::forwardStats;
 
 uint8_t EtherCard::begin (const uint16_t size,
                           const uint8_t* macaddr,
-                          uint8_t csPin) {
-    using_dhcp = false;
+                          uint8_t csPin,
+                          const ENC28J60Layout& layout) {
+    gNIC.using_dhcp = false;
+    copyMac(gNIC.mymac, macaddr);
+    uint8_t rev = initialize(size, gNIC.mymac, csPin, layout);
 #if ETHERCARD_STASH
-    Stash::initMap();
+    Stash::initMap(scratchPages());
 #endif
-    copyMac(mymac, macaddr);
-    return initialize(size, mymac, csPin);
+    return rev;
 }
 
 bool EtherCard::staticSetup (const uint8_t* my_ip,
                              const uint8_t* gw_ip,
                              const uint8_t* dns_ip,
                              const uint8_t* mask) {
-    using_dhcp = false;
+    gNIC.using_dhcp = false;
 
     if (my_ip != 0)
-        copyIp(myip, my_ip);
+        copyIp(gNIC.myip, my_ip);
     if (gw_ip != 0)
         setGwIp(gw_ip);
     if (dns_ip != 0)
-        copyIp(dnsip, dns_ip);
+        copyIp(gNIC.dnsip, dns_ip);
     if(mask != 0)
-        copyIp(netmask, mask);
+        copyIp(gNIC.netmask, mask);
     updateBroadcastAddress();
-    delaycnt = 0; //request gateway ARP lookup
+    updateFilters();
+    gNIC.delaycnt = 0; //request gateway ARP lookup
     return true;
 }
 
@@ -66,3 +71,35 @@ char* EtherCard::wtoa(uint16_t value, char* ptr)
     *++ptr = 0;
     return ptr;
 }
+
+#if ETHERCARD_INTERFACES > 1
+EtherCard& EtherCard::instance (uint8_t iface) {
+    return *static_cast<EtherCard*>(chip(iface));
+}
+#endif
+
+void EtherCard::selectInterface (uint8_t iface) {
+#if ETHERCARD_INTERFACES > 1
+    if (iface >= ETHERCARD_INTERFACES)
+        return;
+    ENC28J60::selectInterface(iface);
+    tcpSelect(iface);
+    arpSelect(iface);
+    dhcpSelect(iface);
+    dnsSelect(iface);
+    udpSelect(iface);
+#if ETHERCARD_STASH
+    Stash::selectInterface(iface);
+#endif
+#else
+    (void) iface;
+#endif
+}
+
+void EtherCard::enableForwarding () {
+    forwarding_enabled = true;
+}
+
+void EtherCard::disableForwarding () {
+    forwarding_enabled = false;
+}
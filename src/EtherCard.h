@@ -56,12 +56,79 @@
 */
 #define ETHERCARD_TCPCLIENT 1
 
+/** Number of TCP client sessions which can be open at once.
+*   Each clientTcpReq() gets its own entry with the server's address and port, its
+*   callbacks and retransmission timer, so requests to several servers may overlap. A request
+*   while all are in use takes over the closed or else the quietest session. The request
+*   goes in segments of the server's MSS. Each entry costs 39 bytes SRAM; 1 to 8, the
+*   session id is 3 bits of the local port. There is one by default, build with e.g.
+*   -DETHERCARD_TCP_CLIENTS=4 for overlapping requests.
+*/
+#ifndef ETHERCARD_TCP_CLIENTS
+#   define ETHERCARD_TCP_CLIENTS 1
+#endif
+
 /** Enable TCP server functionality.
 *   Setting this to zero means that the program will not accept TCP client
 *   requests. Saves 2 bytes SRAM and 250 bytes flash.
 */
 #define ETHERCARD_TCPSERVER 1
 
+/** Number of TCP connections the server keeps track of.
+*   Each entry remembers the client's address and port and where the sequence numbers
+*   of both directions stand, so replies to clients whose requests overlap do not get
+*   mixed up. Segments of connections which did not get an entry, because all were
+*   established, are answered from the segment alone like without the table. Each entry
+*   costs 37 bytes SRAM; 0 disables the table. There is one by default, build with e.g.
+*   -DETHERCARD_TCP_CONNECTIONS=4 for a server whose clients overlap.
+*/
+#ifndef ETHERCARD_TCP_CONNECTIONS
+#   define ETHERCARD_TCP_CONNECTIONS 1
+#endif
+
+/** Milliseconds after which a quiet TCP server connection or client session is dropped, at most 60000 */
+#ifndef ETHERCARD_TCP_IDLE_TIMEOUT
+#   define ETHERCARD_TCP_IDLE_TIMEOUT 20000
+#endif
+
+/** Retransmissions of a TCP segment before its connection is aborted.
+*   Client sessions and the server connections in the table send unacknowledged
+*   segments again when their retransmission timeout runs out. The timeout follows
+*   the round trip times measured as in RFC 6298 and doubles with each retransmission.
+*/
+#ifndef ETHERCARD_TCP_RETRIES
+#   define ETHERCARD_TCP_RETRIES 5
+#endif
+
+/** Lower bound of the TCP retransmission timeout in milliseconds, RFC 6298 asks for 1000 */
+#ifndef ETHERCARD_TCP_RTO_MIN
+#   define ETHERCARD_TCP_RTO_MIN 1000
+#endif
+
+/** Number of sent TCP data segments kept in chip memory until they are acknowledged.
+*   The DMA engine makes the copies within the chip, in memory taken with enc_malloc(),
+*   so they need a layout with a heap such as ENC28J60::layoutBufferPool and ENC_HEAP_UNIT_MAX.
+*   Without a copy a client request is filled in again by its datafill callback, and a server
+*   reply is sent again by the sketch once the client repeats its request. Each costs 9 bytes
+*   SRAM, the default layoutDefault has no heap, hence none by default.
+*/
+#ifndef ETHERCARD_TCP_COPIES
+#   define ETHERCARD_TCP_COPIES 0
+#endif
+
+/** Enable httpServerStream(), which sends replies of any size to connections in the table.
+*   Costs 18 bytes SRAM per entry of ETHERCARD_TCP_CONNECTIONS, so it is off by default;
+*   build with -DETHERCARD_TCP_STREAM=1 to use it.
+*/
+#ifndef ETHERCARD_TCP_STREAM
+#   define ETHERCARD_TCP_STREAM 0
+#endif
+
+/** Segments of the client's MSS a stream may have in flight at once, as far as its window allows */
+#ifndef ETHERCARD_TCP_STREAM_SEGMENTS
+#   define ETHERCARD_TCP_STREAM_SEGMENTS 4
+#endif
+
 /** Enable UDP server functionality.
 *   If zero UDP server is disabled. It is
 *   still possible to register callbacks but these will never be called. Saves
@@ -90,6 +157,11 @@
 #   define ETHERCARD_ARP_STORE_SIZE 4
 #endif
 
+/** Set the number of multicast groups which can be joined at the same time */
+#ifndef ETHERCARD_MULTICAST_GROUPS
+#   define ETHERCARD_MULTICAST_GROUPS 4
+#endif
+
 
 /** This type definition defines the structure of a UDP server event handler callback function */
 typedef void (*UdpServerCallback)(
@@ -97,7 +169,7 @@ typedef void (*UdpServerCallback)(
     uint8_t src_ip[IP_LEN],    ///< IP address of the sender
     uint16_t src_port,    ///< Port the packet was sent from
     const char *data,   ///< UDP payload data
-    uint16_t len);        ///< Length of the payload data
+    uint16_t len);        ///< Length of the payload data in the data buffer, see EtherCard::udpPayloadReader() for longer datagrams; ENC28J60::packetTime() tells when it arrived
 
 /** This type definition defines the structure of a DHCP Option callback function */
 typedef void (*DhcpOptionCallback)(
@@ -109,32 +181,55 @@ typedef void (*IcmpCallback)(const uint8_t *src_ip);
 
 
 /** This class provides the main interface to a ENC28J60 based network interface card and is the class most users will use.
+*   Each instance is one interface, ether the first one; the static functions work on the one selectInterface() picked.
 *   @note   All TCP/IP client (outgoing) connections are made from source port in range 2816-3071. Do not use these source ports for other purposes.
 */
 class EtherCard : public Ethernet {
 public:
-    static uint8_t mymac[ETH_LEN];  ///< MAC address
-    static uint8_t myip[IP_LEN];    ///< IP address
-    static uint8_t netmask[IP_LEN]; ///< Netmask
-    static uint8_t broadcastip[IP_LEN]; ///< Subnet broadcast address
-    static uint8_t gwip[IP_LEN];   ///< Gateway
-    static uint8_t dhcpip[IP_LEN]; ///< DHCP server IP address
-    static uint8_t dnsip[IP_LEN];  ///< DNS server IP address
-    static uint8_t hisip[IP_LEN];  ///< DNS lookup result
-    static uint16_t hisport;  ///< TCP port to connect to (default 80)
-    static bool using_dhcp;   ///< True if using DHCP
-    static bool persist_tcp_connection; ///< False to break connections on first packet received
-    static uint16_t delaycnt; ///< Counts number of cycles of packetLoop when no packet received - used to trigger periodic gateway ARP request
+    uint8_t mymac[ETH_LEN] = {};  ///< MAC address
+    uint8_t myip[IP_LEN] = {};    ///< IP address
+    uint8_t netmask[IP_LEN] = {}; ///< Netmask
+    uint8_t broadcastip[IP_LEN] = {}; ///< Subnet broadcast address
+    uint8_t gwip[IP_LEN] = {};   ///< Gateway
+    uint8_t dhcpip[IP_LEN] = {}; ///< DHCP server IP address
+    uint8_t dnsip[IP_LEN] = {};  ///< DNS server IP address
+    uint8_t hisip[IP_LEN] = {};  ///< DNS lookup result
+    uint16_t hisport = HTTP_PORT;  ///< TCP port to connect to (default 80)
+    bool using_dhcp = false;   ///< True if using DHCP
+    bool persist_tcp_connection = false; ///< False to break connections on first packet received
+    uint16_t delaycnt = 0; ///< Counts number of cycles of packetLoop when no packet received - used to trigger periodic gateway ARP request
+    uint8_t drainProcessed = 0; ///< Number of frames processed by the last call of packetLoopDrain()
+    uint8_t drainOverflows = 0; ///< Number of receive buffer overflows noticed by the last call of packetLoopDrain()
+    uint8_t multicastGroups[ETHERCARD_MULTICAST_GROUPS][IP_LEN] = {}; ///< Joined multicast groups, 0.0.0.0 if unused
+    bool filters_enabled = false; ///< True if the receive filters are generated from the configuration, see enableFilters()
+
+    /** Receive filter counters, they wrap around and can be cleared by the application */
+    struct FilterStats {
+        uint16_t hits;   ///< Frames let through by the receive filters which were addressed to us
+        uint16_t misses; ///< Frames let through which the stack dropped: other ARP targets, other IP destinations, unknown types
+    };
+    FilterStats filterStats = {}; ///< Receive filter counters, a high miss count calls for enableFilters()
+    static bool forwarding_enabled; ///< True if IPv4 packets are routed between the interfaces, see enableForwarding()
+
+    /** Forwarding counters, shared by all interfaces */
+    struct ForwardStats {
+        uint16_t forwarded; ///< Packets sent on to another interface
+        uint16_t dropped;   ///< Packets not addressed to us which could not be forwarded: no route, TTL expired, longer than the data buffer or next hop not resolved yet
+    };
+    static ForwardStats forwardStats; ///< Forwarding counters
 
     // EtherCard.cpp
     /**   @brief  Initialise the network interface
     *     @param  size Size of data buffer
     *     @param  macaddr Hardware address to assign to the network interface (6 bytes)
     *     @param  csPin Arduino pin number connected to chip select. Default = 8
-    *     @return <i>uint8_t</i> Firmware version or zero on failure.
+    *     @param  layout Split of the ENC28J60 buffer memory between receive, transmit and Stash,
+    *             e.g. ENC28J60::layoutSensorSink. Default = ENC28J60::layoutDefault
+    *     @return <i>uint8_t</i> Firmware version or zero on failure, including an invalid layout.
     */
     static uint8_t begin (const uint16_t size, const uint8_t* macaddr,
-                          uint8_t csPin = SS);
+                          uint8_t csPin = SS,
+                          const ENC28J60Layout& layout = layoutDefault);
 
     /**   @brief  Configure network interface with static IP
     *     @param  my_ip IP address (4 bytes). 0 for no change.
@@ -164,6 +259,17 @@ public:
     */
     static uint16_t packetLoop (uint16_t plen);
 
+    /**   @brief  Receive and parse all queued packets, up to a limit
+    *     @param  maxFrames Maximum number of packets to process
+    *     @param  budget Time budget in microseconds, no more packets are started once it is used up. 0 for no limit
+    *     @return <i>uint16_t</i> Offset of TCP payload data in data buffer or zero, as returned by packetLoop()
+    *     @note   Replaces packetLoop(packetReceive()) in loop(). Stops early at a packet with TCP payload
+    *           because the sketch has to handle it before the data buffer is reused.
+    *     @note   The number of packets processed and overflows seen are left in drainProcessed and drainOverflows;
+    *           a frame dropped for a receive error counts as processed and does not end the drain
+    */
+    static uint16_t packetLoopDrain (uint8_t maxFrames, uint16_t budget = 0);
+
     /**   @brief  Accept a TCP/IP connection
     *     @param  port IP port to accept on - do nothing if wrong port
     *     @param  plen Number of bytes in packet
@@ -171,17 +277,77 @@ public:
     */
     static uint16_t accept (uint16_t port, uint16_t plen);
 
+    /**   @brief  Identify the connection of the request accept() or packetLoop() returned last
+    *     @return <i>uint8_t</i> Index of its entry in the connection table, below ETHERCARD_TCP_CONNECTIONS;
+    *           0xFF if the connection has no entry
+    *     @note   Replies with httpServerReply() and friends go to this connection until the next packetLoop()
+    */
+    static uint8_t tcpServerConnection ();
+
+    /**   @brief  Count the TCP connections the server is tracking
+    *     @return <i>uint8_t</i> Number of entries in use, from handshake to the final ACK
+    */
+    static uint8_t tcpServerConnections ();
+
     /**   @brief  Send a response to a HTTP request
     *     @param  dlen Size of the HTTP (TCP) payload
+    *     @note   Connections in the table get the payload in segments of the client's MSS
     */
     static void httpServerReply (uint16_t dlen);
 
     /**   @brief  Send a response to a HTTP request
     *     @param  dlen Size of the HTTP (TCP) payload
-    *     @param  flags TCP flags
+    *     @param  flags TCP flags, PUSH and FIN only go with the last segment
+    *     @note   Connections in the table get the payload in segments of the client's MSS
     */
     static void httpServerReply_with_flags (uint16_t dlen , uint8_t flags);
 
+    /**   @brief  Send a reply to a TCP client whose data is gathered from RAM, flash, EEPROM and Stash segments
+    *     @param  segs Segments making up the data, see ENC28J60Segment
+    *     @param  count Number of segments
+    *     @param  flags TCP flags
+    *     @note   Like httpServerReply_with_flags(), but the data never passes through the data buffer, so a
+    *           page does not have to be copied to tcpOffset() first. Connections in the table get the data in
+    *           segments of the client's MSS, otherwise all segments together must fit in one frame
+    */
+    static void httpServerReplySegments (const ENC28J60Segment* segs, uint8_t count, uint8_t flags);
+
+    /**   @brief  Callback which produces the bytes of a reply sent with httpServerStream()
+    *     @param  conn Connection of the reply, as returned by tcpServerConnection()
+    *     @param  offset Position within the reply of the first byte wanted
+    *     @param  buf Where to put the bytes
+    *     @param  len Number of bytes wanted
+    *     @return <i>uint16_t</i> Number of bytes written, less than len only at the end of the reply
+    *     @note   Lost segments are asked for again, so the same offset must give the same bytes
+    */
+    typedef uint16_t (*StreamFill)(uint8_t conn, uint16_t offset, uint8_t* buf, uint16_t len);
+
+    /**   @brief  Send a reply of any size to the connection of the request accept() returned last
+    *     @param  source Where the reply is and its size, see ENC28J60Segment
+    *     @return <i>bool</i> True if the reply is under way, false if the connection has no entry in the table
+    *           or is sending a reply already
+    *     @note   Instead of httpServerReply() and friends. The reply is cut into segments of the client's MSS,
+    *           which are sent as far as its receive window and ETHERCARD_TCP_STREAM_SEGMENTS allow; packetLoop()
+    *           sends more as the client acknowledges them and sends lost ones again. A FIN follows the last byte.
+    *           The source has to stay unchanged while httpServerStreaming() returns true. Always false unless
+    *           built with ETHERCARD_TCP_STREAM
+    */
+    static bool httpServerStream (const ENC28J60Segment& source);
+
+    /**   @brief  Send a reply of any size to the connection of the request accept() returned last
+    *     @param  fill Callback which produces the reply a segment at a time in the data buffer
+    *     @param  len Size of the reply; 0xFFFF if it ends where the callback says so, at most 0xFFFE
+    *     @return <i>bool</i> True if the reply is under way, false if the connection has no entry in the table
+    *           or is sending a reply already
+    */
+    static bool httpServerStream (StreamFill fill, uint16_t len = 0xFFFF);
+
+    /**   @brief  Check whether a reply of httpServerStream() is still under way
+    *     @param  conn Connection of the reply, as returned by tcpServerConnection()
+    *     @return <i>bool</i> True until the client has acknowledged all of it, or the connection is gone
+    */
+    static bool httpServerStreaming (uint8_t conn);
+
     /**   @brief  Acknowledge TCP message
     *     @todo   Is this / should this be private?
     */
@@ -196,6 +362,64 @@ public:
     */
     static void updateBroadcastAddress();
 
+    /**   @brief  Let the ENC28J60 drop traffic the stack has no use for
+    *     @note   Broadcasts are then only received as ARP requests for our own IP address, unless
+    *           enableBroadcast() is called, e.g. for UDP listeners which expect broadcasts. The filters
+    *           follow changes of the IP address and of the multicast groups automatically
+    */
+    static void enableFilters ();
+
+    /**   @brief  Go back to receiving all broadcasts, as after begin()
+    */
+    static void disableFilters ();
+
+    /**   @brief  Program the receive filters from the IP address and the joined multicast groups
+    *     @note   Called by the stack whenever one of them changes
+    */
+    static void updateFilters ();
+
+    /**   @brief  Receive datagrams sent to a multicast group
+    *     @param  group Multicast IP address (4 bytes), 224.0.0.0 to 239.255.255.255
+    *     @return <i>bool</i> False if all ETHERCARD_MULTICAST_GROUPS entries are in use
+    *     @note   Only frames of joined groups pass the hash filter of the ENC28J60; no IGMP report is sent
+    */
+    static bool joinMulticastGroup (const uint8_t *group);
+
+    /**   @brief  Stop receiving datagrams sent to a multicast group
+    *     @param  group Multicast IP address (4 bytes)
+    */
+    static void leaveMulticastGroup (const uint8_t *group);
+
+    /**   @brief  Make another network interface the one the static API works on
+    *     @param  iface Interface number, less than ETHERCARD_INTERFACES
+    *     @note   Each interface has its own chip, configured by calling begin() after selecting it,
+    *           and its own IP configuration, ARP store, UDP listeners, TCP client and Stash pages.
+    *           The data buffer is shared. Interface 0, ether, is selected at startup.
+    *           Selecting moves a pointer per module, nothing is copied
+    */
+    static void selectInterface (uint8_t iface);
+
+#if ETHERCARD_INTERFACES > 1
+    /**   @brief  Get the instance of an interface, e.g. to read its configuration without selecting it
+    *     @param  iface Interface number, less than ETHERCARD_INTERFACES
+    *     @return <i>EtherCard&</i> The instance, ether for interface 0
+    */
+    static EtherCard& instance (uint8_t iface);
+#endif
+
+    /**   @brief  Route IPv4 packets between the interfaces
+    *     @note   A unicast packet sent to our MAC address but not to our IP address leaves on the
+    *           interface whose subnet holds its destination, or else on the first other interface
+    *           with a gateway, with its TTL decremented. Packets longer than the data buffer and
+    *           packets whose next hop is not in the ARP store yet are dropped; the latter trigger an
+    *           ARP request. Only available with ETHERCARD_INTERFACES above 1
+    */
+    static void enableForwarding ();
+
+    /**   @brief  Stop routing packets between the interfaces
+    */
+    static void disableForwarding ();
+
     /**   @brief  Request the IP associated hardware address (ARP lookup). Use
     *             clientWaitIp(ip) to get the ARP lookup status
     */
@@ -220,11 +444,20 @@ public:
     *     @param  result_cb Pointer to callback function that handles TCP result
     *     @param  datafill_cb Pointer to callback function that handles TCP data payload
     *     @param  port Remote TCP/IP port to connect to
+    *     @param  ip Remote IP address to connect to, hisip if null
     *     @return <i>unit8_t</i> ID of TCP/IP session (0-7)
-    *     @note   Return value provides id of the request to allow up to 7 concurrent requests
+    *     @note   Return value provides id of the request to allow up to ETHERCARD_TCP_CLIENTS concurrent requests
+    *     @note   result_cb gets status 3 if the server resets the session or never answers its SYN
+    *     @note   Within result_cb, packetTime() gives the arrival time of the segment
     */
     static uint8_t clientTcpReq (uint8_t (*result_cb)(uint8_t,uint8_t,uint16_t,uint16_t),
-                                 uint16_t (*datafill_cb)(uint8_t),uint16_t port);
+                                 uint16_t (*datafill_cb)(uint8_t),uint16_t port,
+                                 const uint8_t *ip = 0);
+
+    /**   @brief  Count the TCP client sessions which are not closed yet
+    *     @return <i>uint8_t</i> Number of sessions from the request to the server's reply
+    */
+    static uint8_t tcpClientSessions ();
 
     /**   @brief  Prepare HTTP request
     *     @param  urlbuf Pointer to c-string URL folder
@@ -270,9 +503,11 @@ public:
     /**   @brief  Process network time protocol response
     *     @param  time Pointer to integer to hold result
     *     @param  dstport_l Destination port to expect response. Set to zero to accept on any port
+    *     @param  arrival Pointer to integer to hold micros() when the response arrived, may be null;
+    *             add the time elapsed since then to the result
     *     @return <i>uint8_t</i> True (1) on success
     */
-    static uint8_t ntpProcessAnswer (uint32_t *time, uint8_t dstport_l);
+    static uint8_t ntpProcessAnswer (uint32_t *time, uint8_t dstport_l, uint32_t *arrival = 0);
 
     /**   @brief  Prepare a UDP message for transmission
     *     @param  sport Source port
@@ -286,6 +521,25 @@ public:
     */
     static void udpTransmit (uint16_t len);
 
+    /**   @brief  Store a UDP packet prepared with udpPrepare() in chip memory instead of sending it
+    *     @param  len Size of payload
+    *     @return <i>ENC28J60Template</i> Handle for udpTemplateSend(), start is 0 if there is not enough chip memory
+    *     @note   Meant for packets which are sent over and over, e.g. beacons or wake on lan. It needs a
+    *           layout which leaves a heap for enc_malloc(), such as ENC28J60::layoutSensorSink, and
+    *           ENC_HEAP_UNIT_MAX
+    */
+    static ENC28J60Template udpTemplate (uint16_t len);
+
+    /**   @brief  Send a UDP packet stored with udpTemplate(), optionally changing part of its payload first
+    *     @param  tmpl Template returned by udpTemplate()
+    *     @param  offset Offset within the payload of the bytes to change
+    *     @param  data Pointer to the new bytes, 0 to send the packet unchanged
+    *     @param  len Number of bytes to change
+    *     @note   Only the changed bytes go over SPI and the UDP checksum is updated incrementally
+    */
+    static void udpTemplateSend (const ENC28J60Template& tmpl, uint16_t offset = 0,
+                                 const void *data = 0, uint16_t len = 0);
+
     /**   @brief  Sends a UDP packet
     *     @param  data Pointer to data
     *     @param  len Size of payload (maximum 220 octets / bytes)
@@ -319,6 +573,9 @@ public:
 
     // new stash-based API
     /**   @brief  Send TCP request
+    *     @note   The Stash is released once the request went out, so unless ETHERCARD_TCP_COPIES
+    *             keeps a copy in chip memory, a request the server does not acknowledge is not
+    *             sent again but the session reset; tcpReply() then never returns a reply
     */
     static uint8_t tcpSend ();
 
@@ -501,6 +758,18 @@ public:
     */
     static uint16_t getTcpPayloadLength();
 
+    /**   @brief  Read the payload of the current TCP segment straight from the chip
+    *     @return <i>ENC28J60Reader</i> Reader over all getTcpPayloadLength() bytes
+    *     @note   The data buffer only holds the start of a segment longer than it, the reader gets all of it
+    */
+    static ENC28J60Reader tcpPayloadReader();
+
+    /**   @brief  Read the payload of the current UDP datagram straight from the chip, e.g. in a UdpServerCallback
+    *     @return <i>ENC28J60Reader</i> Reader over the whole payload
+    *     @note   The data buffer only holds the start of a datagram longer than it, the reader gets all of it
+    */
+    static ENC28J60Reader udpPayloadReader();
+
     /**   @brief Check if IP is in ARP store
     *     @param ip IP to check (size must be IP_LEN)
     *     @return <i>bool</i> True if IP is in ARP store
@@ -9,6 +9,22 @@
 
 #define gPB ether.buffer
 
+// The instance the static API works on
+#if ETHERCARD_INTERFACES > 1
+#define gNIC (*static_cast<EtherCard*>(ENC28J60::nic))
+#else
+#define gNIC ether
+#endif
+
+#if ETHERCARD_INTERFACES > 1
+// Point the state of each module at that of interface iface, see ETHERCARD_INTERFACE_STATE
+void tcpSelect (uint8_t iface);
+void arpSelect (uint8_t iface);
+void dhcpSelect (uint8_t iface);
+void dnsSelect (uint8_t iface);
+void udpSelect (uint8_t iface);
+#endif
+
 inline EthHeader &ethernet_header()
 {
     uint8_t *iter = gPB; // avoid strict aliasing warning
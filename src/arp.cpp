@@ -1,4 +1,5 @@
 #include "EtherCard.h"
+#include "EtherUtil.h"
 
 struct ArpEntry
 {
@@ -7,7 +8,12 @@ struct ArpEntry
     uint8_t count;
 };
 
-static ArpEntry store[ETHERCARD_ARP_STORE_SIZE];
+// What an interface knows about its neighbours
+struct ArpState {
+    ArpEntry store[ETHERCARD_ARP_STORE_SIZE] = {};
+};
+
+ETHERCARD_INTERFACE_STATE(ArpState, arp)
 
 static void incArpEntry(ArpEntry &e)
 {
@@ -38,7 +44,7 @@ static void incArpEntry(ArpEntry &e)
 
 static ArpEntry *findArpStoreEntry(const uint8_t *ip)
 {
-    for (ArpEntry *iter = store, *last = store + ETHERCARD_ARP_STORE_SIZE;
+    for (ArpEntry *iter = arp->store, *last = arp->store + ETHERCARD_ARP_STORE_SIZE;
             iter != last; ++iter)
     {
         if (memcmp(ip, iter->ip, IP_LEN) == 0)
@@ -66,8 +72,8 @@ void EtherCard::arpStoreSet(const uint8_t *ip, const uint8_t *mac)
     if (!e)
     {
         // find less used entry
-        e = store;
-        for (ArpEntry *iter = store + 1, *last = store + ETHERCARD_ARP_STORE_SIZE;
+        e = arp->store;
+        for (ArpEntry *iter = arp->store + 1, *last = arp->store + ETHERCARD_ARP_STORE_SIZE;
                 iter != last; ++iter)
         {
             if (iter->count < e->count)
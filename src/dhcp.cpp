@@ -98,16 +98,23 @@ typedef struct {
 // The time value of 0xffffffff is reserved to represent "infinity".
 #define DHCP_INFINITE_LEASE  0xffffffff
 
-static byte dhcpState = DHCP_STATE_INIT;
-static char hostname[DHCP_HOSTNAME_MAX_LEN] = "Arduino-ENC28j60-00";   // Last two characters will be filled by last 2 MAC digits ;
-static uint32_t currentXid;
-static uint32_t stateTimer;
-static uint32_t leaseStart;
-static uint32_t leaseTime;
-static byte* bufPtr;
+// The lease of one interface
+struct DhcpState {
+    byte dhcpState = DHCP_STATE_INIT;
+    char hostname[DHCP_HOSTNAME_MAX_LEN] = "Arduino-ENC28j60-00";   // Last two characters will be filled by last 2 MAC digits ;
+    uint32_t currentXid = 0;
+    uint32_t stateTimer = 0;
+    uint32_t leaseStart = 0;
+    uint32_t leaseTime = 0;
+
+    uint8_t* dhcpCustomOptionList = NULL;
+    DhcpOptionCallback dhcpCustomOptionCallback = NULL;
+    uint8_t dhcpOptionList[2] = {}; // the list of the single option of dhcpAddOptionCallback()
+};
+
+ETHERCARD_INTERFACE_STATE(DhcpState, dhcp)
 
-static uint8_t* dhcpCustomOptionList = NULL;
-static DhcpOptionCallback dhcpCustomOptionCallback = NULL;
+static byte* bufPtr;
 
 extern uint8_t allOnes[];// = { 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF };
 
@@ -163,7 +170,7 @@ static void addOption (byte opt, byte len, const byte* data) {
 static void send_dhcp_message(uint8_t *requestip) {
 
     EtherCard::udpPrepare(DHCP_CLIENT_PORT,
-                          (dhcpState == DHCP_STATE_BOUND ? EtherCard::dhcpip : allOnes),
+                          (dhcp->dhcpState == DHCP_STATE_BOUND ? gNIC.dhcpip : allOnes),
                           DHCP_SERVER_PORT);
 
     // If we ever don't do this, the DHCP renewal gets sent to whatever random
@@ -177,11 +184,11 @@ static void send_dhcp_message(uint8_t *requestip) {
     dhcpPtr->op = DHCP_BOOTREQUEST;
     dhcpPtr->htype = 1;
     dhcpPtr->hlen = 6;
-    dhcpPtr->xid = currentXid;
-    if (dhcpState == DHCP_STATE_BOUND) {
-        EtherCard::copyIp(dhcpPtr->ciaddr, EtherCard::myip);
+    dhcpPtr->xid = dhcp->currentXid;
+    if (dhcp->dhcpState == DHCP_STATE_BOUND) {
+        EtherCard::copyIp(dhcpPtr->ciaddr, gNIC.myip);
     }
-    EtherCard::copyMac(dhcpPtr->chaddr, EtherCard::mymac);
+    EtherCard::copyMac(dhcpPtr->chaddr, gNIC.mymac);
 
     // DHCP magic cookie
     dhcpPtr->magicCookie = HTONL(0x63825363);
@@ -191,27 +198,27 @@ static void send_dhcp_message(uint8_t *requestip) {
 
     addToBuf(DHCP_OPT_MESSAGE_TYPE); // DHCP_STATE_SELECTING, DHCP_STATE_REQUESTING
     addToBuf(1);   // Length
-    addToBuf(dhcpState == DHCP_STATE_INIT ? DHCP_DISCOVER : DHCP_REQUEST);
+    addToBuf(dhcp->dhcpState == DHCP_STATE_INIT ? DHCP_DISCOVER : DHCP_REQUEST);
 
     // Client Identifier Option, this is the client mac address
     addToBuf(DHCP_OPT_CLIENT_IDENTIFIER);
     addToBuf(1 + ETH_LEN); // Length (hardware type + client MAC)
     addToBuf(DHCP_HTYPE_ETHER);
-    addBytes(ETH_LEN, EtherCard::mymac);
+    addBytes(ETH_LEN, gNIC.mymac);
 
-    if (hostname[0]) {
-        addOption(DHCP_OPT_HOSTNAME, strlen(hostname), (byte*) hostname);
+    if (dhcp->hostname[0]) {
+        addOption(DHCP_OPT_HOSTNAME, strlen(dhcp->hostname), (byte*) dhcp->hostname);
     }
 
     if (requestip != NULL) {
         addOption(DHCP_OPT_REQUESTED_ADDRESS, IP_LEN, requestip);
-        addOption(DHCP_OPT_SERVER_IDENTIFIER, IP_LEN, EtherCard::dhcpip);
+        addOption(DHCP_OPT_SERVER_IDENTIFIER, IP_LEN, gNIC.dhcpip);
     }
 
     // Additional info in parameter list - minimal list for what we need
     byte len = 3;
-    if (dhcpCustomOptionList) {
-        uint8_t *p = dhcpCustomOptionList;
+    if (dhcp->dhcpCustomOptionList) {
+        uint8_t *p = dhcp->dhcpCustomOptionList;
         while (*p++ != 0) len++;
     }
     addToBuf(DHCP_OPT_PARAMETER_REQUEST_LIST);
@@ -219,8 +226,8 @@ static void send_dhcp_message(uint8_t *requestip) {
     addToBuf(DHCP_OPT_SUBNET_MASK);
     addToBuf(DHCP_OPT_ROUTERS);
     addToBuf(DHCP_OPT_DOMAIN_NAME_SERVERS);
-    if (dhcpCustomOptionList) {
-        uint8_t *p = dhcpCustomOptionList; // Custom option list
+    if (dhcp->dhcpCustomOptionList) {
+        uint8_t *p = dhcp->dhcpCustomOptionList; // Custom option list
         while (*p != 0) {
             addToBuf(*p++);
         }
@@ -244,7 +251,7 @@ static void process_dhcp_offer(uint16_t len, uint8_t *offeredip) {
         byte option = *ptr++;
         byte optionLen = *ptr++;
         if (option == DHCP_OPT_SERVER_IDENTIFIER) {
-            EtherCard::copyIp(EtherCard::dhcpip, ptr);
+            EtherCard::copyIp(gNIC.dhcpip, ptr);
             break;
         }
         ptr += optionLen;
@@ -256,7 +263,7 @@ static void process_dhcp_ack(uint16_t len) {
     DHCPdata *dhcpPtr = (DHCPdata*) (udp_payload());
 
     // Allocated IP address is in yiaddr
-    EtherCard::copyIp(EtherCard::myip, dhcpPtr->yiaddr);
+    EtherCard::copyIp(gNIC.myip, dhcpPtr->yiaddr);
 
     // Scan through variable length option list identifying options we want
     byte *ptr = (byte*) (dhcpPtr + 1);
@@ -266,21 +273,21 @@ static void process_dhcp_ack(uint16_t len) {
         byte optionLen = *ptr++;
         switch (option) {
         case DHCP_OPT_SUBNET_MASK:
-            EtherCard::copyIp(EtherCard::netmask, ptr);
+            EtherCard::copyIp(gNIC.netmask, ptr);
             break;
         case DHCP_OPT_ROUTERS:
-            EtherCard::copyIp(EtherCard::gwip, ptr);
+            EtherCard::copyIp(gNIC.gwip, ptr);
             break;
         case DHCP_OPT_DOMAIN_NAME_SERVERS:
-            EtherCard::copyIp(EtherCard::dnsip, ptr);
+            EtherCard::copyIp(gNIC.dnsip, ptr);
             break;
         case DHCP_OPT_LEASE_TIME:
         case DHCP_OPT_RENEWAL_TIME:
-            leaseTime = 0;
+            dhcp->leaseTime = 0;
             for (byte i = 0; i<4; i++)
-                leaseTime = (leaseTime << 8) + ptr[i];
-            if (leaseTime != DHCP_INFINITE_LEASE) {
-                leaseTime *= 1000;      // milliseconds
+                dhcp->leaseTime = (dhcp->leaseTime << 8) + ptr[i];
+            if (dhcp->leaseTime != DHCP_INFINITE_LEASE) {
+                dhcp->leaseTime *= 1000;      // milliseconds
             }
             break;
         case DHCP_OPT_END:
@@ -288,11 +295,11 @@ static void process_dhcp_ack(uint16_t len) {
             break;
         default: {
             // Is is a custom configured option?
-            if (dhcpCustomOptionList) {
-                uint8_t *p = dhcpCustomOptionList;
+            if (dhcp->dhcpCustomOptionList) {
+                uint8_t *p = dhcp->dhcpCustomOptionList;
                 while (*p != 0) {
                     if (option == *p) {
-                        dhcpCustomOptionCallback(option, ptr, optionLen);
+                        dhcp->dhcpCustomOptionCallback(option, ptr, optionLen);
                         break;
                     }
                     p++;
@@ -310,8 +317,9 @@ static bool dhcp_received_message_type (uint16_t len, byte msgType) {
     DHCPdata *dhcpPtr = (DHCPdata*) (udp_payload());
 
     if (len >= 70 && udp_header().sport == HTONS(DHCP_SERVER_PORT) &&
-            dhcpPtr->xid == currentXid ) {
+            dhcpPtr->xid == dhcp->currentXid ) {
 
+        EtherCard::packetFetch();
         byte *ptr = (byte*) (dhcpPtr + 1);
         do {
             byte option = *ptr++;
@@ -336,57 +344,56 @@ bool EtherCard::dhcpSetup (const char *hname, bool fromRam) {
     // That shouldn't be a problem, because we don't have an IPaddress yet.
     // Will try 60 secs to obtain DHCP-lease.
 
-    using_dhcp = true;
+    gNIC.using_dhcp = true;
 
     if(hname != NULL) {
         if(fromRam) {
-            strncpy(hostname, hname, DHCP_HOSTNAME_MAX_LEN);
+            strncpy(dhcp->hostname, hname, DHCP_HOSTNAME_MAX_LEN);
         }
         else {
-            strncpy_P(hostname, hname, DHCP_HOSTNAME_MAX_LEN);
+            strncpy_P(dhcp->hostname, hname, DHCP_HOSTNAME_MAX_LEN);
         }
     }
     else {
         // Set a unique hostname, use Arduino-?? with last octet of mac address
-        hostname[strlen(hostname) - 2] = toAsciiHex(mymac[5] >> 4);   // Appends mac to last 2 digits of the hostname
-        hostname[strlen(hostname) - 1] = toAsciiHex(mymac[5]);   // Even if it's smaller than the maximum <thus, strlen(hostname)>
+        dhcp->hostname[strlen(dhcp->hostname) - 2] = toAsciiHex(gNIC.mymac[5] >> 4);   // Appends mac to last 2 digits of the hostname
+        dhcp->hostname[strlen(dhcp->hostname) - 1] = toAsciiHex(gNIC.mymac[5]);   // Even if it's smaller than the maximum <thus, strlen(hostname)>
     }
 
-    dhcpState = DHCP_STATE_INIT;
+    dhcp->dhcpState = DHCP_STATE_INIT;
     uint16_t start = millis();
 
-    while (dhcpState != DHCP_STATE_BOUND && uint16_t(millis()) - start < 60000) {
+    while (dhcp->dhcpState != DHCP_STATE_BOUND && uint16_t(millis()) - start < 60000) {
         if (isLinkUp()) DhcpStateMachine(packetReceive());
     }
     updateBroadcastAddress();
-    delaycnt = 0;
-    return dhcpState == DHCP_STATE_BOUND ;
+    gNIC.delaycnt = 0;
+    return dhcp->dhcpState == DHCP_STATE_BOUND ;
 }
 
 void EtherCard::dhcpAddOptionCallback(uint8_t option, DhcpOptionCallback callback)
 {
-    static uint8_t optionList[2];
-    optionList[0] = option;
-    optionList[1] = 0;
-    dhcpCustomOptionList = optionList;
-    dhcpCustomOptionCallback = callback;
+    dhcp->dhcpOptionList[0] = option;
+    dhcp->dhcpOptionList[1] = 0;
+    dhcp->dhcpCustomOptionList = dhcp->dhcpOptionList;
+    dhcp->dhcpCustomOptionCallback = callback;
 }
 
 void EtherCard::dhcpAddOptionCallback(uint8_t* optionlist, DhcpOptionCallback callback)
 {
-    dhcpCustomOptionList = optionlist;
-    dhcpCustomOptionCallback = callback;
+    dhcp->dhcpCustomOptionList = optionlist;
+    dhcp->dhcpCustomOptionCallback = callback;
 }
 
 void EtherCard::DhcpStateMachine (uint16_t len)
 {
 
 #ifdef DHCPDEBUG
-    if (dhcpState != DHCP_STATE_BOUND) {
+    if (dhcp->dhcpState != DHCP_STATE_BOUND) {
         Serial.print(millis());
         Serial.print(" State: ");
     }
-    switch (dhcpState) {
+    switch (dhcp->dhcpState) {
     case DHCP_STATE_INIT:
         Serial.println("Init");
         break;
@@ -402,24 +409,24 @@ void EtherCard::DhcpStateMachine (uint16_t len)
     }
 #endif
 
-    switch (dhcpState) {
+    switch (dhcp->dhcpState) {
 
     case DHCP_STATE_BOUND:
         //!@todo Due to millis() wrap-around, DHCP renewal may not work if leaseTime is larger than 49days
-        if (leaseTime != DHCP_INFINITE_LEASE && millis() - leaseStart >= leaseTime) {
-            send_dhcp_message(myip);
-            dhcpState = DHCP_STATE_RENEWING;
-            stateTimer = millis();
+        if (dhcp->leaseTime != DHCP_INFINITE_LEASE && millis() - dhcp->leaseStart >= dhcp->leaseTime) {
+            send_dhcp_message(gNIC.myip);
+            dhcp->dhcpState = DHCP_STATE_RENEWING;
+            dhcp->stateTimer = millis();
         }
         break;
 
     case DHCP_STATE_INIT:
-        currentXid = millis();
-        memset(myip,0,IP_LEN); // force ip 0.0.0.0
+        dhcp->currentXid = millis();
+        memset(gNIC.myip,0,IP_LEN); // force ip 0.0.0.0
         send_dhcp_message(NULL);
         enableBroadcast(true); //Temporarily enable broadcasts
-        dhcpState = DHCP_STATE_SELECTING;
-        stateTimer = millis();
+        dhcp->dhcpState = DHCP_STATE_SELECTING;
+        dhcp->stateTimer = millis();
         break;
 
     case DHCP_STATE_SELECTING:
@@ -427,11 +434,11 @@ void EtherCard::DhcpStateMachine (uint16_t len)
             uint8_t offeredip[IP_LEN];
             process_dhcp_offer(len, offeredip);
             send_dhcp_message(offeredip);
-            dhcpState = DHCP_STATE_REQUESTING;
-            stateTimer = millis();
+            dhcp->dhcpState = DHCP_STATE_REQUESTING;
+            dhcp->stateTimer = millis();
         } else {
-            if (millis() - stateTimer > DHCP_REQUEST_TIMEOUT) {
-                dhcpState = DHCP_STATE_INIT;
+            if (millis() - dhcp->stateTimer > DHCP_REQUEST_TIMEOUT) {
+                dhcp->dhcpState = DHCP_STATE_INIT;
             }
         }
         break;
@@ -441,12 +448,13 @@ void EtherCard::DhcpStateMachine (uint16_t len)
         if (dhcp_received_message_type(len, DHCP_ACK)) {
             disableBroadcast(true); //Disable broadcast after temporary enable
             process_dhcp_ack(len);
-            leaseStart = millis();
-            if (gwip[0] != 0) setGwIp(gwip); // why is this? because it initiates an arp request
-            dhcpState = DHCP_STATE_BOUND;
+            updateFilters();
+            dhcp->leaseStart = millis();
+            if (gNIC.gwip[0] != 0) setGwIp(gNIC.gwip); // why is this? because it initiates an arp request
+            dhcp->dhcpState = DHCP_STATE_BOUND;
         } else {
-            if (millis() - stateTimer > DHCP_REQUEST_TIMEOUT) {
-                dhcpState = DHCP_STATE_INIT;
+            if (millis() - dhcp->stateTimer > DHCP_REQUEST_TIMEOUT) {
+                dhcp->dhcpState = DHCP_STATE_INIT;
             }
         }
         break;
@@ -454,5 +462,3 @@ void EtherCard::DhcpStateMachine (uint16_t len)
     }
 }
 
-
-
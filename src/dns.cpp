@@ -8,17 +8,21 @@
 #include "EtherUtil.h"
 #include "net.h"
 
-static byte dnstid_l; // a counter for transaction ID
+struct DnsState {
+    byte dnstid_l = 0; // a counter for transaction ID
+};
+
+ETHERCARD_INTERFACE_STATE(DnsState, dns)
 #define DNSCLIENT_SRC_PORT_H 0xE0
 
 #define DNS_TYPE_A 1
 #define DNS_CLASS_IN 1
 
 static void dnsRequest (const char *hostname, bool fromRam) {
-    ++dnstid_l; // increment for next request, finally wrap
-    if (ether.dnsip[0] == 0)
-        memset(ether.dnsip, 8, IP_LEN); // use 8.8.8.8 Google DNS as default
-    ether.udpPrepare((DNSCLIENT_SRC_PORT_H << 8) | dnstid_l, ether.dnsip, DNS_PORT);
+    ++dns->dnstid_l; // increment for next request, finally wrap
+    if (gNIC.dnsip[0] == 0)
+        memset(gNIC.dnsip, 8, IP_LEN); // use 8.8.8.8 Google DNS as default
+    ether.udpPrepare((DNSCLIENT_SRC_PORT_H << 8) | dns->dnstid_l, gNIC.dnsip, DNS_PORT);
     uint8_t *udpp = udp_payload();
     byte *p = udpp;
     memset(p, 0, 12);
@@ -45,7 +49,7 @@ static void dnsRequest (const char *hostname, bool fromRam) {
     *p++ = DNS_CLASS_IN;
     byte i = p - udpp;
     udpp[0] = i;
-    udpp[1] = dnstid_l;
+    udpp[1] = dns->dnstid_l;
     udpp[2] = 1; // flags, standard recursive query
     udpp[5] = 1; // 1 question
     ether.udpTransmit(i);
@@ -60,9 +64,10 @@ static bool checkForDnsAnswer (uint16_t plen) {
     UdpHeader &udph = udp_header();
     byte *p = udp_payload(); //start of UDP payload
     if (plen < 70 || udph.sport != HTONS(DNS_PORT) || //from DNS source port
-            ntohs(udph.dport) != (uint16_t)(DNSCLIENT_SRC_PORT_H << 8 | dnstid_l) || //response to same port as we sent from
-            p[1] != dnstid_l) //message id same as we sent
+            ntohs(udph.dport) != (uint16_t)(DNSCLIENT_SRC_PORT_H << 8 | dns->dnstid_l) || //response to same port as we sent from
+            p[1] != dns->dnstid_l) //message id same as we sent
         return false; //not our DNS response
+    EtherCard::packetFetch();
     if((p[3] & 0x0F) != 0)
         return true; //DNS response received with error
 
@@ -80,7 +85,7 @@ static bool checkForDnsAnswer (uint16_t plen) {
         if (p + 14 > gPB + plen)
             break;
         if (p[1] == DNS_TYPE_A && p[9] == 4) { // type "A" and IPv4
-            ether.copyIp(ether.hisip, p + 10);
+            ether.copyIp(gNIC.hisip, p + 10);
             break;
         }
         p += p[9] + 10;
@@ -104,11 +109,11 @@ bool EtherCard::dnsLookup (const char* name, bool fromRam) {
             return false; //timeout waiting for gateway ARP
     }
 
-    memset(hisip, 0, IP_LEN);
+    memset(gNIC.hisip, 0, IP_LEN);
     dnsRequest(name, fromRam);
 
     start = millis();
-    while (hisip[0] == 0) {
+    while (gNIC.hisip[0] == 0) {
         if (uint16_t(millis()) - start >= 30000)
             return false; //timeout waiting for dns response
         word len = packetReceive();
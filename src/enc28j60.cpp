@@ -13,11 +13,14 @@
 #else
 #include <Wprogram.h> // Arduino 0022
 #endif
+#include <avr/eeprom.h>
 #include "enc28j60.h"
 
-uint16_t ENC28J60::bufferSize;
-bool ENC28J60::broadcast_enabled = false;
-bool ENC28J60::promiscuous_enabled = false;
+const ENC28J60Layout ENC28J60::layoutDefault    = { 0x0C00, 0x0600, 0x0E00 };
+const ENC28J60Layout ENC28J60::layoutSensorSink = { 0x1600, 0x0600, 0x0200 };
+const ENC28J60Layout ENC28J60::layoutWebServer  = { 0x0800, 0x1200, 0x0600 };
+const ENC28J60Layout ENC28J60::layoutHttpClient = { 0x0800, 0x0600, 0x1200 };
+const ENC28J60Layout ENC28J60::layoutBufferPool = { 0x0C00, 0x0600, 0x0400 };
 
 // ENC28J60 Control Registers
 // Control register definitions are a combination of address,
@@ -42,10 +45,10 @@ bool ENC28J60::promiscuous_enabled = false;
 #define ERXST           (0x08|0x00)
 #define ERXND           (0x0A|0x00)
 #define ERXRDPT         (0x0C|0x00)
-// #define ERXWRPT         (0x0E|0x00)
+#define ERXWRPT         (0x0E|0x00)
 #define EDMAST          (0x10|0x00)
 #define EDMAND          (0x12|0x00)
-// #define EDMADST         (0x14|0x00)
+#define EDMADST         (0x14|0x00)
 #define EDMACS          (0x16|0x00)
 // Bank 1 registers
 #define EHT0             (0x00|0x20)
@@ -65,7 +68,7 @@ bool ENC28J60::promiscuous_enabled = false;
 #define EPMM6            (0x0E|0x20)
 #define EPMM7            (0x0F|0x20)
 #define EPMCS           (0x10|0x20)
-// #define EPMO            (0x14|0x20)
+#define EPMO            (0x14|0x20)
 #define EWOLIE           (0x16|0x20)
 #define EWOLIR           (0x17|0x20)
 #define ERXFCON          (0x18|0x20)
@@ -138,6 +141,10 @@ bool ENC28J60::promiscuous_enabled = false;
 #define ECON2_PKTDEC     0x40
 #define ECON2_PWRSV      0x20
 #define ECON2_VRPS       0x08
+// ENC28J60 EFLOCON Register Bit Definitions
+#define EFLOCON_FULDPXS  0x04
+#define EFLOCON_FCEN1    0x02
+#define EFLOCON_FCEN0    0x01
 // ENC28J60 ECON1 Register Bit Definitions
 #define ECON1_TXRST      0x80
 #define ECON1_RXRST      0x40
@@ -206,6 +213,11 @@ bool ENC28J60::promiscuous_enabled = false;
 #define PHCON2_TXDIS     0x2000
 #define PHCON2_JABBER    0x0400
 #define PHCON2_HDLDIS    0x0100
+// ENC28J60 PHY PHSTAT2 Register Bit Definitions
+#define PHSTAT2_LSTAT    0x0400
+// ENC28J60 PHY PHIE Register Bit Definitions
+#define PHIE_PLNKIE      0x0010
+#define PHIE_PGEIE       0x0002
 
 // ENC28J60 Packet Control Byte Bit Definitions
 #define PKTCTRL_PHUGEEN  0x08
@@ -228,8 +240,145 @@ bool ENC28J60::promiscuous_enabled = false;
 
 #define FULL_SPEED  1   // switch to full-speed SPI for bulk transfers
 
-static byte Enc28j60Bank;
-static byte selectPin;
+#define DEFAULT_FILTERS (ERXFCON_UCEN|ERXFCON_CRCEN|ERXFCON_PMEN|ERXFCON_BCEN)
+
+// Transmit ring: frames are queued back-to-back between txFirst and
+// txLast, each one taking the control byte, the frame itself and the
+// transmit status vector which the MAC writes behind it. The MAC sends one
+// frame at a time; the next one is started when the previous one is reaped.
+struct transmit_slot {
+    uint16_t start; // control byte, i.e. ETXST
+    uint16_t end;   // last byte of the frame, i.e. ETXND
+    ENC28J60SendCallback done; // set by packetSendAsync()
+};
+
+// What the driver keeps about one chip besides the members of its ENC28J60
+struct ChipState {
+    byte Enc28j60Bank = 0;
+    byte selectPin = 0;
+#if ETHERCARD_SPI_TRANSPORT
+    ENC28J60Transport* transport = 0;
+#endif
+
+    // Buffer memory layout chosen by initialize(), the default one until then
+    uint16_t rxStop = RXSTOP_INIT;         // last byte of the receive ring
+    uint16_t txFirst = TXSTART_INIT;       // first byte of the transmit ring
+    uint16_t txLast = TXSTOP_INIT;         // last byte of the transmit ring
+    uint16_t scratchStart = SCRATCH_START; // page 0 of the scratch area
+    uint16_t scratchLimit = SCRATCH_LIMIT; // past end of the scratch area, start of the heap
+#if ENC_HEAP_UNIT_MAX
+    uint16_t heapUnits = 0;                // ENC_HEAP_UNIT blocks in the heap
+
+    // one bit per heap unit marks it used, another one the last unit of a block
+    byte heapUsed[ENC_HEAP_MAP_SIZE] = {};
+    byte heapLast[ENC_HEAP_MAP_SIZE] = {};
+#endif
+
+    uint16_t rxNextPacket = RXSTART_INIT;  // header of the next frame in the receive ring
+    bool rxUnreleased = false;             // the frame before it still has to be freed
+#if ETHERCARD_FULL_DUPLEX && ETHERCARD_PAUSE_THRESHOLD
+    uint16_t rxPauseHigh = 0;              // receive ring fill which starts PAUSE frames
+    bool rxPaused = false;                 // the MAC keeps sending PAUSE frames
+#endif
+    byte rxFilters = DEFAULT_FILTERS;      // ERXFCON outside of promiscuous mode
+
+    // Interrupt mode and arrival times, see enableInterrupt()
+    bool rxInterrupt = false;              // set by enableInterrupt()
+    byte rxEventsSeen = 0;                 // written by the main loop only
+    bool rxPending = false;                // EPKTCNT may be non-zero
+    uint32_t rxEventStamp = 0;             // stamp of the last event pollEvents() saw
+    bool rxEventStamped = false;           // rxEventStamp belongs to the next frame
+    uint32_t rxTime = 0;                   // arrival of the frame packetReceive() returned
+
+    // Frame last returned by packetReceive, valid until the next call
+    uint16_t rxFrame = 0;    // address of its first byte in the receive ring
+    uint16_t rxFrameLen = 0; // its full length without CRC, even if truncated in buffer
+    uint16_t rxLen = 0;      // number of bytes which packetReceive returned
+    uint16_t rxFetched = 0;  // number of bytes copied into buffer so far
+
+    transmit_slot txQueue[ETHERCARD_TX_QUEUE] = {};
+    byte txHead = 0;    // oldest frame, the one the MAC is working on
+    byte txCount = 0;   // number of queued frames
+    byte txRetry = 0;   // late collision retries of the oldest frame
+    byte txRetryLimit = ETHERCARD_RETRY_LATECOLLISIONS ? 16 : 0;
+    byte txRetired = 0; // frames retired so far, i.e. the token of the last one
+#if ETHERCARD_TX_STATS
+    byte txSample = 0;  // frames since the last decoded transmit status vector
+#endif
+};
+
+ETHERCARD_INTERFACE_STATE(ChipState, enc)
+
+#if ETHERCARD_SPI_TRANSPORT
+
+void ENC28J60Transport::readBytes (uint16_t len, uint8_t* data) {
+    while (len--)
+        *data++ = transfer(0x00);
+}
+
+void ENC28J60Transport::writeBytes (uint16_t len, const uint8_t* data) {
+    while (len--)
+        transfer(*data++);
+}
+
+void ENC28J60::setTransport (ENC28J60Transport* t) {
+    enc->transport = t;
+}
+
+void ENC28J60::initSPI () {
+}
+
+static bool isSPIReady () {
+    return enc->transport != NULL;
+}
+
+static void enableChip () {
+    enc->transport->select();
+}
+
+static void disableChip () {
+    enc->transport->deselect();
+}
+
+static byte readOp (byte op, byte address) {
+    enableChip();
+    enc->transport->transfer(op | (address & ADDR_MASK));
+    byte result = enc->transport->transfer(0x00);
+    if (address & 0x80)
+        result = enc->transport->transfer(0x00);
+    disableChip();
+    return result;
+}
+
+static void writeOp (byte op, byte address, byte data) {
+    enableChip();
+    enc->transport->transfer(op | (address & ADDR_MASK));
+    enc->transport->transfer(data);
+    disableChip();
+}
+
+static void readBuf(uint16_t len, byte* data) {
+    enableChip();
+    if (len != 0) {
+        enc->transport->transfer(ENC28J60_READ_BUF_MEM);
+        enc->transport->readBytes(len, data);
+    }
+    disableChip();
+}
+
+static void writeBuf(uint16_t len, const byte* data) {
+    enableChip();
+    if (len != 0) {
+        enc->transport->transfer(ENC28J60_WRITE_BUF_MEM);
+        enc->transport->writeBytes(len, data);
+    }
+    disableChip();
+}
+
+#else
+
+void ENC28J60::setTransport (ENC28J60Transport* /* t */) {
+}
 
 void ENC28J60::initSPI () {
     pinMode(SS, OUTPUT);
@@ -246,13 +395,19 @@ void ENC28J60::initSPI () {
     bitSet(SPSR, SPI2X);
 }
 
+static bool isSPIReady () {
+    if (bitRead(SPCR, SPE) == 0)
+        ENC28J60::initSPI();
+    return true;
+}
+
 static void enableChip () {
     cli();
-    digitalWrite(selectPin, LOW);
+    digitalWrite(enc->selectPin, LOW);
 }
 
 static void disableChip () {
-    digitalWrite(selectPin, HIGH);
+    digitalWrite(enc->selectPin, HIGH);
     sei();
 }
 
@@ -320,11 +475,13 @@ static void writeBuf(uint16_t len, const byte* data) {
     disableChip();
 }
 
+#endif
+
 static void SetBank (byte address) {
-    if ((address & BANK_MASK) != Enc28j60Bank) {
+    if ((address & BANK_MASK) != enc->Enc28j60Bank) {
         writeOp(ENC28J60_BIT_FIELD_CLR, ECON1, ECON1_BSEL1|ECON1_BSEL0);
-        Enc28j60Bank = address & BANK_MASK;
-        writeOp(ENC28J60_BIT_FIELD_SET, ECON1, Enc28j60Bank>>5);
+        enc->Enc28j60Bank = address & BANK_MASK;
+        writeOp(ENC28J60_BIT_FIELD_SET, ECON1, enc->Enc28j60Bank>>5);
     }
 }
 
@@ -363,12 +520,47 @@ static void writePhy (byte address, uint16_t data) {
         ;
 }
 
-byte ENC28J60::initialize (uint16_t size, const byte* macaddr, byte csPin) {
-    bufferSize = size;
-    if (bitRead(SPCR, SPE) == 0)
-        initSPI();
-    selectPin = csPin;
-    pinMode(selectPin, OUTPUT);
+// Both rings must hold a full-size frame: 6 header bytes plus padding on the
+// receive side, the control byte and the 7 byte status vector on the transmit side
+static bool applyLayout (const ENC28J60Layout& layout) {
+    if (layout.rxSize < MAX_FRAMELEN + 8 || (layout.rxSize & 1) ||
+            layout.txSize < MAX_FRAMELEN + 8 ||
+            (layout.scratchSize & (SCRATCH_PAGE_SIZE - 1)) ||
+            (layout.scratchSize >> SCRATCH_PAGE_SHIFT) > SCRATCH_PAGE_MAX ||
+            (uint32_t) layout.rxSize + layout.txSize + layout.scratchSize > ENC_HEAP_END)
+        return false;
+    enc->rxStop = RXSTART_INIT + layout.rxSize - 1;
+    enc->txFirst = enc->rxStop + 1;
+    enc->txLast = enc->txFirst + layout.txSize - 1;
+    enc->scratchStart = enc->txLast + 1;
+    enc->scratchLimit = enc->scratchStart + layout.scratchSize;
+#if ENC_HEAP_UNIT_MAX
+    enc->heapUnits = (ENC_HEAP_END - enc->scratchLimit) / ENC_HEAP_UNIT;
+    if (enc->heapUnits > ENC_HEAP_UNIT_MAX)
+        enc->heapUnits = ENC_HEAP_UNIT_MAX;
+    memset(enc->heapUsed, 0, sizeof enc->heapUsed);
+    memset(enc->heapLast, 0, sizeof enc->heapLast);
+#endif
+    enc->rxNextPacket = RXSTART_INIT;
+    enc->rxUnreleased = false;
+#if ETHERCARD_FULL_DUPLEX && ETHERCARD_PAUSE_THRESHOLD
+    enc->rxPauseHigh = (uint32_t) layout.rxSize * ETHERCARD_PAUSE_THRESHOLD / 100;
+    enc->rxPaused = false;
+#endif
+    return true;
+}
+
+byte ENC28J60::scratchPages () {
+    return (enc->scratchLimit - enc->scratchStart) >> SCRATCH_PAGE_SHIFT;
+}
+
+byte ENC28J60::initialize (uint16_t size, const byte* macaddr, byte csPin,
+                           const ENC28J60Layout& layout) {
+    nic->bufferSize = size;
+    if (!isSPIReady() || !applyLayout(layout))
+        return 0;
+    enc->selectPin = csPin;
+    pinMode(enc->selectPin, OUTPUT);
     disableChip();
 
     writeOp(ENC28J60_SOFT_RESET, 0, ENC28J60_SOFT_RESET);
@@ -378,21 +570,35 @@ byte ENC28J60::initialize (uint16_t size, const byte* macaddr, byte csPin) {
 
     writeReg(ERXST, RXSTART_INIT);
     writeReg(ERXRDPT, RXSTART_INIT);
-    writeReg(ERXND, RXSTOP_INIT);
-    writeReg(ETXST, TXSTART_INIT);
-    writeReg(ETXND, TXSTOP_INIT);
+    writeReg(ERXND, enc->rxStop);
+    writeReg(ETXST, enc->txFirst);
+    writeReg(ETXND, enc->txLast);
 
     // Stretch pulses for LED, LED_A=Link, LED_B=activity
     writePhy(PHLCON, 0x476);
 
-    writeRegByte(ERXFCON, ERXFCON_UCEN|ERXFCON_CRCEN|ERXFCON_PMEN|ERXFCON_BCEN);
+    // the pattern filter accepts broadcast ARP frames: destination ff:ff:ff:ff:ff:ff
+    // and type 0x0806, see setPatternFilter()
+    enc->rxFilters = DEFAULT_FILTERS;
+    writeRegByte(ERXFCON, enc->rxFilters);
     writeReg(EPMM0, 0x303f);
     writeReg(EPMCS, 0xf7f9);
+#if ETHERCARD_FULL_DUPLEX
+    // PHY and MAC must agree on the duplex mode; the gaps are the values the
+    // data sheet gives for full duplex, MAIPGH is not used
+    writePhy(PHCON1, PHCON1_PDPXMD);
+    writeRegByte(MACON1, MACON1_MARXEN|MACON1_TXPAUS|MACON1_RXPAUS);
+    writeOp(ENC28J60_BIT_FIELD_SET, MACON3,
+            MACON3_PADCFG0|MACON3_TXCRCEN|MACON3_FRMLNEN|MACON3_FULDPX);
+    writeReg(MAIPG, 0x0012);
+    writeRegByte(MABBIPG, 0x15);
+#else
     writeRegByte(MACON1, MACON1_MARXEN);
     writeOp(ENC28J60_BIT_FIELD_SET, MACON3,
             MACON3_PADCFG0|MACON3_TXCRCEN|MACON3_FRMLNEN);
     writeReg(MAIPG, 0x0C12);
     writeRegByte(MABBIPG, 0x12);
+#endif
     writeReg(MAMXFL, MAX_FRAMELEN);
     writeRegByte(MAADR5, macaddr[0]);
     writeRegByte(MAADR4, macaddr[1]);
@@ -400,9 +606,19 @@ byte ENC28J60::initialize (uint16_t size, const byte* macaddr, byte csPin) {
     writeRegByte(MAADR2, macaddr[3]);
     writeRegByte(MAADR1, macaddr[4]);
     writeRegByte(MAADR0, macaddr[5]);
+#if !ETHERCARD_FULL_DUPLEX
     writePhy(PHCON2, PHCON2_HDLDIS);
+#endif
+
+    // Let the PHY report link changes through EIR.LINKIF, so that the link
+    // state only has to be read over MII when it actually changes
+    writePhy(PHIE, PHIE_PGEIE|PHIE_PLNKIE);
+    readPhyByte(PHIR); // clear stale interrupt flags
+    nic->linkState = readPhyByte(PHSTAT2) & (PHSTAT2_LSTAT >> 8);
+    nic->linkFlaps = 0;
+
     SetBank(ECON1);
-    writeOp(ENC28J60_BIT_FIELD_SET, EIE, EIE_INTIE|EIE_PKTIE);
+    writeOp(ENC28J60_BIT_FIELD_SET, EIE, EIE_INTIE|EIE_PKTIE|EIE_LINKIE);
     writeOp(ENC28J60_BIT_FIELD_SET, ECON1, ECON1_RXEN);
 
     byte rev = readRegByte(EREVID);
@@ -414,8 +630,84 @@ byte ENC28J60::initialize (uint16_t size, const byte* macaddr, byte csPin) {
     return rev;
 }
 
+// Interrupt mode: the ISR only counts falling edges of the INT pin, the main
+// loop compares that count with the events it has seen. With one writer on
+// each side and single byte counters this is a lock-free SPSC ring whose
+// entries carry no data.
+static volatile byte rxEvents[ETHERCARD_INTERFACES]; // written by the ISRs only
+
+// Arrival times: the INT pin only falls when the first frame lands in an
+// empty ring, so the ISR stamps that frame. Frames queued behind it get the
+// time at which packetReceive() found them.
+static volatile uint32_t rxStamps[ETHERCARD_INTERFACES]; // written by the ISRs only
+
+#if ETHERCARD_INTERFACES > 1
+static byte iface;                  // selected interface
+#else
+static const byte iface = 0;
+#endif
+
+// one ISR per interface, each chip has its own INT pin
+template <byte n> static void rxInterruptHandler () {
+    rxStamps[n] = micros();
+    ++rxEvents[n];
+}
+
+static void (* const rxInterruptHandlers[])() = {
+    rxInterruptHandler<0>,
+#if ETHERCARD_INTERFACES > 1
+    rxInterruptHandler<1>,
+#endif
+#if ETHERCARD_INTERFACES > 2
+    rxInterruptHandler<2>,
+#endif
+#if ETHERCARD_INTERFACES > 3
+    rxInterruptHandler<3>,
+#endif
+};
+
+// Look at EIR, unless the INT pin reported nothing since the last time
+static void pollEvents () {
+    if (enc->rxInterrupt) {
+        if (rxEvents[iface] == enc->rxEventsSeen)
+            return;
+        noInterrupts();
+        enc->rxEventsSeen = rxEvents[iface];
+        enc->rxEventStamp = rxStamps[iface];
+        interrupts();
+        enc->rxEventStamped = true;
+        enc->rxPending = true;
+    }
+    // EIR is a common register, so this costs a single register read
+    if (readOp(ENC28J60_READ_CTRL_REG, EIR) & EIR_LINKIF) {
+        readPhyByte(PHIR); // reading PHIR clears PGIF and thereby LINKIF
+        bool up = readPhyByte(PHSTAT2) & (PHSTAT2_LSTAT >> 8);
+        // a link which went down and came back between two polls still counts
+        ENC28J60::nic->linkFlaps += up == ENC28J60::nic->linkState ? 2 : 1;
+        ENC28J60::nic->linkState = up;
+    }
+}
+
 bool ENC28J60::isLinkUp() {
-    return (readPhyByte(PHSTAT2) >> 2) & 1;
+    pollEvents();
+    return nic->linkState;
+}
+
+void ENC28J60::enableInterrupt(byte intPin) {
+    pinMode(intPin, INPUT);
+    enc->rxEventsSeen = rxEvents[iface];
+    // the pin may already be low, in which case no edge will come
+    enc->rxPending = true;
+    enc->rxInterrupt = true;
+    attachInterrupt(digitalPinToInterrupt(intPin), rxInterruptHandlers[iface], FALLING);
+}
+
+bool ENC28J60::packetAvailable() {
+    return !enc->rxInterrupt || enc->rxPending || rxEvents[iface] != enc->rxEventsSeen;
+}
+
+uint32_t ENC28J60::packetTime() {
+    return enc->rxTime;
 }
 
 /*
@@ -447,65 +739,75 @@ struct transmit_status_vector {
     uint8_t bytes[7];
 };
 
-#if ETHERCARD_SEND_PIPELINING
-    #define BREAKORCONTINUE retry=0; continue;
-#else
-    #define BREAKORCONTINUE break;
-#endif
+// bytes read up front with ETHERCARD_LAZY_RECEIVE: Ethernet, IP and TCP
+// headers without options, which covers ARP, ICMP and UDP headers as well
+#define LAZY_HEADER_LEN 54
 
-void ENC28J60::packetSend(uint16_t len) {
-    byte retry = 0;
-
-    #if ETHERCARD_SEND_PIPELINING
-        goto resume_last_transmission;
-    #endif
-    while (1) {
-        // latest errata sheet: DS80349C
-        // always reset transmit logic (Errata Issue 12)
-        // the Microchip TCP/IP stack implementation used to first check
-        // whether TXERIF is set and only then reset the transmit logic
-        // but this has been changed in later versions; possibly they
-        // have a reason for this; they don't mention this in the errata
-        // sheet
-        writeOp(ENC28J60_BIT_FIELD_SET, ECON1, ECON1_TXRST);
-        writeOp(ENC28J60_BIT_FIELD_CLR, ECON1, ECON1_TXRST);
-        writeOp(ENC28J60_BIT_FIELD_CLR, EIR, EIR_TXERIF|EIR_TXIF);
-
-        // prepare new transmission
-        if (retry == 0) {
-            writeReg(EWRPT, TXSTART_INIT);
-            writeReg(ETXND, TXSTART_INIT+len);
-            writeOp(ENC28J60_WRITE_BUF_MEM, 0, 0x00);
-            writeBuf(len, buffer);
-        }
+static uint16_t rxWrap (uint16_t addr) {
+    return addr > enc->rxStop ? addr - (enc->rxStop - RXSTART_INIT + 1) : addr;
+}
 
-        // initiate transmission
-        writeOp(ENC28J60_BIT_FIELD_SET, ECON1, ECON1_TXRTS);
-        #if ETHERCARD_SEND_PIPELINING
-            if (retry == 0) return;
-        #endif
-
-    resume_last_transmission:
-
-        // wait until transmission has finished; referring to the data sheet and
-        // to the errata (Errata Issue 13; Example 1) you only need to wait until either
-        // TXIF or TXERIF gets set; however this leads to hangs; apparently Microchip
-        // realized this and in later implementations of their tcp/ip stack they introduced
-        // a counter to avoid hangs; of course they didn't update the errata sheet
-        uint16_t count = 0;
-        while ((readRegByte(EIR) & (EIR_TXIF | EIR_TXERIF)) == 0 && ++count < 1000U)
-            ;
+static void txStart () {
+    const transmit_slot& slot = enc->txQueue[enc->txHead];
+    // latest errata sheet: DS80349C
+    // always reset transmit logic (Errata Issue 12)
+    // the Microchip TCP/IP stack implementation used to first check
+    // whether TXERIF is set and only then reset the transmit logic
+    // but this has been changed in later versions; possibly they
+    // have a reason for this; they don't mention this in the errata
+    // sheet
+    writeOp(ENC28J60_BIT_FIELD_SET, ECON1, ECON1_TXRST);
+    writeOp(ENC28J60_BIT_FIELD_CLR, ECON1, ECON1_TXRST);
+    writeOp(ENC28J60_BIT_FIELD_CLR, EIR, EIR_TXERIF|EIR_TXIF);
+
+    writeReg(ETXST, slot.start);
+    writeReg(ETXND, slot.end);
+    writeOp(ENC28J60_BIT_FIELD_SET, ECON1, ECON1_TXRTS);
+}
 
-        if (!(readRegByte(EIR) & EIR_TXERIF) && count < 1000U) {
-            // no error; start new transmission
-            BREAKORCONTINUE
-        }
+#if ETHERCARD_TX_STATS
+// Add a transmit status vector to txStats, see table 7-1 of the data sheet
+static void txDecode (const transmit_status_vector& tsv) {
+    ENC28J60::TxStats& stats = ENC28J60::nic->txStats;
+    ++stats.sampled;
+    stats.bytes += tsv.bytes[4] | tsv.bytes[5] << 8;
+    stats.collisions += tsv.bytes[2] & 0x0F;
+    if (tsv.bytes[3] & (1<<2 | 1<<3)) // packet defer, excessive defer
+        ++stats.deferrals;
+    if (tsv.bytes[3] & 1<<4)
+        ++stats.aborts;
+    if (tsv.bytes[3] & 1<<5)
+        ++stats.lateCollisions;
+    if (tsv.bytes[3] & 1<<7)
+        ++stats.underruns;
+}
+#endif
 
-        // cancel previous transmission if stuck
+// Retire the oldest frame, given the EIR value seen when it finished; zero
+// means the transmission is stuck
+static void txComplete (byte eir) {
+    if ((eir & (EIR_TXIF|EIR_TXERIF)) != EIR_TXIF) {
+        // cancel transmission if stuck
         writeOp(ENC28J60_BIT_FIELD_CLR, ECON1, ECON1_TXRTS);
+        if (eir & EIR_TXERIF)
+            ++ENC28J60::nic->txStats.errors;
+        else
+            ++ENC28J60::nic->txStats.timeouts;
+    }
 
-    #if ETHERCARD_RETRY_LATECOLLISIONS == 0
-        BREAKORCONTINUE
+    // the MAC only writes the vector once it is done with the frame
+#if ETHERCARD_TX_STATS
+    bool sample = (eir & EIR_TXIF) && ++enc->txSample >= ETHERCARD_TX_STATS;
+#else
+    bool sample = false;
+#endif
+    if ((eir & EIR_TXERIF) || sample) {
+        transmit_status_vector tsv;
+        writeReg(ERDPT, enc->txQueue[enc->txHead].end + 1);
+        readBuf(sizeof(transmit_status_vector), tsv.bytes);
+    #if ETHERCARD_TX_STATS
+        enc->txSample = 0;
+        txDecode(tsv);
     #endif
 
         // Check whether the chip thinks that a late collision occurred; the chip
@@ -513,37 +815,504 @@ void ENC28J60::packetSend(uint16_t len) {
         // LATECOL in the ESTAT register in order to find out whether the chip
         // thinks a late collision occurred but (Errata Issue 15) tells us that
         // this is not working. Therefore we check TSV
-        transmit_status_vector tsv;
-        uint16_t etxnd = readReg(ETXND);
-        writeReg(ERDPT, etxnd+1);
-        readBuf(sizeof(transmit_status_vector), (byte*) &tsv);
         // LATECOL is bit number 29 in TSV (starting from 0)
+        if ((eir & EIR_TXERIF) && (tsv.bytes[3] & 1<<5) /*tsv.transmitLateCollision*/ && enc->txRetry < enc->txRetryLimit) {
+            ++enc->txRetry;
+            txStart();
+            return;
+        }
+    }
+
+    // start the next frame before telling about this one
+    ENC28J60SendCallback done = enc->txQueue[enc->txHead].done;
+    ++ENC28J60::nic->txStats.frames;
+    ++enc->txRetired;
+    enc->txRetry = 0;
+    enc->txHead = (enc->txHead + 1) % ETHERCARD_TX_QUEUE;
+    if (--enc->txCount)
+        txStart();
+    if (done)
+        done(enc->txRetired, (eir & (EIR_TXIF|EIR_TXERIF)) == EIR_TXIF);
+}
+
+// Reap the oldest frame if the MAC is done with it, without waiting
+static void txPoll () {
+    if (enc->txCount) {
+        byte eir = readOp(ENC28J60_READ_CTRL_REG, EIR);
+        if (eir & (EIR_TXIF|EIR_TXERIF))
+            txComplete(eir);
+    }
+}
+
+// Wait until the MAC is done with the oldest frame and reap it
+static void txWait () {
+    // referring to the data sheet and to the errata (Errata Issue 13; Example 1)
+    // you only need to wait until either TXIF or TXERIF gets set; however this
+    // leads to hangs; apparently Microchip realized this and in later
+    // implementations of their tcp/ip stack they introduced a counter to avoid
+    // hangs; of course they didn't update the errata sheet
+    uint16_t count = 0;
+    byte eir;
+    while (((eir = readOp(ENC28J60_READ_CTRL_REG, EIR)) & (EIR_TXIF|EIR_TXERIF)) == 0 && ++count < 1000U)
+        ;
+#if ETHERCARD_TX_WAITS
+    byte bucket = 0;
+    while (count >> bucket)
+        ++bucket;
+    ++ENC28J60::nic->txStats.waits[bucket];
+#endif
+    txComplete(eir);
+}
+
+// Templates are queued like any other frame but live in the heap, outside the ring
+static bool txInRing (const transmit_slot& slot) {
+    return slot.start >= enc->txFirst && slot.start <= enc->txLast;
+}
+
+// Find room for size bytes behind the newest frame, wrapping to txFirst
+// if needed; returns zero if the ring is full or too small for them (the RX
+// buffer owns address 0)
+static uint16_t txAlloc (uint16_t size) {
+    if (enc->txCount == ETHERCARD_TX_QUEUE || size > enc->txLast - enc->txFirst + 1)
+        return 0;
+    const transmit_slot* oldest = 0;
+    const transmit_slot* newest = 0;
+    for (byte i = 0; i < enc->txCount; ++i) {
+        const transmit_slot& slot = enc->txQueue[(enc->txHead + i) % ETHERCARD_TX_QUEUE];
+        if (txInRing(slot)) {
+            if (!oldest)
+                oldest = &slot;
+            newest = &slot;
+        }
+    }
+    if (!oldest)
+        return enc->txFirst;
+    uint16_t head = oldest->start;
+    uint16_t tail = newest->end + 1 + sizeof(transmit_status_vector);
+    if (tail > head) {
+        if (tail + size - 1 <= enc->txLast)
+            return tail;
+        tail = enc->txFirst;
+    }
+    return tail + size <= head ? tail : 0;
+}
+
+// Claim room for a frame of len bytes in the ring, without starting it yet;
+// returns the address of its control byte. Every layout has room for a frame
+// of MAX_FRAMELEN, callers must not ask for more
+static uint16_t txReserve (uint16_t len) {
+    // control byte, frame and transmit status vector
+    uint16_t size = 1 + len + sizeof(transmit_status_vector);
+    uint16_t start;
+
+    txPoll();
+    while ((start = txAlloc(size)) == 0)
+        txWait();
+
+    transmit_slot& slot = enc->txQueue[(enc->txHead + enc->txCount) % ETHERCARD_TX_QUEUE];
+    slot.start = start;
+    slot.end = start + len;
+    slot.done = 0;
+    return start;
+}
+
+// Copy a frame from the data buffer into the ring, without starting it yet;
+// returns the address of its control byte. The MAC would not send a frame
+// longer than MAX_FRAMELEN anyway, so it gets cut short
+static uint16_t txWrite (uint16_t len) {
+    if (len > MAX_FRAMELEN)
+        len = MAX_FRAMELEN;
+    uint16_t start = txReserve(len);
+    writeReg(EWRPT, start);
+    writeOp(ENC28J60_WRITE_BUF_MEM, 0, 0x00);
+    writeBuf(len, ENC28J60::buffer);
+    return start;
+}
+
+// Hand the frame written by txWrite to the MAC
+static void txCommit () {
+    if (enc->txCount++ == 0)
+        txStart();
+}
+
+void ENC28J60::packetSend(uint16_t len) {
+    txWrite(len);
+    txCommit();
+}
+
+byte ENC28J60::packetSendAsync(uint16_t len, ENC28J60SendCallback done) {
+    txWrite(len);
+    enc->txQueue[(enc->txHead + enc->txCount) % ETHERCARD_TX_QUEUE].done = done;
+    txCommit();
+    return enc->txRetired + enc->txCount;
+}
+
+bool ENC28J60::packetSendPending(byte token) {
+    txPoll();
+    return (byte) (token - enc->txRetired - 1) < enc->txCount;
+}
+
+void ENC28J60::setLateCollisionRetries(byte retries) {
+    enc->txRetryLimit = retries;
+}
+
+// Run the DMA engine over EDMAST..EDMAND and wait until it is done
+static void dmaRun (byte mode) {
+    writeOp(ENC28J60_BIT_FIELD_SET, ECON1, ECON1_DMAST | mode);
+    while (readOp(ENC28J60_READ_CTRL_REG, ECON1) & ECON1_DMAST)
+        ;
+    if (mode)
+        writeOp(ENC28J60_BIT_FIELD_CLR, ECON1, mode);
+}
+
+// Copy start..end to dest within the chip; the source wraps at ERXND
+static void dmaCopy (uint16_t start, uint16_t end, uint16_t dest) {
+    writeReg(EDMAST, start);
+    writeReg(EDMAND, end);
+    writeReg(EDMADST, dest);
+    dmaRun(0);
+}
+
+// Sum start..end like the IP checksum, without the final complement
+static uint16_t dmaSum (uint16_t start, uint16_t end) {
+    writeReg(EDMAST, start);
+    writeReg(EDMAND, end);
+    dmaRun(ECON1_CSUMEN);
+    // EDMACS holds the complemented sum, high byte first on the wire
+    return ~readReg(EDMACS);
+}
+
+// Add the fields which are not part of the frame and store the checksum
+static void txChecksum (uint16_t frame, uint16_t sumPos, uint32_t sum, uint16_t sumAdd) {
+    sum += sumAdd;
+    while (sum >> 16)
+        sum = (uint16_t) sum + (sum >> 16);
+    byte ck[] = { (byte) (~sum >> 8), (byte) ~sum };
 
-        if (!((readRegByte(EIR) & EIR_TXERIF) && (tsv.bytes[3] & 1<<5) /*tsv.transmitLateCollision*/) || retry > 16U) {
-            // there was some error but no LATECOL so we do not repeat
-            BREAKORCONTINUE
+    writeReg(EWRPT, frame + sumPos);
+    writeBuf(sizeof ck, ck);
+}
+
+#if ETHERCARD_DMA_CHECKSUM
+void ENC28J60::packetSendChecksum(uint16_t len, uint16_t sumStart, uint16_t sumPos, uint16_t sumAdd) {
+    if (len > MAX_FRAMELEN)
+        len = MAX_FRAMELEN;
+    uint16_t frame = txWrite(len) + 1; // skip the control byte
+
+    // let the DMA engine sum the frame from sumStart to its end
+    txChecksum(frame, sumPos, dmaSum(frame + sumStart, frame + len - 1), sumAdd);
+    txCommit();
+}
+#endif
+
+// Sum bytes like the IP checksum, odd if the first one is the low byte of a word
+static uint32_t sumBytes (uint32_t sum, const byte* data, uint16_t len, bool odd) {
+    while (len--) {
+        sum += odd ? *data : *data << 8;
+        ++data;
+        odd = !odd;
+    }
+    return sum;
+}
+
+// Stash pages hold 63 data bytes and the number of the next page in the last
+// byte; the first page starts with a 3 byte StashHeader, see stash.h
+#define STASH_PAGE_DATA 63
+
+void ENC28J60::packetSendSegments(uint16_t headerLen, const ENC28J60Segment* segs, byte count,
+                                  uint16_t sumStart, uint16_t sumPos, uint16_t sumAdd) {
+    uint32_t total = headerLen;
+    for (byte i = 0; i < count; ++i)
+        total += segs[i].len;
+    if (total > MAX_FRAMELEN) {
+        ++nic->txStats.oversized;
+        return;
+    }
+    uint16_t len = total;
+    uint16_t frame = txReserve(len) + 1; // skip the control byte
+
+    writeReg(EWRPT, frame - 1);
+    writeOp(ENC28J60_WRITE_BUF_MEM, 0, 0x00);
+    writeBuf(headerLen, buffer);
+
+    // the checksum is summed on the way: by the MCU for bytes which pass
+    // through it, by the DMA engine for bytes copied within the chip
+    uint32_t sum = 0;
+    if (sumStart && sumStart < headerLen)
+        sum = sumBytes(0, buffer + sumStart, headerLen - sumStart, false);
+
+    uint16_t pos = headerLen;
+    for (byte i = 0; i < count; ++i) {
+        const ENC28J60Segment& seg = segs[i];
+        writeReg(EWRPT, frame + pos);
+        if (seg.source == ENC28J60Segment::STASH) {
+            byte page = seg.stash, off = 3;
+            for (uint16_t skip = (uintptr_t) seg.data; skip > 0; ) {
+                // the segment starts further into the Stash
+                byte n = STASH_PAGE_DATA - off;
+                if (n > skip) {
+                    off += skip;
+                    break;
+                }
+                skip -= n;
+                page = peekin(page, STASH_PAGE_DATA);
+                off = 0;
+            }
+            for (uint16_t left = seg.len; left > 0; ) {
+                byte n = STASH_PAGE_DATA - off;
+                if (n > left)
+                    n = left;
+                uint16_t src = enc->scratchStart + (page << SCRATCH_PAGE_SHIFT) + off;
+                dmaCopy(src, src + n - 1, frame + pos);
+                if (sumStart) {
+                    // a block summed from an odd offset has its bytes swapped
+                    uint16_t part = dmaSum(frame + pos, frame + pos + n - 1);
+                    sum += (pos - sumStart) & 1 ? (uint16_t) (part << 8 | part >> 8) : part;
+                }
+                pos += n;
+                left -= n;
+                page = peekin(page, STASH_PAGE_DATA);
+                off = 0;
+            }
+        } else if (seg.source == ENC28J60Segment::RAM) {
+            writeBuf(seg.len, (const byte*) seg.data);
+            if (sumStart)
+                sum = sumBytes(sum, (const byte*) seg.data, seg.len, (pos - sumStart) & 1);
+            pos += seg.len;
+        } else {
+            // flash and EEPROM pass through a small buffer on the stack
+            const byte* src = (const byte*) seg.data;
+            byte chunk[32];
+            for (uint16_t left = seg.len; left > 0; ) {
+                byte n = left < sizeof chunk ? left : sizeof chunk;
+                if (seg.source == ENC28J60Segment::FLASH)
+                    memcpy_P(chunk, src, n);
+                else
+                    for (byte j = 0; j < n; ++j)
+                        chunk[j] = eeprom_read_byte(src + j);
+                writeBuf(n, chunk);
+                if (sumStart)
+                    sum = sumBytes(sum, chunk, n, (pos - sumStart) & 1);
+                src += n;
+                pos += n;
+                left -= n;
+            }
         }
+    }
+
+    if (sumStart)
+        txChecksum(frame, sumPos, sum, sumAdd);
+    txCommit();
+}
 
-        retry++;
+// Templates: a control byte, the frame and room for the transmit status
+// vector, taken from the heap and sent in place by pointing ETXST/ETXND at it
+ENC28J60Template ENC28J60::templateStore (uint16_t len) {
+    ENC28J60Template tmpl = { enc_malloc(1 + len + sizeof(transmit_status_vector)), len };
+    if (tmpl.start == 0) {
+        tmpl.len = 0;
+        return tmpl;
     }
+    writeReg(EWRPT, tmpl.start);
+    writeOp(ENC28J60_WRITE_BUF_MEM, 0, 0x00);
+    writeBuf(len, buffer);
+    return tmpl;
 }
 
+ENC28J60Template ENC28J60::templateKeep () {
+    // the entry of the frame queued last stays valid until the next one is reserved
+    const transmit_slot& slot = enc->txQueue[(enc->txHead + enc->txCount + ETHERCARD_TX_QUEUE - 1) % ETHERCARD_TX_QUEUE];
+    ENC28J60Template tmpl = { 0, 0 };
+    if (slot.end <= slot.start)
+        return tmpl;
+    tmpl.len = slot.end - slot.start;
+    tmpl.start = enc_malloc(1 + tmpl.len + sizeof(transmit_status_vector));
+    if (tmpl.start == 0)
+        tmpl.len = 0;
+    else
+        dmaCopy(slot.start, slot.end, tmpl.start); // control byte and frame
+    return tmpl;
+}
+
+// The MAC reads the frame while it is sending it, so wait until it is done
+static void templateIdle (uint16_t start) {
+    txPoll();
+    for (byte i = 0; i < enc->txCount; ) {
+        if (enc->txQueue[(enc->txHead + i) % ETHERCARD_TX_QUEUE].start == start) {
+            txWait();
+            i = 0;
+        } else
+            ++i;
+    }
+}
+
+void ENC28J60::templateFree (ENC28J60Template& tmpl) {
+    if (tmpl.start == 0)
+        return;
+    templateIdle(tmpl.start);
+    enc_free(tmpl.start);
+    tmpl.start = 0;
+    tmpl.len = 0;
+}
+
+void ENC28J60::templatePatch (const ENC28J60Template& tmpl, uint16_t offset, const void* data, uint16_t len,
+                              uint16_t sumPos) {
+    templateIdle(tmpl.start);
+    uint16_t frame = tmpl.start + 1;
+    if (sumPos) {
+        // RFC 1624: HC' = ~(~HC + ~m + m'), m being the sum of the bytes replaced
+        byte ck[2];
+        writeReg(ERDPT, frame + sumPos);
+        readBuf(sizeof ck, ck);
+        uint32_t oldSum = 0;
+        writeReg(ERDPT, frame + offset);
+        for (uint16_t n = 0; n < len; ) {
+            byte old[8];
+            uint16_t left = len - n;
+            byte chunk = left < sizeof old ? left : sizeof old;
+            readBuf(chunk, old);
+            oldSum = sumBytes(oldSum, old, chunk, (offset + n) & 1);
+            n += chunk;
+        }
+        while (oldSum >> 16)
+            oldSum = (uint16_t) oldSum + (oldSum >> 16);
+        uint32_t sum = sumBytes((uint16_t) ~(ck[0] << 8 | ck[1]) + (uint16_t) ~oldSum,
+                                (const byte*) data, len, offset & 1);
+        while (sum >> 16)
+            sum = (uint16_t) sum + (sum >> 16);
+        ck[0] = ~sum >> 8;
+        ck[1] = ~sum;
+        writeReg(EWRPT, frame + sumPos);
+        writeBuf(sizeof ck, ck);
+    }
+    writeReg(EWRPT, frame + offset);
+    writeBuf(len, (const byte*) data);
+}
+
+void ENC28J60::templateSend (const ENC28J60Template& tmpl) {
+    if (tmpl.start == 0)
+        return;
+    txPoll();
+    while (enc->txCount == ETHERCARD_TX_QUEUE)
+        txWait();
+    transmit_slot& slot = enc->txQueue[(enc->txHead + enc->txCount) % ETHERCARD_TX_QUEUE];
+    slot.start = tmpl.start;
+    slot.end = tmpl.start + tmpl.len;
+    slot.done = 0;
+    txCommit();
+}
+
+void ENC28J60::packetSendReceived(uint16_t len, uint16_t headerLen) {
+    if (len > enc->rxFrameLen)
+        len = enc->rxFrameLen;
+    if (len > MAX_FRAMELEN)
+        len = MAX_FRAMELEN;
+    if (len == 0)
+        return;
+    if (headerLen > len)
+        headerLen = len;
+    uint16_t frame = txReserve(len) + 1; // skip the control byte
+
+    // copy the remainder within the chip; the DMA source wraps at ERXND
+    if (headerLen < len)
+        dmaCopy(rxWrap(enc->rxFrame + headerLen), rxWrap(enc->rxFrame + len - 1), frame + headerLen);
+
+    writeReg(EWRPT, frame - 1);
+    writeOp(ENC28J60_WRITE_BUF_MEM, 0, 0x00);
+    writeBuf(headerLen, buffer);
+    txCommit();
+}
+
+void ENC28J60::packetFlush() {
+    while (enc->txCount)
+        txWait();
+}
+
+// Bring the receive ring back to a sane state after its pointers got corrupted,
+// without touching the rest of the chip; everything pending is discarded
+static void resetReceiver () {
+    writeOp(ENC28J60_BIT_FIELD_CLR, ECON1, ECON1_RXEN);
+    writeOp(ENC28J60_BIT_FIELD_SET, ECON1, ECON1_RXRST);
+    writeOp(ENC28J60_BIT_FIELD_CLR, ECON1, ECON1_RXRST);
+    byte pending;
+    while ((pending = readRegByte(EPKTCNT)) > 0) {
+        ENC28J60::nic->rxStats.lost += pending;
+        while (pending--)
+            writeOp(ENC28J60_BIT_FIELD_SET, ECON2, ECON2_PKTDEC);
+    }
+    // writing ERXST moves ERXWRPT along; ERXRDPT must be odd (Errata Issue 14)
+    writeReg(ERXST, RXSTART_INIT);
+    writeReg(ERXND, enc->rxStop);
+    writeReg(ERXRDPT, enc->rxStop);
+    writeOp(ENC28J60_BIT_FIELD_CLR, EIR, EIR_RXERIF);
+    writeOp(ENC28J60_BIT_FIELD_SET, ECON1, ECON1_RXEN);
+    enc->rxNextPacket = RXSTART_INIT;
+    enc->rxUnreleased = false;
+    ++ENC28J60::nic->rxStats.resets;
+}
+
+#if ETHERCARD_FULL_DUPLEX && ETHERCARD_PAUSE_THRESHOLD
+// Flow control: above the high-water mark the MAC sends PAUSE frames until
+// told to stop, which it does by sending one with a zero pause time. The fill
+// level counts from the frame about to be read up to the receive write pointer.
+static void rxFlowControl (bool empty) {
+    uint16_t used = 0;
+    if (!empty) {
+        uint16_t wr = readReg(ERXWRPT);
+        used = wr >= enc->rxNextPacket ? wr - enc->rxNextPacket : wr + enc->rxStop + 1 - enc->rxNextPacket;
+    }
+    if (!enc->rxPaused && used > enc->rxPauseHigh) {
+        writeRegByte(EFLOCON, EFLOCON_FCEN1);
+        enc->rxPaused = true;
+        ++ENC28J60::nic->rxStats.pauses;
+    } else if (enc->rxPaused && used < enc->rxPauseHigh / 2) {
+        writeRegByte(EFLOCON, EFLOCON_FCEN1|EFLOCON_FCEN0);
+        enc->rxPaused = false;
+    }
+}
+#endif
+
+uint16_t ENC28J60::rxFree() {
+    // the write pointer never catches up with the frames still to be read,
+    // so meeting the next of them means the ring is empty
+    uint16_t wr = readReg(ERXWRPT);
+    uint16_t used = wr >= enc->rxNextPacket ? wr - enc->rxNextPacket : wr + enc->rxStop + 1 - enc->rxNextPacket;
+    return enc->rxStop + 1 - RXSTART_INIT - used;
+}
 
 uint16_t ENC28J60::packetReceive() {
-    static uint16_t gNextPacketPtr = RXSTART_INIT;
-    static bool     unreleasedPacket = false;
     uint16_t len = 0;
+    enc->rxFrameLen = enc->rxLen = enc->rxFetched = 0;
+
+    txPoll(); // keep the transmit ring moving
 
-    if (unreleasedPacket) {
-        if (gNextPacketPtr == 0)
-            writeReg(ERXRDPT, RXSTOP_INIT);
+    if (enc->rxUnreleased) {
+        if (enc->rxNextPacket == 0)
+            writeReg(ERXRDPT, enc->rxStop);
         else
-            writeReg(ERXRDPT, gNextPacketPtr - 1);
-        unreleasedPacket = false;
+            writeReg(ERXRDPT, enc->rxNextPacket - 1);
+        enc->rxUnreleased = false;
+    }
+
+    if (enc->rxInterrupt) {
+        // a link change shares the INT pin, pollEvents clears it so that
+        // later packets produce a falling edge again
+        pollEvents();
+        if (!enc->rxPending)
+            return 0;
     }
 
-    if (readRegByte(EPKTCNT) > 0) {
-        writeReg(ERDPT, gNextPacketPtr);
+    byte pending = readRegByte(EPKTCNT);
+    if (pending > 0) {
+        if (pending > nic->rxStats.maxPending)
+            nic->rxStats.maxPending = pending;
+        // frames only get lost to overflows while others are queued
+        packetOverflow();
+    #if ETHERCARD_FULL_DUPLEX && ETHERCARD_PAUSE_THRESHOLD
+        rxFlowControl(false);
+    #endif
+
+        writeReg(ERDPT, enc->rxNextPacket);
 
         struct {
             uint16_t nextPacket;
@@ -553,33 +1322,135 @@ uint16_t ENC28J60::packetReceive() {
 
         readBuf(sizeof header, (byte*) &header);
 
-        gNextPacketPtr  = header.nextPacket;
+        // frames start on even addresses, so the next pointer must follow
+        // from the byte count; anything else means the ring is corrupt
+        uint16_t expected = rxWrap(enc->rxNextPacket + sizeof header +
+                                   header.byteCount + (header.byteCount & 1));
+        if (header.nextPacket != expected || header.byteCount > MAX_FRAMELEN + 18) {
+            resetReceiver();
+            return 0;
+        }
+
+        enc->rxTime = enc->rxEventStamped ? enc->rxEventStamp : micros();
+        enc->rxEventStamped = false;
+        enc->rxFrame = rxWrap(enc->rxNextPacket + sizeof header);
+        enc->rxNextPacket = header.nextPacket;
         len = header.byteCount - 4; //remove the CRC count
-        if (len>bufferSize-1)
-            len=bufferSize-1;
-        if ((header.status & 0x80)==0)
+        if ((header.status & 0x80)==0) {
+            ++nic->rxStats.errors;
+            if (header.status & 0x10)
+                ++nic->rxStats.crcErrors;
             len = 0;
-        else
-            readBuf(len, buffer);
+        } else
+            ++nic->rxStats.frames;
+        enc->rxFrameLen = len;
+        if (len>nic->bufferSize-1)
+            len=nic->bufferSize-1;
+        enc->rxLen = len;
+    #if ETHERCARD_LAZY_RECEIVE
+        enc->rxFetched = len < LAZY_HEADER_LEN ? len : LAZY_HEADER_LEN;
+    #else
+        enc->rxFetched = len;
+    #endif
+        readBuf(enc->rxFetched, buffer);
         buffer[len] = 0;
-        unreleasedPacket = true;
+        enc->rxUnreleased = true;
 
         writeOp(ENC28J60_BIT_FIELD_SET, ECON2, ECON2_PKTDEC);
+    } else {
+        if (enc->rxInterrupt) {
+            // INT is level low but interrupts on its falling edge only: a link change
+            // while frames held it low brought no edge of its own. Dropping INTIE and
+            // setting it again makes one if any flag is still set.
+            writeOp(ENC28J60_BIT_FIELD_CLR, EIE, EIE_INTIE);
+            writeOp(ENC28J60_BIT_FIELD_SET, EIE, EIE_INTIE);
+        }
+        enc->rxPending = false;
+        enc->rxEventStamped = false; // the event was a link change
+    #if ETHERCARD_FULL_DUPLEX && ETHERCARD_PAUSE_THRESHOLD
+        if (enc->rxPaused)
+            rxFlowControl(true);
+    #endif
     }
     return len;
 }
 
+bool ENC28J60::packetOverflow() {
+    if (readOp(ENC28J60_READ_CTRL_REG, EIR) & EIR_RXERIF) {
+        writeOp(ENC28J60_BIT_FIELD_CLR, EIR, EIR_RXERIF);
+        ++nic->rxStats.overflows;
+        return true;
+    }
+    return false;
+}
+
+uint16_t ENC28J60::packetFetch() {
+    if (enc->rxFetched < enc->rxLen) {
+        writeReg(ERDPT, rxWrap(enc->rxFrame + enc->rxFetched));
+        readBuf(enc->rxLen - enc->rxFetched, buffer + enc->rxFetched);
+        enc->rxFetched = enc->rxLen;
+    }
+    return enc->rxLen;
+}
+
+uint16_t ENC28J60::packetRefetch() {
+    writeReg(ERDPT, enc->rxFrame);
+    readBuf(enc->rxFetched, buffer);
+    buffer[enc->rxLen] = 0;
+    return enc->rxLen;
+}
+
+ENC28J60Reader::ENC28J60Reader (uint16_t offset, uint16_t len)
+    : start (offset), pos (offset), end (offset), sum (0) {
+    if (offset < enc->rxFrameLen)
+        end = len < enc->rxFrameLen - offset ? offset + len : enc->rxFrameLen;
+}
+
+uint16_t ENC28J60Reader::read (void* dest, uint16_t n) {
+    if (n > end - pos)
+        n = end - pos;
+    if (n) {
+        // ERDPT wraps at the end of the receive ring by itself
+        writeReg(ERDPT, rxWrap(enc->rxFrame + pos));
+        readBuf(n, (byte*) dest);
+        sum = sumBytes(sum, (const byte*) dest, n, (pos - start) & 1);
+        pos += n;
+    }
+    return n;
+}
+
+uint16_t ENC28J60Reader::skip (uint16_t n) {
+    if (n > end - pos)
+        n = end - pos;
+    pos += n;
+    return n;
+}
+
+int16_t ENC28J60Reader::peek () const {
+    if (pos == end)
+        return -1;
+    writeReg(ERDPT, rxWrap(enc->rxFrame + pos));
+    return readOp(ENC28J60_READ_BUF_MEM, 0);
+}
+
+uint16_t ENC28J60Reader::checksum () const {
+    uint32_t folded = sum;
+    while (folded >> 16)
+        folded = (uint16_t) folded + (folded >> 16);
+    return folded;
+}
+
 void ENC28J60::copyout (byte page, const byte* data) {
-    uint16_t destPos = SCRATCH_START + (page << SCRATCH_PAGE_SHIFT);
-    if (destPos < SCRATCH_START || destPos > SCRATCH_LIMIT - SCRATCH_PAGE_SIZE)
+    uint16_t destPos = enc->scratchStart + (page << SCRATCH_PAGE_SHIFT);
+    if (destPos < enc->scratchStart || destPos > enc->scratchLimit - SCRATCH_PAGE_SIZE)
         return;
     writeReg(EWRPT, destPos);
     writeBuf(SCRATCH_PAGE_SIZE, data);
 }
 
 void ENC28J60::copyin (byte page, byte* data) {
-    uint16_t destPos = SCRATCH_START + (page << SCRATCH_PAGE_SHIFT);
-    if (destPos < SCRATCH_START || destPos > SCRATCH_LIMIT - SCRATCH_PAGE_SIZE)
+    uint16_t destPos = enc->scratchStart + (page << SCRATCH_PAGE_SHIFT);
+    if (destPos < enc->scratchStart || destPos > enc->scratchLimit - SCRATCH_PAGE_SIZE)
         return;
     writeReg(ERDPT, destPos);
     readBuf(SCRATCH_PAGE_SIZE, data);
@@ -587,8 +1458,8 @@ void ENC28J60::copyin (byte page, byte* data) {
 
 byte ENC28J60::peekin (byte page, byte off) {
     byte result = 0;
-    uint16_t destPos = SCRATCH_START + (page << SCRATCH_PAGE_SHIFT) + off;
-    if (SCRATCH_START <= destPos && destPos < SCRATCH_LIMIT) {
+    uint16_t destPos = enc->scratchStart + (page << SCRATCH_PAGE_SHIFT) + off;
+    if (enc->scratchStart <= destPos && destPos < enc->scratchLimit) {
         writeReg(ERDPT, destPos);
         readBuf(1, &result);
     }
@@ -598,6 +1469,7 @@ byte ENC28J60::peekin (byte page, byte off) {
 // Contributed by Alex M. Based on code from: http://blog.derouineau.fr
 //                  /2011/07/putting-enc28j60-ethernet-controler-in-sleep-mode/
 void ENC28J60::powerDown() {
+    packetFlush();
     writeOp(ENC28J60_BIT_FIELD_CLR, ECON1, ECON1_RXEN);
     while(readRegByte(ESTAT) & ESTAT_RXBUSY);
     while(readRegByte(ECON1) & ECON1_TXRTS);
@@ -611,39 +1483,90 @@ void ENC28J60::powerUp() {
     writeOp(ENC28J60_BIT_FIELD_SET, ECON1, ECON1_RXEN);
 }
 
+// Set and clear receive filter bits, both in rxFilters and in ERXFCON
+static void changeFilters (byte set, byte clear) {
+    enc->rxFilters = (enc->rxFilters | set) & ~clear;
+    if (!ENC28J60::nic->promiscuous_enabled)
+        writeRegByte(ERXFCON, (readRegByte(ERXFCON) | set) & ~clear);
+}
+
 void ENC28J60::enableBroadcast (bool temporary) {
-    writeRegByte(ERXFCON, readRegByte(ERXFCON) | ERXFCON_BCEN);
+    changeFilters(ERXFCON_BCEN, 0);
     if(!temporary)
-        broadcast_enabled = true;
+        nic->broadcast_enabled = true;
 }
 
 void ENC28J60::disableBroadcast (bool temporary) {
     if(!temporary)
-        broadcast_enabled = false;
-    if(!broadcast_enabled)
-        writeRegByte(ERXFCON, readRegByte(ERXFCON) & ~ERXFCON_BCEN);
+        nic->broadcast_enabled = false;
+    if(!nic->broadcast_enabled)
+        changeFilters(0, ERXFCON_BCEN);
 }
 
 void ENC28J60::enableMulticast () {
-    writeRegByte(ERXFCON, readRegByte(ERXFCON) | ERXFCON_MCEN);
+    changeFilters(ERXFCON_MCEN, 0);
 }
 
 void ENC28J60::disableMulticast () {
-    writeRegByte(ERXFCON, readRegByte(ERXFCON) & ~ERXFCON_MCEN);
+    changeFilters(0, ERXFCON_MCEN);
 }
 
 void ENC28J60::enablePromiscuous (bool temporary) {
     writeRegByte(ERXFCON, readRegByte(ERXFCON) & ERXFCON_CRCEN);
     if(!temporary)
-        promiscuous_enabled = true;
+        nic->promiscuous_enabled = true;
 }
 
 void ENC28J60::disablePromiscuous (bool temporary) {
     if(!temporary)
-        promiscuous_enabled = false;
-    if(!promiscuous_enabled) {
-        writeRegByte(ERXFCON, ERXFCON_UCEN|ERXFCON_CRCEN|ERXFCON_PMEN|ERXFCON_BCEN);
+        nic->promiscuous_enabled = false;
+    if(!nic->promiscuous_enabled) {
+        writeRegByte(ERXFCON, enc->rxFilters);
+    }
+}
+
+// The chip compares the IP checksum of the bytes selected by the mask with
+// EPMCS, the bytes are summed as big endian words like the DMA checksum does
+void ENC28J60::setPatternFilter (uint16_t offset, const byte* mask, const byte* pattern) {
+    uint32_t sum = 0;
+    byte n = 0;
+    for (byte i = 0; i < 8; ++i) {
+        writeRegByte(EPMM0 + i, mask[i]);
+        for (byte m = mask[i]; m != 0; m &= m - 1)
+            sum += (n++ & 1) ? *pattern++ : *pattern++ << 8;
+    }
+    while (sum >> 16)
+        sum = (sum & 0xFFFF) + (sum >> 16);
+    writeReg(EPMO, offset);
+    writeReg(EPMCS, ~sum);
+    changeFilters(ERXFCON_PMEN, 0);
+}
+
+void ENC28J60::disablePatternFilter () {
+    changeFilters(0, ERXFCON_PMEN);
+}
+
+void ENC28J60::setHashFilter (const byte* table) {
+    byte any = 0;
+    for (byte i = 0; i < 8; ++i) {
+        writeRegByte(EHT0 + i, table[i]);
+        any |= table[i];
+    }
+    if (any)
+        changeFilters(ERXFCON_HTEN, 0);
+    else
+        changeFilters(0, ERXFCON_HTEN);
+}
+
+// CRC-32 of the destination address as the MAC computes it for the frame check sequence
+byte ENC28J60::hashFilterIndex (const byte* mac) {
+    uint32_t crc = 0xFFFFFFFF;
+    for (byte i = 0; i < 6; ++i) {
+        crc ^= mac[i];
+        for (byte b = 0; b < 8; ++b)
+            crc = (crc >> 1) ^ (crc & 1 ? 0xEDB88320 : 0);
     }
+    return (~crc >> 23) & 0x3F;
 }
 
 uint8_t ENC28J60::doBIST ( byte csPin) {
@@ -653,10 +1576,10 @@ uint8_t ENC28J60::doBIST ( byte csPin) {
 #define RANDOM_RACE     0b1100
 
 // init
-    if (bitRead(SPCR, SPE) == 0)
-        initSPI();
-    selectPin = csPin;
-    pinMode(selectPin, OUTPUT);
+    if (!isSPIReady())
+        return 0;
+    enc->selectPin = csPin;
+    pinMode(enc->selectPin, OUTPUT);
     disableChip();
 
     writeOp(ENC28J60_SOFT_RESET, 0, ENC28J60_SOFT_RESET);
@@ -740,33 +1663,127 @@ void ENC28J60::memcpy_from_enc(void* dest, uint16_t source, int16_t num) {
     readBuf(num, (uint8_t*) dest);
 }
 
-static uint16_t endRam = ENC_HEAP_END;
+#if ENC_HEAP_UNIT_MAX
+static bool heapBit (const byte* map, uint16_t unit) {
+    return bitRead(map[unit / 8], unit % 8);
+}
+
+static void heapMark (byte* map, uint16_t unit, bool set) {
+    bitWrite(map[unit / 8], unit % 8, set);
+}
+
+// Walk the free runs of the heap; returns the free units, the largest run
+// and the number of runs, and where the smallest run of at least need units starts
+static uint16_t heapScan (uint16_t need, uint16_t& fit, uint16_t& largest, byte& runs) {
+    uint16_t total = 0, fitLen = 0xFFFF, run = 0;
+    fit = 0xFFFF;
+    largest = 0;
+    runs = 0;
+    for (uint16_t unit = 0; unit <= enc->heapUnits; ++unit) {
+        if (unit < enc->heapUnits && !heapBit(enc->heapUsed, unit)) {
+            ++run;
+            continue;
+        }
+        if (run) {
+            total += run;
+            ++runs;
+            if (run > largest)
+                largest = run;
+            if (run >= need && run < fitLen) {
+                fit = unit - run;
+                fitLen = run;
+            }
+            run = 0;
+        }
+    }
+    return total;
+}
+
 uint16_t ENC28J60::enc_malloc(uint16_t size) {
-    if (endRam-size >= ENC_HEAP_START) {
-        endRam -= size;
-        return endRam;
+    uint16_t need = (size + ENC_HEAP_UNIT - 1) / ENC_HEAP_UNIT;
+    uint16_t fit, largest;
+    byte runs;
+    heapScan(need, fit, largest, runs);
+    if (need == 0 || fit == 0xFFFF)
+        return 0;
+    for (uint16_t unit = fit; unit < fit + need; ++unit)
+        heapMark(enc->heapUsed, unit, true);
+    heapMark(enc->heapLast, fit + need - 1, true);
+    return enc->scratchLimit + fit * ENC_HEAP_UNIT;
+}
+
+void ENC28J60::enc_free(uint16_t addr) {
+    if (addr < enc->scratchLimit)
+        return;
+    uint16_t unit = (addr - enc->scratchLimit) / ENC_HEAP_UNIT;
+    if (unit >= enc->heapUnits || !heapBit(enc->heapUsed, unit))
+        return;
+    for (bool last = false; !last; ++unit) {
+        last = heapBit(enc->heapLast, unit);
+        heapMark(enc->heapUsed, unit, false);
+        heapMark(enc->heapLast, unit, false);
     }
+}
+#else
+// without ENC_HEAP_UNIT_MAX there is no heap, whatever the layout leaves
+static uint16_t heapScan (uint16_t, uint16_t& fit, uint16_t& largest, byte& runs) {
+    fit = 0xFFFF;
+    largest = 0;
+    runs = 0;
     return 0;
 }
 
+uint16_t ENC28J60::enc_malloc(uint16_t) {
+    return 0;
+}
+
+void ENC28J60::enc_free(uint16_t) {
+}
+#endif
+
 uint16_t ENC28J60::enc_freemem() {
-    return endRam-ENC_HEAP_START;
+    uint16_t fit, largest;
+    byte runs;
+    return heapScan(0xFFFF, fit, largest, runs) * ENC_HEAP_UNIT;
 }
 
-uint16_t ENC28J60::readPacketSlice(char* dest, int16_t maxlength, int16_t packetOffset) {
-    uint16_t erxrdpt = readReg(ERXRDPT);
-    int16_t packetLength;
+uint16_t ENC28J60::enc_maxfree() {
+    uint16_t fit, largest;
+    byte runs;
+    heapScan(0xFFFF, fit, largest, runs);
+    return largest * ENC_HEAP_UNIT;
+}
 
-    memcpy_from_enc((char*) &packetLength, (erxrdpt+3)%(RXSTOP_INIT+1), 2);
-    packetLength -= 4; // remove crc
+byte ENC28J60::enc_fragments() {
+    uint16_t fit, largest;
+    byte runs;
+    heapScan(0xFFFF, fit, largest, runs);
+    return runs;
+}
 
-    int16_t bytesToCopy = packetLength - packetOffset;
+uint16_t ENC28J60::readPacketSlice(char* dest, int16_t maxlength, int16_t packetOffset) {
+    int16_t bytesToCopy = enc->rxFrameLen - packetOffset;
     if (bytesToCopy > maxlength) bytesToCopy = maxlength;
     if (bytesToCopy <= 0) bytesToCopy = 0;
 
-    int16_t startofSlice = (erxrdpt+7+packetOffset)%(RXSTOP_INIT+1);
-    memcpy_from_enc(dest, startofSlice, bytesToCopy);
+    memcpy_from_enc(dest, rxWrap(enc->rxFrame + packetOffset), bytesToCopy);
     dest[bytesToCopy] = 0;
 
     return bytesToCopy;
 }
+
+void ENC28J60::selectInterface (byte n) {
+#if ETHERCARD_INTERFACES > 1
+    if (n >= ETHERCARD_INTERFACES)
+        return;
+    nic = chip(n);
+    encSelect(n);
+    iface = n;
+#else
+    (void) n;
+#endif
+}
+
+byte ENC28J60::currentInterface () {
+    return iface;
+}
@@ -14,34 +14,196 @@
 #ifndef ENC28J60_H
 #define ENC28J60_H
 
-// buffer boundaries applied to internal 8K ram
+// buffer boundaries applied to internal 8K ram in the default layout, see ENC28J60Layout
 // the entire available packet buffer space is allocated
 
 #define RXSTART_INIT        0x0000  // start of RX buffer, (must be zero, Rev. B4 Errata point 5)
 #define RXSTOP_INIT         0x0BFF  // end of RX buffer, room for 2 packets
 
-#define TXSTART_INIT        0x0C00  // start of TX buffer, room for 1 packet
+#define TXSTART_INIT        0x0C00  // start of TX buffer, room for 1 full-size packet or several small ones
 #define TXSTOP_INIT         0x11FF  // end of TX buffer
 
 #define SCRATCH_START       0x1200  // start of scratch area
-#define SCRATCH_LIMIT       0x2000  // past end of area, i.e. 3 Kb
+#define SCRATCH_LIMIT       0x2000  // past end of area, i.e. 3.5 Kb
 #define SCRATCH_PAGE_SHIFT  6       // addressing is in pages of 64 bytes
 #define SCRATCH_PAGE_SIZE   (1 << SCRATCH_PAGE_SHIFT)
 #define SCRATCH_PAGE_NUM    ((SCRATCH_LIMIT-SCRATCH_START) >> SCRATCH_PAGE_SHIFT)
-#define SCRATCH_MAP_SIZE    (((SCRATCH_PAGE_NUM % 8) == 0) ? (SCRATCH_PAGE_NUM / 8) : (SCRATCH_PAGE_NUM/8+1))
+#define SCRATCH_PAGE_MAX    80      // most pages any layout may give to the scratch area, i.e. 5 Kb
+#define SCRATCH_MAP_SIZE    (((SCRATCH_PAGE_MAX % 8) == 0) ? (SCRATCH_PAGE_MAX / 8) : (SCRATCH_PAGE_MAX/8+1))
 
-// area in the enc memory that can be used via enc_malloc; by default 0 bytes; decrease SCRATCH_LIMIT in order
-// to use this functionality
-#define ENC_HEAP_START      SCRATCH_LIMIT
+// area in the enc memory that can be used via enc_malloc: whatever the layout leaves
+// behind the scratch area, 0 bytes in the default layout
 #define ENC_HEAP_END        0x2000
+#define ENC_HEAP_UNIT       32      // enc_malloc hands out multiples of 32 bytes
+#ifndef ENC_HEAP_UNIT_MAX
+#define ENC_HEAP_UNIT_MAX   0       // most units the heap may use, e.g. 128 for 4 Kb; costs 2 bits of RAM each
+#endif
+#define ENC_HEAP_MAP_SIZE   (((ENC_HEAP_UNIT_MAX % 8) == 0) ? (ENC_HEAP_UNIT_MAX / 8) : (ENC_HEAP_UNIT_MAX/8+1))
+
+/** This structure describes how the 8 KB buffer memory of the ENC28J60 is split up.
+*   The receive ring starts at address 0, the transmit ring follows it, then the
+*   scratch area used by Stash. What is left at the end is handed out by enc_malloc().
+*/
+struct ENC28J60Layout {
+    uint16_t rxSize;      //!< Receive ring, even and at least one full-size frame plus its header
+    uint16_t txSize;      //!< Transmit ring, at least one full-size frame plus its control byte and status vector
+    uint16_t scratchSize; //!< Scratch area, a multiple of SCRATCH_PAGE_SIZE and at most SCRATCH_PAGE_MAX pages
+};
+
+/** This structure describes a finished frame kept in the buffer memory of the chip by
+*   ENC28J60::templateStore(), so that it can be sent again without copying it over SPI.
+*/
+struct ENC28J60Template {
+    uint16_t start; //!< Control byte in the chip buffer memory, 0 if the template could not be stored
+    uint16_t len;   //!< Length of the frame
+};
 
-/** This class provide low-level interfacing with the ENC28J60 network interface. This is used by the EtherCard class and not intended for use by (normal) end users. */
+/** This type definition defines the structure of the function ENC28J60::packetSendAsync() calls
+*   when the MAC is done with a frame. It runs inside other driver calls, e.g. packetReceive() or
+*   packetSend(), so it must neither send nor touch the data buffer; note the outcome and act on it
+*   in the main loop instead.
+*/
+typedef void (*ENC28J60SendCallback)(
+    uint8_t token,  //!< Token which packetSendAsync() returned for the frame
+    bool sent);     //!< True if the frame went out, false if it failed or got stuck, see ENC28J60::txStats
+
+/** This structure describes one piece of a frame sent with ENC28J60::packetSendSegments().
+*   The data is streamed into the transmit buffer straight from where it lives.
+*/
+struct ENC28J60Segment {
+    enum Source {
+        RAM,    //!< data points to RAM
+        FLASH,  //!< data points to PROGMEM
+        EEPROM, //!< data points to EEPROM
+        STASH   //!< stash holds the first block of a Stash, its bytes are copied within the chip
+    };
+    uint8_t source;   //!< Where the data lives, one of Source
+    uint8_t stash;    //!< First block of the Stash, i.e. its handle, if source is STASH
+    uint16_t len;     //!< Number of bytes
+    const void* data; //!< Pointer to the data; if source is STASH the number of bytes to skip at its start
+};
+
+/** This class describes the SPI link between the host and the ENC28J60.
+*   On AVR the driver talks to the SPI registers directly. Other targets, such as
+*   the host build in extras/host, install an implementation with ENC28J60::setTransport().
+*/
+class ENC28J60Transport {
+public:
+    /**   @brief  Assert chip select, i.e. start an SPI transaction
+    */
+    virtual void select () = 0;
+
+    /**   @brief  Release chip select, i.e. end an SPI transaction
+    */
+    virtual void deselect () = 0;
+
+    /**   @brief  Exchange a single byte with the chip
+    *     @param  data Byte to send
+    *     @return <i>uint8_t</i> Byte received
+    */
+    virtual uint8_t transfer (uint8_t data) = 0;
+
+    /**   @brief  Clock a block of bytes in from the chip, sending zeros
+    *     @param  len Number of bytes to read
+    *     @param  data Pointer to buffer to copy data to
+    */
+    virtual void readBytes (uint16_t len, uint8_t* data);
+
+    /**   @brief  Clock a block of bytes out to the chip
+    *     @param  len Number of bytes to write
+    *     @param  data Pointer to buffer to copy data from
+    */
+    virtual void writeBytes (uint16_t len, const uint8_t* data);
+};
+
+/** Keep a histogram of the EIR polls spent waiting for the MAC in ENC28J60::txStats.
+*   Shows whether sending is held up by the wire; costs 22 bytes SRAM.
+*/
+#ifndef ETHERCARD_TX_WAITS
+#define ETHERCARD_TX_WAITS 0
+#endif
+
+/** Number of ENC28J60 chips driven by the firmware, at most 4.
+*   Each one is an EtherCard instance with its own chip select, buffer layout, IP
+*   configuration, ARP store and listeners, ether being the first one;
+*   EtherCard::selectInterface() picks the one the static API works on. With 1 the
+*   choice is made at compile time and costs nothing.
+*/
+#ifndef ETHERCARD_INTERFACES
+#define ETHERCARD_INTERFACES 1
+#endif
+
+// Used by the library sources: what a source keeps for each interface is a struct.
+// ETHERCARD_INTERFACE_STATE(Type, name) defines one per interface and name, the pointer
+// to the one of the selected interface, which name##Select(iface) moves.
+#if ETHERCARD_INTERFACES > 1
+#define ETHERCARD_INTERFACE_STATE(Type, name) \
+    static Type name##States[ETHERCARD_INTERFACES]; \
+    static Type* name = name##States; \
+    void name##Select (uint8_t iface) { name = &name##States[iface]; }
+#else
+#define ETHERCARD_INTERFACE_STATE(Type, name) \
+    static Type name##States[1]; \
+    static Type* const name = name##States;
+#endif
+
+/** This class provide low-level interfacing with the ENC28J60 network interface. This is used by the EtherCard class and not intended for use by (normal) end users.
+*   Each instance holds what is known about one chip, the static functions work on the one nic points to.
+*/
 class ENC28J60 {
 public:
     static uint8_t buffer[]; //!< Data buffer (shared by receive and transmit)
-    static uint16_t bufferSize; //!< Size of data buffer
-    static bool broadcast_enabled; //!< True if broadcasts enabled (used to allow temporary disable of broadcast for DHCP or other internal functions)
-    static bool promiscuous_enabled; //!< True if promiscuous mode enabled (used to allow temporary disable of promiscuous mode)
+    uint16_t bufferSize = 0; //!< Size of data buffer
+    bool broadcast_enabled = false; //!< True if broadcasts enabled (used to allow temporary disable of broadcast for DHCP or other internal functions)
+    bool promiscuous_enabled = false; //!< True if promiscuous mode enabled (used to allow temporary disable of promiscuous mode)
+    bool linkState = false; //!< Cached link state, refreshed by isLinkUp() when the PHY signals a link change
+    uint16_t linkFlaps = 0; //!< Number of link state changes (flaps) seen since initialize(), wraps around
+
+    /** Receive counters, they wrap around and can be cleared by the application */
+    struct RxStats {
+        uint16_t frames;     //!< Frames returned by packetReceive()
+        uint16_t errors;     //!< Frames discarded because the receive status vector flagged an error
+        uint16_t crcErrors;  //!< Part of errors with a CRC error; the chip drops these itself while ERXFCON_CRCEN is set
+        uint16_t overflows;  //!< Receive buffer overflows (EIR.RXERIF), each one loses one or more frames
+        uint16_t resets;     //!< Recoveries of a corrupt receive ring
+        uint16_t lost;       //!< Frames discarded by those recoveries
+        uint8_t maxPending;  //!< Highest number of frames waiting in the receive buffer (EPKTCNT) seen
+        uint16_t pauses;     //!< Times the receive buffer passed ETHERCARD_PAUSE_THRESHOLD and PAUSE frames were sent
+    };
+    RxStats rxStats = {}; //!< Receive counters, e.g. to size the receive buffer
+
+    /** Transmit counters, they wrap around and can be cleared by the application.
+    *   The fields from bytes to underruns come from the transmit status vectors decoded,
+    *   see ETHERCARD_TX_STATS; scale them by frames / sampled for totals. */
+    struct TxStats {
+        uint16_t frames;         //!< Frames the MAC is done with, sent or not
+        uint16_t errors;         //!< Transmissions which failed (EIR.TXERIF), late collision retries included
+        uint16_t timeouts;       //!< Frames cancelled because neither TXIF nor TXERIF came up
+        uint16_t oversized;      //!< Frames of packetSendSegments() longer than the MAC takes, which were not sent
+        uint16_t sampled;        //!< Transmit status vectors decoded
+        uint32_t bytes;          //!< Bytes put on the wire, including those of attempts that collided
+        uint16_t collisions;     //!< Collisions, before the frame went out or was given up
+        uint16_t deferrals;      //!< Frames which had to wait for a busy medium
+        uint16_t aborts;         //!< Frames given up after 16 collisions
+        uint16_t lateCollisions; //!< Frames hit by a collision after 64 bytes, a sign of bad cabling or a duplex mismatch
+        uint16_t underruns;      //!< Frames aborted because the MAC ran out of data
+#if ETHERCARD_TX_WAITS
+        uint16_t waits[11];      //!< Histogram of EIR polls while waiting for the MAC: [0] none, [n] 2^(n-1) to 2^n - 1
+#endif
+    };
+    TxStats txStats = {}; //!< Transmit counters, e.g. to spot a saturated link or bad cabling
+
+#if ETHERCARD_INTERFACES > 1
+    static ENC28J60* nic; //!< The chip the static functions work on, see selectInterface()
+#else
+    static ENC28J60* const nic; //!< The chip the static functions work on
+#endif
+
+    static const ENC28J60Layout layoutDefault;    //!< 3 KB receive, 1.5 KB transmit, 3.5 KB scratch
+    static const ENC28J60Layout layoutSensorSink; //!< Receive-heavy: 5.5 KB receive absorbs bursts, 0.5 KB scratch, 0.5 KB heap for templates
+    static const ENC28J60Layout layoutWebServer;  //!< Transmit-heavy: 4.5 KB transmit queues 3 full-size replies
+    static const ENC28J60Layout layoutHttpClient; //!< Stash-heavy: 4.5 KB scratch for request bodies, 2 KB receive
+    static const ENC28J60Layout layoutBufferPool; //!< Heap-heavy: 1 KB scratch, 2.5 KB heap for enc_malloc()
 
     static uint8_t* tcpOffset () { return buffer + 0x36; } //!< Pointer to the start of TCP payload
 
@@ -50,32 +212,221 @@ public:
     */
     static void initSPI ();
 
+    /**   @brief  Route all SPI traffic through a transport instead of the AVR SPI registers
+    *     @param  transport Pointer to transport, must stay valid while the interface is used
+    *     @note   Only used if ETHERCARD_SPI_TRANSPORT is enabled; call before initialize()
+    */
+    static void setTransport (ENC28J60Transport* transport);
+
     /**   @brief  Initialise network interface
     *     @param  size Size of data buffer
     *     @param  macaddr Pointer to 6 byte hardware (MAC) address
     *     @param  csPin Arduino pin used for chip select (enable network interface SPI bus). Default = 8
-    *     @return <i>uint8_t</i> ENC28J60 firmware version or zero on failure.
+    *     @param  layout Split of the chip buffer memory, e.g. one of the layout presets. Default = layoutDefault
+    *     @return <i>uint8_t</i> ENC28J60 firmware version or zero on failure, including an invalid layout.
     */
     static uint8_t initialize (const uint16_t size, const uint8_t* macaddr,
-                               uint8_t csPin = 8);
+                               uint8_t csPin = 8,
+                               const ENC28J60Layout& layout = layoutDefault);
+
+    /**   @brief  Get the number of scratch pages of the layout passed to initialize()
+    *     @return <i>uint8_t</i> Number of pages of SCRATCH_PAGE_SIZE bytes, including page 0
+    */
+    static uint8_t scratchPages ();
+
+    /**   @brief  Make another chip the one the driver works on
+    *     @param  iface Interface number, less than ETHERCARD_INTERFACES
+    *     @note   Sketches use EtherCard::selectInterface(), which selects the state of the stack as well
+    */
+    static void selectInterface (uint8_t iface);
+
+    /**   @brief  Get the number of the chip the driver works on
+    *     @return <i>uint8_t</i> Interface number, 0 unless selectInterface() picked another one
+    */
+    static uint8_t currentInterface ();
+
+#if ETHERCARD_INTERFACES > 1
+    /**   @brief  Get the instance of an interface
+    *     @param  iface Interface number, less than ETHERCARD_INTERFACES
+    *     @return <i>ENC28J60*</i> The instance, defined by the stack along with ether
+    */
+    static ENC28J60* chip (uint8_t iface);
+#endif
+
+    /**   @brief  Receive through the INT pin instead of polling EPKTCNT
+    *     @param  intPin Arduino pin connected to the INT output of the ENC28J60, must support external interrupts;
+    *             each interface needs a pin of its own
+    *     @note   Call after initialize(). packetReceive() and isLinkUp() then only access the chip after
+    *           the pin signalled an event, so an idle loop costs no SPI traffic at all
+    */
+    static void enableInterrupt (uint8_t intPin);
+
+    /**   @brief  Check whether packetReceive() may have a packet, without any SPI traffic
+    *     @return <i>bool</i> False if no packet is pending; always true unless enableInterrupt() was called
+    */
+    static bool packetAvailable ();
+
+    /**   @brief  Get the arrival time of the frame last returned by packetReceive()
+    *     @return <i>uint32_t</i> micros() when the frame arrived
+    *     @note   With enableInterrupt() the first frame to reach an empty receive ring is stamped by the ISR,
+    *           any other frame when packetReceive() finds it; the latter are late by the time they sat in the ring
+    */
+    static uint32_t packetTime ();
+
+    /**   @brief  Get the free space of the receive ring
+    *     @return <i>uint16_t</i> Bytes which may still arrive, counting the frame last returned by packetReceive()
+    *           as released; each frame takes its length, the CRC and a 6 byte header, rounded up to even
+    *     @note   Costs a register read over SPI
+    */
+    static uint16_t rxFree ();
 
     /**   @brief  Check if network link is connected
     *     @return <i>bool</i> True if link is up
+    *     @note   The PHY is only queried over MII after it raised a link change interrupt,
+    *             otherwise this costs a single register read, or nothing in interrupt mode
     */
     static bool isLinkUp ();
 
+    /**   @brief  Get the link state without any SPI traffic
+    *     @return <i>bool</i> True if link was up the last time isLinkUp() was called
+    */
+    static bool linkStatus () { return nic->linkState; }
+
     /**   @brief  Sends data to network interface
     *     @param  len Size of data to send
     *     @note   Data buffer is shared by receive and transmit functions
+    *     @note   The frame is queued in the transmit ring and the function returns while the
+    *           MAC may still be sending it; it only waits if the ring is full
     */
     static void packetSend (uint16_t len);
 
+    /**   @brief  Sends data to network interface and reports when the MAC is done with it
+    *     @param  len Size of data to send
+    *     @param  done Function to call with the outcome, may be null to only poll packetSendPending()
+    *     @return <i>uint8_t</i> Token of the frame, tokens count the frames sent and wrap around
+    *     @note   Like packetSend(), this returns while the MAC may still be sending; the data buffer
+    *           is free for the next frame right away
+    */
+    static uint8_t packetSendAsync (uint16_t len, ENC28J60SendCallback done = 0);
+
+    /**   @brief  Check whether a frame sent with packetSendAsync() is still queued
+    *     @param  token Token which packetSendAsync() returned
+    *     @return <i>bool</i> True until the MAC is done with the frame; only meaningful for the
+    *           last 255 frames sent
+    */
+    static bool packetSendPending (uint8_t token);
+
+    /**   @brief  Set how often a frame is sent again after a late collision
+    *     @param  retries Number of retries, 0 to give up right away
+    *     @note   See ETHERCARD_RETRY_LATECOLLISIONS for the default
+    */
+    static void setLateCollisionRetries (uint8_t retries);
+
+    /**   @brief  Sends data to network interface, letting the chip compute a checksum
+    *     @param  len Size of data to send
+    *     @param  sumStart Offset within the frame where the checksummed data starts, it runs to the end of the frame
+    *     @param  sumPos Offset within the frame of the 16-bit checksum field, which must be zero in the data buffer
+    *     @param  sumAdd Value added to the sum, e.g. the pseudo header fields not present in the frame
+    *     @note   Only available if ETHERCARD_DMA_CHECKSUM is enabled
+    */
+    static void packetSendChecksum (uint16_t len, uint16_t sumStart, uint16_t sumPos, uint16_t sumAdd);
+
+    /**   @brief  Sends the frame last returned by packetReceive() back out, copying it inside the chip
+    *     @param  len Size of data to send, limited to the size of the received frame
+    *     @param  headerLen Number of leading bytes taken from the data buffer, e.g. rewritten headers
+    *     @note   The rest of the frame is copied from the receive buffer by the DMA engine, so it is
+    *           not transferred over SPI and may be longer than the data buffer
+    */
+    static void packetSendReceived (uint16_t len, uint16_t headerLen);
+
+    /**   @brief  Sends a frame gathered from the data buffer and a list of segments
+    *     @param  headerLen Number of leading bytes taken from the data buffer, e.g. the headers
+    *     @param  segs Segments which follow the headers, see ENC28J60Segment
+    *     @param  count Number of segments
+    *     @param  sumStart Offset within the frame where the checksummed data starts, 0 for no checksum
+    *     @param  sumPos Offset within the frame of the 16-bit checksum field, which must be zero in the data buffer
+    *     @param  sumAdd Value added to the sum, e.g. the pseudo header fields not present in the frame
+    *     @note   The frame is never assembled in RAM, so it may be larger than the data buffer. The checksum
+    *           is summed while the bytes pass through, Stash bytes are copied and summed by the DMA engine.
+    *           A Stash must have been written back with Stash::flush() first. A frame longer than the MAC
+    *           takes, 1500 bytes, is not sent but counted in txStats.oversized
+    */
+    static void packetSendSegments (uint16_t headerLen, const ENC28J60Segment* segs, uint8_t count,
+                                    uint16_t sumStart = 0, uint16_t sumPos = 0, uint16_t sumAdd = 0);
+
+    /**   @brief  Store the frame in the data buffer in chip memory, to be sent with templateSend()
+    *     @param  len Size of the frame
+    *     @return <i>ENC28J60Template</i> Handle of the stored frame, start is 0 if there is not enough memory
+    *     @note   The memory is taken with enc_malloc() and stays reserved until templateFree()
+    */
+    static ENC28J60Template templateStore (uint16_t len);
+
+    /**   @brief  Keep a copy of the frame queued last, e.g. to send it again with templateSend()
+    *     @return <i>ENC28J60Template</i> Handle of the copy, start is 0 if there is not enough memory
+    *     @note   The DMA engine copies the frame within the chip, nothing goes over SPI. Like
+    *           templateStore() the memory is taken with enc_malloc() and stays reserved until templateFree()
+    */
+    static ENC28J60Template templateKeep ();
+
+    /**   @brief  Release the chip memory of a stored frame
+    *     @param  tmpl Template returned by templateStore(), its start is set to 0
+    *     @note   Waits until the MAC has sent the template if it is still queued
+    */
+    static void templateFree (ENC28J60Template& tmpl);
+
+    /**   @brief  Overwrite a few bytes of a stored frame, e.g. a sequence number
+    *     @param  tmpl Template returned by templateStore()
+    *     @param  offset Offset within the frame
+    *     @param  data Pointer to the new bytes
+    *     @param  len Number of bytes
+    *     @param  sumPos Offset within the frame of a 16-bit checksum covering the bytes, 0 for none
+    *     @note   The checksum is updated incrementally (RFC 1624) from the bytes being replaced, so only
+    *           those go over SPI. Bytes at even offsets count as high bytes of the checksummed words,
+    *           as in all IP headers, and the checksum field must not overlap them. Waits until the MAC
+    *           has sent the template if it is still queued
+    */
+    static void templatePatch (const ENC28J60Template& tmpl, uint16_t offset, const void* data, uint16_t len,
+                               uint16_t sumPos = 0);
+
+    /**   @brief  Queue a stored frame for transmission
+    *     @param  tmpl Template returned by templateStore()
+    *     @note   Only ETXST and ETXND are pointed at the frame, it is not copied at all. It takes a
+    *           transmit queue entry but no room in the transmit ring
+    */
+    static void templateSend (const ENC28J60Template& tmpl);
+
+    /**   @brief  Wait until all queued frames have been transmitted
+    */
+    static void packetFlush ();
+
     /**   @brief  Copy received packets to data buffer
     *     @return <i>uint16_t</i> Size of received data
     *     @note   Data buffer is shared by receive and transmit functions
+    *     @note   If the receive ring turns out to be corrupt it is reset, dropping all pending frames
     */
     static uint16_t packetReceive ();
 
+    /**   @brief  Check for and acknowledge a receive buffer overflow
+    *     @return <i>bool</i> True if frames were dropped because the receive buffer was full
+    *     @note   Counted in rxStats.overflows. The chip does not tell how many frames were lost.
+    *     @note   packetReceive() calls this whenever it finds a frame
+    */
+    static bool packetOverflow ();
+
+    /**   @brief  Copy the rest of the received packet to data buffer
+    *     @return <i>uint16_t</i> Size of received data, as returned by packetReceive()
+    *     @note   With ETHERCARD_LAZY_RECEIVE packetReceive() only copies the headers; the stack
+    *           calls this before it looks at any payload. Does nothing if the packet is complete.
+    */
+    static uint16_t packetFetch ();
+
+    /**   @brief  Copy what was copied of the received packet to data buffer once more
+    *     @return <i>uint16_t</i> Size of received data, as returned by packetReceive()
+    *     @note   For the stack, which builds segments of its timers in the data buffer while
+    *           a packet is in it; the packet stays in the receive buffer until the next one is read.
+    */
+    static uint16_t packetRefetch ();
+
     /**   @brief  Copy data from ENC28J60 memory
     *     @param  page Data page of memory
     *     @param  data Pointer to buffer to copy data to
@@ -140,6 +491,31 @@ public:
     */
     static void disableMulticast();
 
+    /**   @brief  Accept frames which match a pattern, in addition to the other receive filters
+    *     @param  offset Position in the frame of the 64 byte window the mask selects from
+    *     @param  mask 8 bytes, bit n of byte m selects byte offset+8*m+n of the frame
+    *     @param  pattern The selected bytes in frame order, one for each bit set in mask
+    *     @note   The chip only compares the checksum of the selected bytes, so frames with
+    *           other bytes which happen to give the same checksum are accepted as well
+    *     @note   By default the pattern matches broadcast ARP frames
+    */
+    static void setPatternFilter (uint16_t offset, const uint8_t* mask, const uint8_t* pattern);
+
+    /**   @brief  Stop accepting frames through the pattern filter
+    */
+    static void disablePatternFilter ();
+
+    /**   @brief  Accept frames whose destination address hashes into a table, e.g. multicast groups
+    *     @param  table 8 bytes, bit n of byte m accepts hash value 8*m+n; all zeros disables the filter
+    */
+    static void setHashFilter (const uint8_t* table);
+
+    /**   @brief  Get the hash value of a destination address, i.e. its bit in the hash filter table
+    *     @param  mac Pointer to 6 byte destination address
+    *     @return <i>uint8_t</i> Hash value 0..63, bits 28:23 of the CRC of the address
+    */
+    static uint8_t hashFilterIndex (const uint8_t* mac);
+
     /**   @brief  Reset and fully initialise ENC28J60
     *     @param  csPin Arduino pin used for chip select (enable SPI bus)
     *     @return <i>uint8_t</i> 0 on failure
@@ -152,22 +528,39 @@ public:
     *     @param  packetOffset where within the packet to start; if less than maxlength bytes are available only the remaining bytes are copied.
     *     @return <i>uint16_t</i> the number of bytes that have been read
     *     @note   At the destination at least maxlength+1 bytes should be reserved because the copied content will be 0-terminated.
+    *     @note   ENC28J60Reader streams a frame without the terminator and without absolute offsets
     */
     static uint16_t readPacketSlice(char* dest, int16_t maxlength, int16_t packetOffset);
 
     /** @brief  reserves a block of RAM in the memory of the enc chip
      *  @param  size number of bytes to reserve
-     *  @return <i>uint16_t</i> start address of the block within the enc memory. 0 if the remaining memory for malloc operation is less than size.
-     *  @note  There is no enc_free(), i.e., reserved blocks stay reserved for the duration of the program.
-     *  @note  The total memory available for malloc-operations is determined by ENC_HEAP_END-ENC_HEAP_START, defined in enc28j60.h; by default this is 0, i.e., you have to change these values in order to use enc_malloc().
+     *  @return <i>uint16_t</i> start address of the block within the enc memory. 0 if there is no free block of at least size bytes.
+     *  @note  Blocks are multiples of ENC_HEAP_UNIT bytes, taken best fit from the heap and returned with enc_free().
+     *  @note  The total memory available for malloc-operations is what the ENC28J60Layout passed to initialize() leaves behind the scratch area, up to ENC_HEAP_UNIT_MAX units; in layoutDefault this is 0, i.e., you have to pick another layout such as layoutBufferPool and define ENC_HEAP_UNIT_MAX, which is 0 by default, in order to use enc_malloc().
      */
     static uint16_t enc_malloc(uint16_t size);
 
+    /** @brief  returns a block reserved by enc_malloc() to the heap
+     *  @param  addr start address returned by enc_malloc(), 0 is ignored
+     */
+    static void enc_free(uint16_t addr);
+
     /** @brief  returns the amount of memory within the enc28j60 chip that is still available for malloc.
-     *  @return <i>uint16_t</i> the amount of memory in bytes.
+     *  @return <i>uint16_t</i> the amount of memory in bytes, possibly split up in several free blocks.
      */
     static uint16_t enc_freemem();
 
+    /** @brief  returns the size of the largest block enc_malloc() can currently reserve.
+     *  @return <i>uint16_t</i> the amount of memory in bytes.
+     *  @note  1 - enc_maxfree() / enc_freemem() tells how fragmented the heap is.
+     */
+    static uint16_t enc_maxfree();
+
+    /** @brief  returns the number of separate free blocks in the heap.
+     *  @return <i>uint8_t</i> 1 if the free memory is in one piece, 0 if there is none.
+     */
+    static uint8_t enc_fragments();
+
     /** @brief copies a block of data from SRAM to the enc memory
         @param dest destination address within enc memory
         @param source source pointer to a block of SRAM in the arduino
@@ -184,24 +577,144 @@ public:
     static void memcpy_from_enc(void* dest, uint16_t source, int16_t num);
 };
 
+/** This class reads the frame last returned by ENC28J60::packetReceive() straight from the
+*   receive buffer of the chip, so frames longer than the data buffer can be consumed in chunks.
+*   It is only valid until the next call of packetReceive().
+*/
+class ENC28J60Reader {
+public:
+    /**   @brief  Start reading the current frame
+    *     @param  offset Offset within the frame of the first byte to read
+    *     @param  len Most bytes to read, the end of the frame is never passed
+    */
+    ENC28J60Reader (uint16_t offset = 0, uint16_t len = 0xFFFF);
+
+    /**   @brief  Copy the next bytes of the frame to RAM
+    *     @param  dest Pointer in RAM where the data is copied to
+    *     @param  n Most bytes to copy
+    *     @return <i>uint16_t</i> Number of bytes copied, 0 at the end
+    */
+    uint16_t read (void* dest, uint16_t n);
+
+    /**   @brief  Move past the next bytes of the frame without transferring them
+    *     @param  n Number of bytes to skip
+    *     @return <i>uint16_t</i> Number of bytes skipped
+    *     @note   Skipped bytes are not part of checksum()
+    */
+    uint16_t skip (uint16_t n);
+
+    /**   @brief  Get the next byte without moving past it
+    *     @return <i>int16_t</i> The byte, or -1 at the end
+    */
+    int16_t peek () const;
+
+    /**   @brief  Get the number of bytes left to read
+    */
+    uint16_t remaining () const { return end - pos; }
+
+    /**   @brief  Get the offset within the frame of the next byte to read
+    */
+    uint16_t position () const { return pos; }
+
+    /**   @brief  Get the sum of all bytes read so far, like the IP checksum but without the final complement
+    *     @note   Words are aligned with the offset the reader started at
+    */
+    uint16_t checksum () const;
+
+private:
+    uint16_t start; // offset the reader started at
+    uint16_t pos;   // offset of the next byte
+    uint16_t end;   // offset past the last byte
+    uint32_t sum;   // running sum of the bytes read
+};
+
 typedef ENC28J60 Ethernet; //!< Define alias Ethernet for ENC28J60
 
 
 /** Workaround for Errata 13.
 *   The transmission hardware may drop some packets because it thinks a late collision
 *   occurred (which should never happen if all cable length etc. are ok). If setting
-*   this to 1 these packages will be retried a fixed number of times. Costs about 150bytes
-*   of flash.
+*   this to 1 these packages will be retried 16 times unless
+*   ENC28J60::setLateCollisionRetries() says otherwise.
 */
+#ifndef ETHERCARD_RETRY_LATECOLLISIONS
 #define ETHERCARD_RETRY_LATECOLLISIONS 0
+#endif
+
+/** Number of frames which can be queued for transmission.
+*   packetSend copies each frame into the next free space of the transmit buffer
+*   (see ENC28J60Layout) and returns while the MAC is still sending earlier
+*   frames, so that multi-packet responses don't stall on every frame. With 1 the
+*   wait for a frame is shifted to the next call of packetSend. Each entry costs 6
+*   bytes of RAM.
+*/
+#ifndef ETHERCARD_TX_QUEUE
+#define ETHERCARD_TX_QUEUE 4
+#endif
+
+/** Let the ENC28J60 compute TCP and UDP checksums.
+*   If enabled, frames carrying TCP or UDP data are copied into the transmit buffer
+*   first and summed there by the DMA checksum engine; the MCU only adds the pseudo
+*   header fields and patches the 16-bit result in place. This removes the per-byte
+*   checksum loop for large frames at the cost of about 30 SPI bytes per frame plus
+*   polling ECON1 while the DMA engine runs.
+*/
+#ifndef ETHERCARD_DMA_CHECKSUM
+#define ETHERCARD_DMA_CHECKSUM 0
+#endif
+
+/** Copy only the headers of received packets up front.
+*   If enabled packetReceive reads the first 54 bytes of a frame (Ethernet, IP and TCP
+*   headers) and packetLoop classifies the frame on those; the payload is fetched from
+*   the receive buffer with packetFetch() only for frames somebody handles. Frames which
+*   are dropped, e.g. foreign broadcasts or TCP to closed ports, cost just their headers.
+*   Sketches which inspect the data buffer on their own after packetLoop returned 0 must
+*   call packetFetch() first.
+*/
+#ifndef ETHERCARD_LAZY_RECEIVE
+#define ETHERCARD_LAZY_RECEIVE 0
+#endif
+
+/** Run the MAC and PHY in full duplex.
+*   The ENC28J60 does not autonegotiate, so the switch port must be forced to 10 Mbit/s
+*   full duplex as well, otherwise the duplex mismatch loses frames. There are no
+*   collisions in full duplex, hence no late collisions to retry, and the MAC can send
+*   PAUSE frames, see ETHERCARD_PAUSE_THRESHOLD.
+*/
+#ifndef ETHERCARD_FULL_DUPLEX
+#define ETHERCARD_FULL_DUPLEX 0
+#endif
 
-/** Enable pipelining of packet transmissions.
-*   If enabled the packetSend function will not block/wait until the packet is actually
-*   transmitted; but instead this wait is shifted to the next time that packetSend is
-*   called. This gives higher performance; however in combination with
-*   ETHERCARD_RETRY_LATECOLLISIONS this may lead to problems because a packet whose
-*   transmission fails because the ENC-chip thinks that it is a late collision will
-*   not be retried until the next call to packetSend.
+/** Fill level of the receive buffer, in percent, at which PAUSE frames are sent.
+*   Only used in full duplex. Once the receive buffer holds more than this the MAC keeps
+*   the link partner quiet with PAUSE frames, until packetReceive() has drained it below
+*   half the threshold. This costs a read of ERXWRPT per received frame. 0 disables flow
+*   control.
 */
-#define ETHERCARD_SEND_PIPELINING 0
+#ifndef ETHERCARD_PAUSE_THRESHOLD
+#define ETHERCARD_PAUSE_THRESHOLD 75
+#endif
+
+/** Decode the transmit status vector of every Nth frame into ENC28J60::txStats.
+*   Each decoded vector costs about 14 SPI bytes; frames which failed are always
+*   decoded. 1 decodes every frame, at most 255; 0 leaves only the frame and error
+*   counts, which cost nothing.
+*/
+#ifndef ETHERCARD_TX_STATS
+#define ETHERCARD_TX_STATS 16
+#endif
+
+/** Use the pluggable SPI transport.
+*   If enabled all chip access goes through the ENC28J60Transport installed with
+*   ENC28J60::setTransport() instead of the AVR SPI registers. This is the default
+*   on non-AVR targets, e.g. the host build in extras/host.
+*/
+#ifndef ETHERCARD_SPI_TRANSPORT
+#   ifdef __AVR__
+#       define ETHERCARD_SPI_TRANSPORT 0
+#   else
+#       define ETHERCARD_SPI_TRANSPORT 1
+#   endif
+#endif
+
 #endif
@@ -155,7 +155,7 @@ struct IpHeader
         flagsFragmentOffset |= HTONS(o) & ~flags_mask();
     }
 
-} __attribute__((__packed__));
+}; // all fields are naturally aligned, so the header needs no packing
 
 
 // ******* ARP *******
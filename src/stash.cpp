@@ -9,11 +9,18 @@
 
 //#define FLOATEMIT // uncomment line to enable $T in emit_P for float emitting
 
+#if ETHERCARD_INTERFACES > 1
+Stash::Block Stash::interfaceBufs[ETHERCARD_INTERFACES][BUFCOUNT];
+byte Stash::interfaceMaps[ETHERCARD_INTERFACES][SCRATCH_MAP_SIZE];
+Stash::Block* Stash::bufs = interfaceBufs[0];
+byte* Stash::map = interfaceMaps[0];
+#else
 byte Stash::map[SCRATCH_MAP_SIZE];
 Stash::Block Stash::bufs[BUFCOUNT];
+#endif
 
 uint8_t Stash::allocBlock () {
-    for (uint8_t i = 0; i < sizeof map; ++i)
+    for (uint8_t i = 0; i < SCRATCH_MAP_SIZE; ++i)
         if (map[i] != 0)
             for (uint8_t j = 0; j < 8; ++j)
                 if (bitRead(map[i], j)) {
@@ -34,11 +41,12 @@ uint8_t Stash::fetchByte (uint8_t blk, uint8_t off) {
 }
 
 
-// block 0 is special since always occupied
+// block 0 is special since always occupied; pages past last do not exist
+// in the chosen buffer layout, see ENC28J60::scratchPages(), which may have none
 void Stash::initMap (uint8_t last /*=SCRATCH_PAGE_NUM*/) {
-    last = SCRATCH_PAGE_NUM;
-    while (--last > 0)
-        freeBlock(last);
+    memset(map, 0, SCRATCH_MAP_SIZE);
+    while (last > 1)
+        freeBlock(--last);
 }
 
 // load a page/block either into the write or into the readbuffer
@@ -58,9 +66,15 @@ void Stash::load (uint8_t idx, uint8_t blk) {
     }
 }
 
+// write the block being written back to the chip, e.g. before the chip copies
+// a stash into the transmit buffer itself
+void Stash::flush () {
+    ether.copyout(bufs[WRITEBUF].bnum, bufs[WRITEBUF].bytes);
+}
+
 uint8_t Stash::freeCount () {
     uint8_t count = 0;
-    for (uint8_t i = 0; i < sizeof map; ++i)
+    for (uint8_t i = 0; i < SCRATCH_MAP_SIZE; ++i)
         for (uint8_t m = 0x80; m != 0; m >>= 1)
             if (map[i] & m)
                 ++count;
@@ -144,8 +158,8 @@ void Stash::prepare (const char* fmt PROGMEM, ...) {
 #ifdef __AVR__
     *segs++ = (uint16_t) fmt;
 #else
-    *segs++ = (uint32_t) fmt;
-    *segs++ = (uint32_t) fmt >> 16;
+    memcpy(segs, &fmt, sizeof fmt);
+    segs += sizeof fmt / sizeof *segs;
 #endif
     va_list ap;
     va_start(ap, fmt);
@@ -157,7 +171,12 @@ void Stash::prepare (const char* fmt PROGMEM, ...) {
 #ifdef __AVR__
             uint16_t argval = va_arg(ap, uint16_t), arglen = 0;
 #else
-            uint32_t argval = va_arg(ap, int), arglen = 0;
+            // pointers may be wider than int, so fetch by the type of the argument
+            char argmode = pgm_read_byte(fmt);
+            uintptr_t argval = argmode == 'D' || argmode == 'H' ?
+                               (uintptr_t) va_arg(ap, int) :
+                               (uintptr_t) va_arg(ap, const void*);
+            uint16_t arglen = 0;
 #endif
             switch (pgm_read_byte(fmt++)) {
             case 'D': {
@@ -188,8 +207,8 @@ void Stash::prepare (const char* fmt PROGMEM, ...) {
 #ifdef __AVR__
             *segs++ = argval;
 #else
-            *segs++ = argval;
-            *segs++ = argval >> 16;
+            memcpy(segs, &argval, sizeof argval);
+            segs += sizeof argval / sizeof *segs;
 #endif
             Stash::bufs[WRITEBUF].words[0] += arglen - 2;
         }
@@ -208,8 +227,9 @@ void Stash::extract (uint16_t offset, uint16_t count, void* buf) {
 #ifdef __AVR__
     const char* fmt PROGMEM = (const char*) *++segs;
 #else
-    const char* fmt PROGMEM = (const char*)((segs[2] << 16) | segs[1]);
-    segs += 2;
+    const char* fmt PROGMEM;
+    memcpy(&fmt, segs + 1, sizeof fmt);
+    segs += sizeof fmt / sizeof *segs;
 #endif
     Stash stash;
     char mode = '@', tmp[7], *ptr = NULL, *out = (char*) buf;
@@ -225,8 +245,9 @@ void Stash::extract (uint16_t offset, uint16_t count, void* buf) {
 #ifdef __AVR__
             uint16_t arg = *++segs;
 #else
-            uint32_t arg = *++segs;
-            arg |= *++segs << 16;
+            uintptr_t arg;
+            memcpy(&arg, segs + 1, sizeof arg);
+            segs += sizeof arg / sizeof *segs;
 #endif
             mode = pgm_read_byte(fmt++);
             switch (mode) {
@@ -276,8 +297,9 @@ void Stash::cleanup () {
 #ifdef __AVR__
     const char* fmt PROGMEM = (const char*) *++segs;
 #else
-    const char* fmt PROGMEM = (const char*)((segs[2] << 16) | segs[1]);
-    segs += 2;
+    const char* fmt PROGMEM;
+    memcpy(&fmt, segs + 1, sizeof fmt);
+    segs += sizeof fmt / sizeof *segs;
 #endif
     for (;;) {
         char c = pgm_read_byte(fmt++);
@@ -287,8 +309,9 @@ void Stash::cleanup () {
 #ifdef __AVR__
             uint16_t arg = *++segs;
 #else
-            uint32_t arg = *++segs;
-            arg |= *++segs << 16;
+            uintptr_t arg;
+            memcpy(&arg, segs + 1, sizeof arg);
+            segs += sizeof arg / sizeof *segs;
 #endif
             if (pgm_read_byte(fmt++) == 'H') {
                 Stash stash (arg);
@@ -298,3 +321,9 @@ void Stash::cleanup () {
     }
 }
 
+#if ETHERCARD_INTERFACES > 1
+void Stash::selectInterface (uint8_t iface) {
+    bufs = interfaceBufs[iface];
+    map = interfaceMaps[iface];
+}
+#endif
@@ -33,13 +33,25 @@ class Stash : public /*Stream*/ Print, private StashHeader {
     static void freeBlock (uint8_t block);
     static uint8_t fetchByte (uint8_t blk, uint8_t off);
 
+#if ETHERCARD_INTERFACES > 1
+    // every chip has its own scratch area, hence its own page map and cached pages
+    static Block interfaceBufs[ETHERCARD_INTERFACES][2];
+    static uint8_t interfaceMaps[ETHERCARD_INTERFACES][SCRATCH_MAP_SIZE];
+    static Block* bufs;   // those of the selected interface
+    static uint8_t* map;
+#else
     static Block bufs[2];
     static uint8_t map[SCRATCH_MAP_SIZE];
+#endif
 
 public:
     static void initMap (uint8_t last=SCRATCH_PAGE_NUM);
     static void load (uint8_t idx, uint8_t blk);
+    static void flush ();
     static uint8_t freeCount ();
+#if ETHERCARD_INTERFACES > 1
+    static void selectInterface (uint8_t iface);
+#endif
 
     Stash () : curr (0) { first = 0; }
     Stash (uint8_t fd) { open(fd); }
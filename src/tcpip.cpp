@@ -33,30 +33,123 @@
 #define TCP_STATE_CLOSING       5
 #define TCP_STATE_CLOSED        6
 
+#define TCP_RTO_INITIAL 1000 // milliseconds before the first round trip time is measured
+#define TCP_RTO_MAX     60000
+
+// RFC 6298 retransmission timer of a connection, all times in milliseconds
+struct TcpTimer {
+    uint16_t srtt;       // smoothed round trip time, 0 before the first measurement
+    uint16_t rttvar;     // round trip time variation
+    uint16_t rto;        // retransmission timeout, doubled for each retransmission
+    uint16_t sentAt;     // millis() when the timer was started, truncated
+    uint8_t retries;     // retransmissions since data was last acknowledged
+    bool timing;         // the segment which started the timer is timed, i.e. was not sent again
+};
+
 #define TCPCLIENT_SRC_PORT_H 11 //Source port (MSB) for TCP/IP client connections - hardcode all TCP/IP client connection from ports in range 2816-3071
-static uint8_t tcpclient_src_port_l=1; // Source port (LSB) for tcp/ip client connections - increments on each TCP/IP request
-static uint8_t tcp_fd; // a file descriptor, will be encoded into the port
-static uint8_t tcp_client_state; //TCP connection state: 1=Send SYN, 2=SYN sent awaiting SYN+ACK, 3=Established, 4=Not used, 5=Closing, 6=Closed
-static uint8_t tcp_client_port_h; // Destination port (MSB) of TCP/IP client connection
-static uint8_t tcp_client_port_l; // Destination port (LSB) of TCP/IP client connection
-static uint8_t (*client_tcp_result_cb)(uint8_t,uint8_t,uint16_t,uint16_t); // Pointer to callback function to handle response to current TCP/IP request
-static uint16_t (*client_tcp_datafill_cb)(uint8_t); //Pointer to callback function to handle payload data in response to current TCP/IP request
-static uint8_t www_fd; // ID of current http request (only one http request at a time - one of the 8 possible concurrent TCP/IP connections)
-static void (*client_browser_cb)(uint8_t,uint16_t,uint16_t); // Pointer to callback function to handle result of current HTTP request
-static const char *client_additionalheaderline; // Pointer to c-string additional http request header info
-static const char *client_postval;
-static const char *client_urlbuf; // Pointer to c-string path part of HTTP request URL
-static const char *client_urlbuf_var; // Pointer to c-string filename part of HTTP request URL
-static const char *client_hoststr; // Pointer to c-string hostname of current HTTP request
-static IcmpCallback icmp_cb; // Pointer to callback function for ICMP ECHO response handler (triggers when localhost receives ping response (pong))
-
-static uint16_t info_data_len; // Length of TCP/IP payload
-static uint8_t seqnum = 0xa; // My initial tcp sequence number
-static uint8_t result_fd = 123; // Session id of last reply
-static const char* result_ptr; // Pointer to TCP/IP data
-static unsigned long SEQ; // TCP/IP sequence number
-
-#define CLIENTMSS 550
+
+// A session opened by clientTcpReq(), the entry is free if state is zero
+struct TcpClient {
+    uint8_t state;       // TCP connection state: 1=Send SYN, 2=SYN sent awaiting SYN+ACK, 3=Established, 4=Not used, 5=Closing, 6=Closed
+    uint8_t fd;          // session id, encoded into the upper 3 bits of srcPort
+    uint8_t srcPort;     // lower byte of our port, the upper one is TCPCLIENT_SRC_PORT_H
+    uint8_t ip[IP_LEN];  // server address
+    uint16_t port;       // server port
+    uint8_t (*result_cb)(uint8_t,uint8_t,uint16_t,uint16_t); // handles the response of the server
+    uint16_t (*datafill_cb)(uint8_t); // fills in the request
+    uint16_t lastSeen;   // millis() of the SYN or the last segment received, truncated
+    uint32_t sndUna;     // sequence number of our oldest unacknowledged byte, the SYN at first
+    uint32_t sndNxt;     // sequence number of our next byte
+    uint32_t rcvNxt;     // sequence number of the next byte expected from the server
+    uint16_t mss;        // largest segment the server takes
+    TcpTimer rtx;
+};
+
+// the session id is 3 bits of the local port; ETHERCARD_TCPCLIENT turns the client off
+static_assert(ETHERCARD_TCP_CLIENTS > 0 && ETHERCARD_TCP_CLIENTS <= 8,
+              "ETHERCARD_TCP_CLIENTS must be 1 to 8");
+#if ETHERCARD_TCPSERVER && ETHERCARD_TCP_CONNECTIONS
+#define TCP_SERVER_SYN_RECEIVED 1 // SYN+ACK sent, waiting for its ACK
+#define TCP_SERVER_ESTABLISHED  2
+#define TCP_SERVER_FIN_WAIT     3 // our FIN sent, the client's still to come
+#define TCP_SERVER_CLOSE_WAIT   4 // the client's FIN received, ours still to send
+#define TCP_SERVER_LAST_ACK     5 // both FINs sent, waiting for the ACK of ours
+
+#if ETHERCARD_TCP_STREAM
+// A reply sent by httpServerStream(), none if source.len and fill are both zero
+struct TcpStream {
+    ENC28J60Segment source;     // where the reply is and its size
+    EtherCard::StreamFill fill; // or else the callback which produces it
+    uint32_t start;             // sequence number of its first byte
+    uint32_t recover;           // sndNxt when a segment was last sent again after a timeout
+    bool lost;                  // a partial ACK showed the segment at sndUna got lost as well
+    bool probe;                 // the byte at sndUna probes the shut window of the client
+};
+#endif
+
+// A connection accepted by the TCP server, the entry is free if state is zero
+struct TcpConnection {
+    uint8_t state;       // one of TCP_SERVER_*
+    uint8_t ip[IP_LEN];  // client address
+    uint16_t port;       // client port, network byte order
+    uint16_t localPort;  // server port, network byte order
+    uint32_t sndUna;     // sequence number of our oldest unacknowledged byte
+    uint32_t sndNxt;     // sequence number of our next byte; of the SYN while in SYN_RECEIVED
+    uint32_t rcvNxt;     // sequence number of the next byte expected from the client
+    uint16_t lastSeen;   // millis() of its last segment, truncated
+    uint16_t mss;        // largest segment the client takes
+    uint16_t window;     // receive window of the client, from its last segment
+    TcpTimer rtx;
+#if ETHERCARD_TCP_STREAM
+    TcpStream stream;
+#endif
+};
+#endif
+
+#if ETHERCARD_TCP_COPIES
+// A sent data segment kept in chip memory until it is acknowledged, the entry is free if frame.start is zero
+struct TcpCopy {
+    uint8_t owner;       // index of the server connection, or of the client session | TCP_COPY_CLIENT
+    uint32_t end;        // sequence number following the segment
+    ENC28J60Template frame;
+};
+#endif
+#define TCP_COPY_CLIENT 0x80
+
+// TCP client and server state of one interface
+struct TcpState {
+    uint8_t tcpclient_src_port_l = 1; // Source port (LSB) for tcp/ip client connections - increments on each TCP/IP request
+    uint8_t tcp_fd = 0; // a file descriptor, will be encoded into the port
+    TcpClient tcp_clients[ETHERCARD_TCP_CLIENTS] = {};
+    uint8_t www_fd = 0; // ID of current http request (only one http request at a time - one of the 8 possible concurrent TCP/IP connections)
+    void (*client_browser_cb)(uint8_t,uint16_t,uint16_t) = 0; // Pointer to callback function to handle result of current HTTP request
+    const char *client_additionalheaderline = 0; // Pointer to c-string additional http request header info
+    const char *client_postval = 0;
+    const char *client_urlbuf = 0; // Pointer to c-string path part of HTTP request URL
+    const char *client_urlbuf_var = 0; // Pointer to c-string filename part of HTTP request URL
+    const char *client_hoststr = 0; // Pointer to c-string hostname of current HTTP request
+    IcmpCallback icmp_cb = 0; // Pointer to callback function for ICMP ECHO response handler (triggers when localhost receives ping response (pong))
+
+    uint16_t info_data_len = 0; // Length of TCP/IP payload
+    uint8_t seqnum = 0xa; // My initial tcp sequence number
+    uint8_t result_fd = 123; // Session id of last reply
+    const char* result_ptr = 0; // Pointer to TCP/IP data
+    unsigned long SEQ = 0; // TCP/IP sequence number
+#if ETHERCARD_TCPSERVER && ETHERCARD_TCP_CONNECTIONS
+    TcpConnection tcp_conns[ETHERCARD_TCP_CONNECTIONS] = {};
+    TcpConnection *tcp_conn = 0; // connection of the segment being answered, 0 if not in the table
+#endif
+#if ETHERCARD_TCP_COPIES
+    TcpCopy tcp_copies[ETHERCARD_TCP_COPIES] = {};
+#endif
+    uint16_t tcp_window = 0; // window of this packetLoop() pass, 0 until worked out
+    uint16_t tcp_timers_run = 0; // millis() when the TCP timers last ran, truncated
+};
+
+ETHERCARD_INTERFACE_STATE(TcpState, tcp)
+
+#define TCP_MSS_DEFAULT 536 // if the SYN has no MSS option, RFC 1122
+#define TCP_MSS_MAX 1442     // what a frame holds, the MAC takes 1500 bytes with headers and CRC
 #define TCP_DATA_START ((uint16_t)TCP_SRC_PORT_H_P+(gPB[TCP_HEADER_LEN_P]>>4)*4) // Get offset of TCP/IP payload data
 
 const unsigned char ntpreqhdr[] PROGMEM = { 0xE3,0,4,0xFA,0,1,0,0,0,1 }; //NTP request header
@@ -97,13 +190,28 @@ static void fill_checksum(uint8_t dest, uint8_t off, uint16_t len, uint8_t type)
     fill_checksum(checksum, ptr, len, type);
 }
 
+// Fill in the UDP (type 1) or TCP (type 2) checksum of a segment which runs to
+// the end of the frame and send it, see fill_checksum() for dest, off and len
+static void send_with_checksum(uint8_t dest, uint8_t off, uint16_t len, uint8_t type) {
+    gPB[dest] = 0;
+    gPB[dest+1] = 0;
+#if ETHERCARD_DMA_CHECKSUM
+    // the chip sums the segment in its transmit buffer
+    EtherCard::packetSendChecksum(off + len, off, dest,
+                                  (type==1 ? IP_PROTO_UDP_V : IP_PROTO_TCP_V) + len - 8);
+#else
+    fill_checksum(dest, off, len, type);
+    EtherCard::packetSend(off + len);
+#endif
+}
+
 static boolean is_lan(const uint8_t source[IP_LEN], const uint8_t destination[IP_LEN]);
 
 static void init_eth_header(const uint8_t *thaddr)
 {
     EthHeader &h = ethernet_header();
     EtherCard::copyMac(h.thaddr, thaddr);
-    EtherCard::copyMac(h.shaddr, EtherCard::mymac);
+    EtherCard::copyMac(h.shaddr, gNIC.mymac);
 }
 
 static void init_eth_header(
@@ -118,16 +226,18 @@ static void init_eth_header(
 // check if ARP request is ongoing
 static bool client_arp_waiting(const uint8_t *ip)
 {
-    const uint8_t *mac = EtherCard::arpStoreGetMac(is_lan(EtherCard::myip, ip) ? ip : EtherCard::gwip);
+    const uint8_t *mac = EtherCard::arpStoreGetMac(is_lan(gNIC.myip, ip) ? ip : gNIC.gwip);
     return !mac || memcmp(mac, allOnes, ETH_LEN) == 0;
 }
 
+#if ETHERCARD_INTERFACES > 1
 // check if ARP is request is done
 static bool client_arp_ready(const uint8_t *ip)
 {
     const uint8_t *mac = EtherCard::arpStoreGetMac(ip);
     return mac && memcmp(mac, allOnes, ETH_LEN) != 0;
 }
+#endif
 
 // return
 //  - IP MAC address if IP is part of LAN
@@ -141,8 +251,8 @@ static const uint8_t *client_arp_get(const uint8_t *ip)
     if (
             (ip[0] & 0xF0) == 0xE0
             || *((uint32_t *) ip) == 0xFFFFFFFF
-            || !memcmp(EtherCard::broadcastip, ip, IP_LEN)
-            || (mac = EtherCard::arpStoreGetMac(is_lan(EtherCard::myip, ip) ? ip : EtherCard::gwip)) == NULL
+            || !memcmp(gNIC.broadcastip, ip, IP_LEN)
+            || (mac = EtherCard::arpStoreGetMac(is_lan(gNIC.myip, ip) ? ip : gNIC.gwip)) == NULL
         )
         return allOnes;
 
@@ -155,7 +265,7 @@ static void init_ip_header(
 {
     IpHeader &iph = ip_header();
     EtherCard::copyIp(iph.tpaddr, dst);
-    EtherCard::copyIp(iph.spaddr, EtherCard::myip);
+    EtherCard::copyIp(iph.spaddr, gNIC.myip);
     iph.flags(IP_DF);
     iph.fragmentOffset(0);
     iph.ttl = 64;
@@ -170,18 +280,26 @@ static boolean is_lan(const uint8_t source[IP_LEN], const uint8_t destination[IP
         return false;
     }
     for(int i = 0; i < IP_LEN; i++)
-        if((source[i] & EtherCard::netmask[i]) != (destination[i] & EtherCard::netmask[i])) {
+        if((source[i] & gNIC.netmask[i]) != (destination[i] & gNIC.netmask[i])) {
             return false;
         }
     return true;
 }
 
+// return the entry of a joined multicast group, or 0
+static uint8_t *find_multicast_group(const uint8_t *group) {
+    for (uint8_t i = 0; i < ETHERCARD_MULTICAST_GROUPS; ++i)
+        if (memcmp(gNIC.multicastGroups[i], group, IP_LEN) == 0)
+            return gNIC.multicastGroups[i];
+    return 0;
+}
+
 static uint8_t is_my_ip(const IpHeader &iph) {
     return iph.version() == IP_V4 && iph.ihl() == IP_IHL &&
-           (memcmp(iph.tpaddr, EtherCard::myip, IP_LEN) == 0  //not my IP
-            || (memcmp(iph.tpaddr, EtherCard::broadcastip, IP_LEN) == 0) //not subnet broadcast
-            || (memcmp(iph.tpaddr, allOnes, IP_LEN) == 0)); //not global broadcasts
-    //!@todo Handle multicast
+           (memcmp(iph.tpaddr, gNIC.myip, IP_LEN) == 0  //not my IP
+            || (memcmp(iph.tpaddr, gNIC.broadcastip, IP_LEN) == 0) //not subnet broadcast
+            || (memcmp(iph.tpaddr, allOnes, IP_LEN) == 0) //not global broadcasts
+            || ((iph.tpaddr[0] & 0xF0) == 0xE0 && find_multicast_group(iph.tpaddr))); //not a joined group
 }
 
 static void fill_ip_hdr_checksum(IpHeader &iph) {
@@ -217,6 +335,24 @@ static void step_seq(uint16_t rel_ack_num,uint8_t cp_seq) {
     }
 }
 
+static void setSequenceNumber(uint32_t seq) {
+    gPB[TCP_SEQ_H_P]   = (seq & 0xff000000 ) >> 24;
+    gPB[TCP_SEQ_H_P+1] = (seq & 0xff0000 ) >> 16;
+    gPB[TCP_SEQ_H_P+2] = (seq & 0xff00 ) >> 8;
+    gPB[TCP_SEQ_H_P+3] = (seq & 0xff );
+}
+
+static void setAcknowledgementNumber(uint32_t ack) {
+    gPB[TCP_SEQACK_H_P]   = (ack & 0xff000000 ) >> 24;
+    gPB[TCP_SEQACK_H_P+1] = (ack & 0xff0000 ) >> 16;
+    gPB[TCP_SEQACK_H_P+2] = (ack & 0xff00 ) >> 8;
+    gPB[TCP_SEQACK_H_P+3] = (ack & 0xff );
+}
+
+static uint32_t getAcknowledgementNumber() {
+    return ntohl(*(uint32_t *)(gPB + TCP_SEQACK_H_P));
+}
+
 static void make_tcphead(uint16_t rel_ack_num,uint8_t cp_seq) {
     uint8_t i = gPB[TCP_DST_PORT_H_P];
     gPB[TCP_DST_PORT_H_P] = gPB[TCP_SRC_PORT_H_P];
@@ -225,6 +361,13 @@ static void make_tcphead(uint16_t rel_ack_num,uint8_t cp_seq) {
     gPB[TCP_DST_PORT_L_P] = gPB[TCP_SRC_PORT_L_P];
     gPB[TCP_SRC_PORT_L_P] = j;
     step_seq(rel_ack_num,cp_seq);
+#if ETHERCARD_TCPSERVER && ETHERCARD_TCP_CONNECTIONS
+    if (tcp->tcp_conn) {
+        // the connection knows where both directions stand, the segment may be stale
+        setSequenceNumber(tcp->tcp_conn->sndNxt);
+        setAcknowledgementNumber(tcp->tcp_conn->rcvNxt);
+    }
+#endif
     gPB[TCP_CHECKSUM_H_P] = 0;
     gPB[TCP_CHECKSUM_L_P] = 0;
     gPB[TCP_HEADER_LEN_P] = 0x50;
@@ -238,20 +381,22 @@ static void make_arp_answer_from_request() {
     ArpHeader &arp = arp_header();
     arp.opcode = ETH_ARP_OPCODE_REPLY;
     EtherCard::copyMac(arp.thaddr, arp.shaddr);
-    EtherCard::copyMac(arp.shaddr, EtherCard::mymac);
+    EtherCard::copyMac(arp.shaddr, gNIC.mymac);
     EtherCard::copyIp(arp.tpaddr, arp.spaddr);
-    EtherCard::copyIp(arp.spaddr, EtherCard::myip);
+    EtherCard::copyIp(arp.spaddr, gNIC.myip);
 
     // send ethernet frame
     EtherCard::packetSend((uint8_t *)&arp + sizeof(ArpHeader) - gPB); // 42
 }
 
-static void make_echo_reply_from_request(uint16_t len) {
+static void make_echo_reply_from_request() {
     make_eth_ip_reply();
     IcmpHeader &ih = icmp_header();
     ih.type = ICMP_TYPE_ECHOREPLY_V;
     ih.checksum = ih.checksum + 0x08;
-    EtherCard::packetSend(len);
+    // only the headers go over SPI, the chip copies the echo data itself
+    EtherCard::packetSendReceived(ETH_HEADER_LEN + ntohs(ip_header().totalLen),
+                                  icmp_payload() - gPB);
 }
 
 void EtherCard::makeUdpReply (const char *data,uint8_t datalen,uint16_t port) {
@@ -264,28 +409,49 @@ void EtherCard::makeUdpReply (const char *data,uint8_t datalen,uint16_t port) {
     udph.dport = udph.sport;
     htons(udph.sport, port);
     htons(udph.length, sizeof(UdpHeader)+datalen);
-    udph.checksum = 0;
     memcpy(udp_payload(), data, datalen);
-    fill_checksum(udph.checksum, (const uint8_t *)&iph.spaddr, 16 + datalen,1);
-    packetSend(udp_payload() - gPB + datalen);
+    send_with_checksum((uint8_t *)&udph.checksum - gPB, (uint8_t *)&iph.spaddr - gPB, 16 + datalen,1);
+}
+
+// the largest segment we take, anything longer than the data buffer gets truncated
+static uint16_t tcp_local_mss() {
+    const uint16_t room = gNIC.bufferSize - 1 - (TCP_SRC_PORT_H_P + TCP_HEADER_LEN_PLAIN);
+    return room < TCP_MSS_MAX ? room : TCP_MSS_MAX;
+}
+
+// put the window into the TCP header in the data buffer: as many full segments
+// as the free receive ring holds, at least one as we never announce it open again;
+// the ring is read once per packetLoop() pass, not for every segment of a burst
+static void tcp_set_window() {
+    if (!tcp->tcp_window) {
+        const uint16_t mss = tcp_local_mss();
+        // a frame also takes its headers, the CRC, the receive header and a pad byte
+        uint16_t n = ENC28J60::rxFree() / (TCP_SRC_PORT_H_P + TCP_HEADER_LEN_PLAIN + mss + 4 + 6 + 1);
+        if (n == 0)
+            n = 1;
+        tcp->tcp_window = n * mss;
+    }
+    gPB[TCP_WIN_SIZE] = tcp->tcp_window >> 8;
+    gPB[TCP_WIN_SIZE+1] = tcp->tcp_window;
 }
 
-static void make_tcp_synack_from_syn() {
+// the MSS option of a SYN we send
+static void tcp_set_mss_option() {
+    const uint16_t mss = tcp_local_mss();
+    gPB[TCP_OPTIONS_P] = 2;
+    gPB[TCP_OPTIONS_P+1] = 4;
+    gPB[TCP_OPTIONS_P+2] = mss >> 8;
+    gPB[TCP_OPTIONS_P+3] = mss;
+}
+
+static void make_tcp_synack_from_syn(uint32_t isn) {
     make_eth_ip_reply(TCP_HEADER_LEN_PLAIN+4);
     gPB[TCP_FLAGS_P] = TCP_FLAGS_SYNACK_V;
     make_tcphead(1,0);
-    gPB[TCP_SEQ_H_P+0] = 0;
-    gPB[TCP_SEQ_H_P+1] = 0;
-    gPB[TCP_SEQ_H_P+2] = seqnum;
-    gPB[TCP_SEQ_H_P+3] = 0;
-    seqnum += 3;
-    gPB[TCP_OPTIONS_P] = 2;
-    gPB[TCP_OPTIONS_P+1] = 4;
-    gPB[TCP_OPTIONS_P+2] = 0x05;
-    gPB[TCP_OPTIONS_P+3] = 0x0;
+    setSequenceNumber(isn);
+    tcp_set_mss_option();
     gPB[TCP_HEADER_LEN_P] = 0x60;
-    gPB[TCP_WIN_SIZE] = 0x5; // 1400=0x578
-    gPB[TCP_WIN_SIZE+1] = 0x78;
+    tcp_set_window();
     fill_checksum(TCP_CHECKSUM_H_P, (uint8_t *)&ip_header().spaddr - gPB, 8+TCP_HEADER_LEN_PLAIN+4,2);
     EtherCard::packetSend(tcp_header() - gPB + TCP_HEADER_LEN_PLAIN+4);
 }
@@ -298,39 +464,236 @@ uint16_t EtherCard::getTcpPayloadLength() {
     return (uint16_t)i;
 }
 
+ENC28J60Reader EtherCard::tcpPayloadReader() {
+    return ENC28J60Reader(TCP_DATA_START, getTcpPayloadLength());
+}
+
+ENC28J60Reader EtherCard::udpPayloadReader() {
+    return ENC28J60Reader(udp_payload() - gPB, ntohs(udp_header().length) - sizeof(UdpHeader));
+}
+
 static void make_tcp_ack_from_any(int16_t datlentoack,uint8_t addflags) {
     gPB[TCP_FLAGS_P] = TCP_FLAGS_ACK_V|addflags;
     if (addflags!=TCP_FLAGS_RST_V && datlentoack==0)
         datlentoack = 1;
     make_tcphead(datlentoack,1); // no options
     make_eth_ip_reply(TCP_HEADER_LEN_PLAIN);
-    gPB[TCP_WIN_SIZE] = 0x4; // 1024=0x400, 1280=0x500 2048=0x800 768=0x300
-    gPB[TCP_WIN_SIZE+1] = 0;
+    tcp_set_window();
     fill_checksum(TCP_CHECKSUM_H_P, (uint8_t *)&ip_header().spaddr - gPB, 8+TCP_HEADER_LEN_PLAIN,2);
     EtherCard::packetSend(tcp_header() - gPB + TCP_HEADER_LEN_PLAIN);
 }
 
-static void make_tcp_ack_with_data_noflags(uint16_t dlen) {
-    IpHeader &iph = ip_header();
-    htons(iph.totalLen, ip_payload() - (uint8_t *)&ip_header() + TCP_HEADER_LEN_PLAIN + dlen);
-    fill_ip_hdr_checksum(iph);
+static void tcp_timer_init(TcpTimer &t) {
+    memset(&t, 0, sizeof t);
+    t.rto = TCP_RTO_INITIAL;
+}
+
+// start the timer for a segment just sent when nothing was outstanding
+static void tcp_timer_start(TcpTimer &t) {
+    t.sentAt = millis();
+    t.timing = true;
+}
+
+// new data was acknowledged: take a round trip sample unless the segment was
+// sent again (Karn) and undo the back off, then restart the timer for whatever
+// is still outstanding
+static void tcp_timer_acked(TcpTimer &t) {
+    const uint16_t now = millis();
+    if (t.timing) {
+        uint16_t r = now - t.sentAt;
+        if (t.srtt == 0) {
+            t.srtt = r ? r : 1;
+            t.rttvar = r / 2;
+        } else {
+            uint16_t err = t.srtt > r ? t.srtt - r : r - t.srtt;
+            t.rttvar = t.rttvar - t.rttvar / 4 + err / 4;
+            t.srtt = t.srtt - t.srtt / 8 + r / 8;
+        }
+    }
+    if (t.srtt) {
+        uint32_t rto = t.srtt + (t.rttvar ? 4UL * t.rttvar : 1);
+        t.rto = rto < ETHERCARD_TCP_RTO_MIN ? ETHERCARD_TCP_RTO_MIN :
+                rto > TCP_RTO_MAX ? TCP_RTO_MAX : rto;
+    } else {
+        t.rto = TCP_RTO_INITIAL;
+    }
+    t.sentAt = now;
+    t.retries = 0;
+    t.timing = false;
+}
+
+// true if the oldest outstanding segment is due to be sent again, which
+// then counts as a retransmission with the timeout backed off
+static bool tcp_timer_expired(TcpTimer &t) {
+    const uint16_t now = millis();
+    if ((uint16_t) (now - t.sentAt) < t.rto)
+        return false;
+    t.rto = t.rto > TCP_RTO_MAX / 2 ? TCP_RTO_MAX : t.rto * 2;
+    t.sentAt = now;
+    ++t.retries;
+    t.timing = false;
+    return true;
+}
+
+// a before b in sequence space
+static bool seq_before(uint32_t a, uint32_t b) {
+    return (int32_t) (a - b) < 0;
+}
+
+// keep the data segment just queued until the peer acknowledges end
+static void tcp_copy_keep(uint8_t owner, uint32_t end) {
+#if ETHERCARD_TCP_COPIES
+    for (TcpCopy *c = tcp->tcp_copies; c != tcp->tcp_copies + ETHERCARD_TCP_COPIES; ++c)
+        if (c->frame.start == 0) {
+            c->frame = EtherCard::templateKeep();
+            c->owner = owner;
+            c->end = end;
+            return;
+        }
+#else
+    (void) owner;
+    (void) end;
+#endif
+}
+
+// release the copies the peer acknowledged with ack, or all of them
+static void tcp_copy_release(uint8_t owner, uint32_t ack, bool all = false) {
+#if ETHERCARD_TCP_COPIES
+    for (TcpCopy *c = tcp->tcp_copies; c != tcp->tcp_copies + ETHERCARD_TCP_COPIES; ++c)
+        if (c->frame.start && c->owner == owner && (all || !seq_before(ack, c->end)))
+            EtherCard::templateFree(c->frame);
+#else
+    (void) owner;
+    (void) ack;
+    (void) all;
+#endif
+}
+
+// send the copy of the oldest segment which is not acknowledged yet; false if there is none
+static bool tcp_copy_resend(uint8_t owner, uint32_t una) {
+#if ETHERCARD_TCP_COPIES
+    TcpCopy *oldest = 0;
+    for (TcpCopy *c = tcp->tcp_copies; c != tcp->tcp_copies + ETHERCARD_TCP_COPIES; ++c)
+        if (c->frame.start && c->owner == owner && seq_before(una, c->end) &&
+                (!oldest || seq_before(c->end, oldest->end)))
+            oldest = c;
+    if (oldest) {
+        EtherCard::templateSend(oldest->frame);
+        return true;
+    }
+#else
+    (void) owner;
+    (void) una;
+#endif
+    return false;
+}
+
+// sequence number of the next server segment
+static uint32_t server_seq() {
+#if ETHERCARD_TCPSERVER && ETHERCARD_TCP_CONNECTIONS
+    if (tcp->tcp_conn)
+        return tcp->tcp_conn->sndNxt;
+#endif
+    return tcp->SEQ;
+}
+
+// account for a server segment of dlen bytes just sent with flags
+static void server_sent(uint16_t dlen, uint8_t flags) {
+    tcp->SEQ += dlen;
+#if ETHERCARD_TCPSERVER && ETHERCARD_TCP_CONNECTIONS
+    if (tcp->tcp_conn) {
+        if (tcp->tcp_conn->sndUna == tcp->tcp_conn->sndNxt && (dlen || (flags & TCP_FLAGS_FIN_V)))
+            tcp_timer_start(tcp->tcp_conn->rtx);
+        tcp->tcp_conn->sndNxt += dlen;
+        if (flags & TCP_FLAGS_FIN_V) {
+            ++tcp->tcp_conn->sndNxt;
+            if (tcp->tcp_conn->state == TCP_SERVER_ESTABLISHED)
+                tcp->tcp_conn->state = TCP_SERVER_FIN_WAIT;
+            else if (tcp->tcp_conn->state == TCP_SERVER_CLOSE_WAIT)
+                tcp->tcp_conn->state = TCP_SERVER_LAST_ACK;
+        }
+        if (dlen)
+            tcp_copy_keep(tcp->tcp_conn - tcp->tcp_conns, tcp->tcp_conn->sndNxt);
+    }
+#else
+    (void) flags;
+#endif
+}
+
+// send the IP and TCP headers in the data buffer followed by the dlen bytes of segs
+static void send_segments(const ENC28J60Segment* segs, uint8_t count, uint16_t dlen) {
     gPB[TCP_CHECKSUM_H_P] = 0;
     gPB[TCP_CHECKSUM_L_P] = 0;
-    fill_checksum(TCP_CHECKSUM_H_P, (uint8_t *)&ip_header().spaddr - gPB, 8+TCP_HEADER_LEN_PLAIN+dlen,2);
-    EtherCard::packetSend(tcp_header() - gPB + TCP_HEADER_LEN_PLAIN + dlen);
+    const uint8_t off = (uint8_t *)&ip_header().spaddr - gPB;
+    EtherCard::packetSendSegments(tcp_header() - gPB + TCP_HEADER_LEN_PLAIN, segs, count, off,
+                                  TCP_CHECKSUM_H_P, IP_PROTO_TCP_V + TCP_HEADER_LEN_PLAIN + dlen);
 }
 
-void EtherCard::httpServerReply (uint16_t dlen) {
-    make_tcp_ack_from_any(info_data_len,0); // send ack for http get
-    gPB[TCP_FLAGS_P] = TCP_FLAGS_ACK_V|TCP_FLAGS_PUSH_V|TCP_FLAGS_FIN_V;
-    make_tcp_ack_with_data_noflags(dlen); // send data
+// the len bytes of seg from byte off on
+static ENC28J60Segment segment_slice(const ENC28J60Segment &seg, uint16_t off, uint16_t len) {
+    ENC28J60Segment piece = seg;
+    piece.len = len;
+    if (seg.source == ENC28J60Segment::STASH)
+        piece.data = (const void *) ((uintptr_t) seg.data + off);
+    else
+        piece.data = (const uint8_t *) seg.data + off;
+    return piece;
 }
 
-static void setSequenceNumber(uint32_t seq) {
-    gPB[TCP_SEQ_H_P]   = (seq & 0xff000000 ) >> 24;
-    gPB[TCP_SEQ_H_P+1] = (seq & 0xff0000 ) >> 16;
-    gPB[TCP_SEQ_H_P+2] = (seq & 0xff00 ) >> 8;
-    gPB[TCP_SEQ_H_P+3] = (seq & 0xff );
+// the largest segment the client of the reply takes, unknown without an entry in the table
+static uint16_t server_mss() {
+#if ETHERCARD_TCPSERVER && ETHERCARD_TCP_CONNECTIONS
+    if (tcp->tcp_conn)
+        return tcp->tcp_conn->mss;
+#endif
+    return 0xFFFF;
+}
+
+// Send the dlen bytes of segs with the headers in the data buffer, cut into
+// segments of at most the client's MSS; PUSH and FIN only go with the last one
+static void server_send(const ENC28J60Segment* segs, uint8_t count, uint16_t dlen, uint8_t flags) {
+    const uint16_t mss = server_mss();
+    uint8_t i = 0;
+    uint16_t skip = 0; // bytes of segs[i] already sent
+    do {
+        ENC28J60Segment piece;
+        const ENC28J60Segment *part = segs + i;
+        uint8_t parts = 0;
+        uint16_t n = 0;
+        if (i < count && (skip || segs[i].len > mss)) {
+            // a segment larger than the MSS goes in slices
+            n = segs[i].len - skip < mss ? segs[i].len - skip : mss;
+            piece = segment_slice(segs[i], skip, n);
+            part = &piece;
+            parts = 1;
+            skip += n;
+            if (skip == segs[i].len) {
+                ++i;
+                skip = 0;
+            }
+        } else {
+            // else as many whole ones as fit
+            while (i + parts < count && n + segs[i + parts].len <= mss)
+                n += segs[i + parts++].len;
+            i += parts;
+        }
+        dlen -= n;
+        const uint8_t f = dlen ? flags & ~(TCP_FLAGS_PUSH_V|TCP_FLAGS_FIN_V) : flags;
+        gPB[TCP_FLAGS_P] = f;
+        IpHeader &iph = ip_header();
+        htons(iph.totalLen, ip_payload() - (uint8_t *)&iph + TCP_HEADER_LEN_PLAIN + n);
+        fill_ip_hdr_checksum(iph);
+        send_segments(part, parts, n);
+        server_sent(n, f);
+        if (dlen)
+            setSequenceNumber(EtherCard::getSequenceNumber() + n);
+    } while (dlen);
+}
+
+void EtherCard::httpServerReply (uint16_t dlen) {
+    make_tcp_ack_from_any(tcp->info_data_len,0); // send ack for http get
+    const ENC28J60Segment data = { ENC28J60Segment::RAM, 0, dlen, tcpOffset() };
+    server_send(&data, 1, dlen, TCP_FLAGS_ACK_V|TCP_FLAGS_PUSH_V|TCP_FLAGS_FIN_V); // send data
 }
 
 uint32_t EtherCard::getSequenceNumber() {
@@ -339,14 +702,26 @@ uint32_t EtherCard::getSequenceNumber() {
 
 void EtherCard::httpServerReplyAck () {
     make_tcp_ack_from_any(getTcpPayloadLength(), 0); // send ack for http request
-    SEQ = getSequenceNumber(); //get the sequence number of packets after an ack from GET
+    tcp->SEQ = getSequenceNumber(); //get the sequence number of packets after an ack from GET
 }
 
 void EtherCard::httpServerReply_with_flags (uint16_t dlen , uint8_t flags) {
-    setSequenceNumber(SEQ);
-    gPB[TCP_FLAGS_P] = flags; // final packet
-    make_tcp_ack_with_data_noflags(dlen); // send data
-    SEQ=SEQ+dlen;
+    setSequenceNumber(server_seq());
+    const ENC28J60Segment data = { ENC28J60Segment::RAM, 0, dlen, tcpOffset() };
+    server_send(&data, 1, dlen, flags); // send data
+}
+
+void EtherCard::httpServerReplySegments (const ENC28J60Segment* segs, uint8_t count, uint8_t flags) {
+    uint16_t dlen = 0;
+    for (uint8_t i = 0; i < count; ++i) {
+        dlen += segs[i].len;
+#if ETHERCARD_STASH
+        if (segs[i].source == ENC28J60Segment::STASH)
+            Stash::flush();
+#endif
+    }
+    setSequenceNumber(server_seq());
+    server_send(segs, count, dlen, flags);
 }
 
 // initialize ethernet frame and IP header
@@ -366,6 +741,38 @@ static IpHeader &init_ip_frame(
     return iph;
 }
 
+// Build the headers of a segment of a connection from what we know about it,
+// for dlen bytes of payload; a SYN gets the MSS option. Returns the TCP header length
+static uint8_t tcp_segment_head(const uint8_t *ip, uint16_t localPort, uint16_t port, uint32_t seq,
+                                uint32_t ack, uint8_t flags, uint16_t dlen) {
+    const uint8_t hlen = TCP_HEADER_LEN_PLAIN + ((flags & TCP_FLAGS_SYN_V) ? 4 : 0);
+    IpHeader &iph = init_ip_frame(ip, IP_PROTO_TCP_V);
+    htons(iph.totalLen, sizeof(IpHeader) + hlen + dlen);
+    fill_ip_hdr_checksum(iph);
+    gPB[TCP_SRC_PORT_H_P] = localPort >> 8;
+    gPB[TCP_SRC_PORT_L_P] = localPort;
+    gPB[TCP_DST_PORT_H_P] = port >> 8;
+    gPB[TCP_DST_PORT_L_P] = port;
+    setSequenceNumber(seq);
+    setAcknowledgementNumber(ack);
+    gPB[TCP_HEADER_LEN_P] = hlen << 2;
+    gPB[TCP_FLAGS_P] = flags;
+    tcp_set_window();
+    gPB[TCP_CHECKSUM_L_P+1] = 0; // urgent pointer
+    gPB[TCP_CHECKSUM_L_P+2] = 0;
+    if (flags & TCP_FLAGS_SYN_V)
+        tcp_set_mss_option();
+    return hlen;
+}
+
+// Build a segment of a connection and send it, dlen bytes of payload must
+// already be at tcpOffset()
+static void tcp_segment(const uint8_t *ip, uint16_t localPort, uint16_t port, uint32_t seq,
+                        uint32_t ack, uint8_t flags, uint16_t dlen) {
+    const uint8_t hlen = tcp_segment_head(ip, localPort, port, seq, ack, flags, dlen);
+    send_with_checksum(TCP_CHECKSUM_H_P, (uint8_t *)&ip_header().spaddr - gPB, 8 + hlen + dlen, 2);
+}
+
 void EtherCard::clientIcmpRequest(const uint8_t *destip) {
     IpHeader &iph = init_ip_frame(destip, IP_PROTO_ICMP_V);
     iph.totalLen = HTONS(0x54);
@@ -374,7 +781,7 @@ void EtherCard::clientIcmpRequest(const uint8_t *destip) {
     ih.type = ICMP_TYPE_ECHOREQUEST_V;
     ih.code = 0;
     ih.checksum = 0;
-    ih.ping.identifier = HTONS(0x0500 | EtherCard::myip[3]);
+    ih.ping.identifier = HTONS(0x0500 | gNIC.myip[3]);
     ih.ping.sequence = HTONS(1);
     memset(icmp_payload(), ICMP_PING_PAYLOAD_PATTERN, ICMP_PING_PAYLOAD_SIZE);
     fill_checksum(ih.checksum, (const uint8_t *)&ih, sizeof(IcmpHeader) + ICMP_PING_PAYLOAD_SIZE, 0);
@@ -397,15 +804,18 @@ void EtherCard::ntpRequest (uint8_t *ntpip, uint8_t srcport) {
     packetSend(90);
 }
 
-uint8_t EtherCard::ntpProcessAnswer (uint32_t *time,uint8_t dstport_l) {
+uint8_t EtherCard::ntpProcessAnswer (uint32_t *time,uint8_t dstport_l,uint32_t *arrival) {
     UdpHeader &udph = udp_header();
     if ((dstport_l && (ntohs(udph.dport) & 0xFF) != dstport_l) || udph.length != HTONS(56)
             || udph.sport != HTONS(NTP_PORT))
         return 0;
+    packetFetch();
     ((uint8_t*) time)[3] = gPB[0x52];
     ((uint8_t*) time)[2] = gPB[0x53];
     ((uint8_t*) time)[1] = gPB[0x54];
     ((uint8_t*) time)[0] = gPB[0x55];
+    if (arrival)
+        *arrival = packetTime();
     return 1;
 }
 
@@ -425,8 +835,31 @@ void EtherCard::udpTransmit (uint16_t datalen) {
 
     UdpHeader &udph = udp_header();
     htons(udph.length, sizeof(UdpHeader) + datalen);
-    fill_checksum(udph.checksum, (const uint8_t *)&iph.spaddr, 16 + datalen,1);
-    packetSend(udp_payload() - gPB + datalen);
+    send_with_checksum((uint8_t *)&udph.checksum - gPB, (uint8_t *)&iph.spaddr - gPB, 16 + datalen,1);
+}
+
+// Offsets within a UDP frame built by udpPrepare(), which has no IP options
+#define UDP_CHECKSUM_P  (sizeof(EthHeader) + sizeof(IpHeader) + 6)
+#define UDP_DATA_P      (sizeof(EthHeader) + sizeof(IpHeader) + sizeof(UdpHeader))
+
+ENC28J60Template EtherCard::udpTemplate (uint16_t datalen) {
+    IpHeader &iph = ip_header();
+    htons(iph.totalLen, sizeof(IpHeader) + sizeof(UdpHeader) + datalen);
+    fill_ip_hdr_checksum(iph);
+
+    UdpHeader &udph = udp_header();
+    htons(udph.length, sizeof(UdpHeader) + datalen);
+    fill_checksum((uint8_t *)&udph.checksum - gPB, (uint8_t *)&iph.spaddr - gPB, 16 + datalen, 1);
+    return templateStore(UDP_DATA_P + datalen);
+}
+
+void EtherCard::udpTemplateSend (const ENC28J60Template& tmpl, uint16_t offset,
+                                 const void *data, uint16_t len) {
+    if (tmpl.start == 0)
+        return;
+    if (data != 0 && len != 0)
+        templatePatch(tmpl, UDP_DATA_P + offset, data, len, UDP_CHECKSUM_P);
+    templateSend(tmpl);
 }
 
 void EtherCard::sendUdp (const char *data, uint8_t datalen, uint16_t sport,
@@ -460,8 +893,8 @@ static void client_arp_whohas(const uint8_t *ip_we_search) {
     arp.hlen = ETH_LEN;
     arp.plen = IP_LEN;
     arp.opcode = ETH_ARP_OPCODE_REQ;
-    EtherCard::copyMac(arp.shaddr, EtherCard::mymac);
-    EtherCard::copyIp(arp.spaddr, EtherCard::myip);
+    EtherCard::copyMac(arp.shaddr, gNIC.mymac);
+    EtherCard::copyIp(arp.spaddr, gNIC.myip);
     memset(arp.thaddr, 0, sizeof(arp.thaddr));
     EtherCard::copyIp(arp.tpaddr, ip_we_search);
 
@@ -475,7 +908,7 @@ static void client_arp_whohas(const uint8_t *ip_we_search) {
 static void client_arp_refresh(const uint8_t *ip)
 {
     // Check every 65536 (no-packet) cycles whether we need to retry ARP requests
-    if (is_lan(EtherCard::myip, ip) && (!EtherCard::arpStoreHasMac(ip) || EtherCard::delaycnt == 0))
+    if (is_lan(gNIC.myip, ip) && (!EtherCard::arpStoreHasMac(ip) || gNIC.delaycnt == 0))
         client_arp_whohas(ip);
 }
 
@@ -490,76 +923,177 @@ uint8_t EtherCard::clientWaitIp(const uint8_t *ip)
 }
 
 uint8_t EtherCard::clientWaitingGw () {
-    return clientWaitIp(gwip);
+    return clientWaitIp(gNIC.gwip);
 }
 
 uint8_t EtherCard::clientWaitingDns () {
-    return clientWaitIp(dnsip);
+    return clientWaitIp(gNIC.dnsip);
 }
 
 void EtherCard::setGwIp (const uint8_t *gwipaddr) {
-    if (memcmp(gwipaddr, gwip, IP_LEN) != 0)
-        arpStoreInvalidIp(gwip);
-    copyIp(gwip, gwipaddr);
+    if (memcmp(gwipaddr, gNIC.gwip, IP_LEN) != 0)
+        arpStoreInvalidIp(gNIC.gwip);
+    copyIp(gNIC.gwip, gwipaddr);
 }
 
 void EtherCard::updateBroadcastAddress()
 {
     for(uint8_t i=0; i<IP_LEN; i++)
-        broadcastip[i] = myip[i] | ~netmask[i];
+        gNIC.broadcastip[i] = gNIC.myip[i] | ~gNIC.netmask[i];
 }
 
-static void client_syn(uint8_t srcport,uint8_t dstport_h,uint8_t dstport_l) {
-    IpHeader &iph = init_ip_frame(EtherCard::hisip, IP_PROTO_TCP_V);
-    iph.totalLen = HTONS(44); // good for syn
-    fill_ip_hdr_checksum(iph);
-    gPB[TCP_DST_PORT_H_P] = dstport_h;
-    gPB[TCP_DST_PORT_L_P] = dstport_l;
-    gPB[TCP_SRC_PORT_H_P] = TCPCLIENT_SRC_PORT_H;
-    gPB[TCP_SRC_PORT_L_P] = srcport; // lower 8 bit of src port
-    memset(gPB + TCP_SEQ_H_P, 0, 8);
-    gPB[TCP_SEQ_H_P+2] = seqnum;
-    seqnum += 3;
-    gPB[TCP_HEADER_LEN_P] = 0x60; // 0x60=24 len: (0x60>>4) * 4
-    gPB[TCP_FLAGS_P] = TCP_FLAGS_SYN_V;
-    gPB[TCP_WIN_SIZE] = 0x3; // 1024 = 0x400 768 = 0x300, initial window
-    gPB[TCP_WIN_SIZE+1] = 0x0;
-    gPB[TCP_CHECKSUM_H_P] = 0;
-    gPB[TCP_CHECKSUM_L_P] = 0;
-    gPB[TCP_CHECKSUM_L_P+1] = 0;
-    gPB[TCP_CHECKSUM_L_P+2] = 0;
-    gPB[TCP_OPTIONS_P] = 2;
-    gPB[TCP_OPTIONS_P+1] = 4;
-    gPB[TCP_OPTIONS_P+2] = (CLIENTMSS>>8);
-    gPB[TCP_OPTIONS_P+3] = (uint8_t) CLIENTMSS;
-    fill_checksum(TCP_CHECKSUM_H_P, (uint8_t *)&iph.spaddr - gPB, 8 + TCP_HEADER_LEN_PLAIN + 4, 2);
-    // 4 is the tcp mss option:
-    EtherCard::packetSend(tcp_header() - gPB + TCP_HEADER_LEN_PLAIN + 4);
+void EtherCard::enableFilters()
+{
+    gNIC.filters_enabled = true;
+    updateFilters();
+}
+
+void EtherCard::disableFilters()
+{
+    // back to the pattern programmed by initialize(): any broadcast ARP frame
+    static const uint8_t mask[8] = { 0x3F, 0x30 };
+    static const uint8_t pattern[8] = { 0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0x08,0x06 };
+    gNIC.filters_enabled = false;
+    setPatternFilter(0, mask, pattern);
+    enableBroadcast(true);
+}
+
+void EtherCard::updateFilters()
+{
+    // a group maps to MAC 01:00:5e plus its low 23 bits, the hash filter only
+    // passes frames for those
+    uint8_t table[8];
+    memset(table, 0, sizeof table);
+    for (uint8_t i = 0; i < ETHERCARD_MULTICAST_GROUPS; ++i) {
+        const uint8_t *group = gNIC.multicastGroups[i];
+        if (group[0] != 0) {
+            const uint8_t mac[ETH_LEN] = { 0x01, 0x00, 0x5E, (uint8_t)(group[1] & 0x7F), group[2], group[3] };
+            uint8_t hash = hashFilterIndex(mac);
+            table[hash >> 3] |= 1 << (hash & 7);
+        }
+    }
+    setHashFilter(table);
+
+    if (!gNIC.filters_enabled)
+        return;
+    // a single pattern is available: broadcast ARP requests for our IP, that is
+    // destination, type, opcode and target IP address
+    static const uint8_t mask[8] = { 0x3F, 0x30, 0x30, 0x00, 0xC0, 0x03 };
+    uint8_t pattern[14] = { 0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0x08,0x06,0x00,0x01 };
+    copyIp(pattern + 10, gNIC.myip);
+    setPatternFilter(0, mask, pattern);
+    disableBroadcast(true);
+}
+
+bool EtherCard::joinMulticastGroup(const uint8_t *group)
+{
+    static const uint8_t unused[IP_LEN] = { 0 };
+    if (find_multicast_group(group))
+        return true;
+    uint8_t *entry = find_multicast_group(unused);
+    if (entry == 0)
+        return false;
+    copyIp(entry, group);
+    updateFilters();
+    return true;
+}
+
+void EtherCard::leaveMulticastGroup(const uint8_t *group)
+{
+    uint8_t *entry = find_multicast_group(group);
+    if (entry) {
+        memset(entry, 0, IP_LEN);
+        updateFilters();
+    }
+}
+
+static void client_syn(const TcpClient &c) {
+    tcp_segment(c.ip, TCPCLIENT_SRC_PORT_H << 8 | c.srcPort, c.port, c.sndUna, 0,
+                TCP_FLAGS_SYN_V, 0);
+}
+
+// send the n bytes of the request at tcpOffset() + off as the segment starting at seq
+static void client_segment(const TcpClient &c, uint32_t seq, uint16_t off, uint16_t n, uint8_t flags) {
+    tcp_segment_head(c.ip, TCPCLIENT_SRC_PORT_H << 8 | c.srcPort, c.port, seq, c.rcvNxt, flags, n);
+    const ENC28J60Segment piece = { ENC28J60Segment::RAM, 0, n, EtherCard::tcpOffset() + off };
+    send_segments(&piece, n ? 1 : 0, n);
+}
+
+// return the session a segment to one of our client ports belongs to, or 0
+static TcpClient *tcp_client_find(const IpHeader &iph) {
+    uint16_t port = gPB[TCP_SRC_PORT_H_P] << 8 | gPB[TCP_SRC_PORT_L_P];
+    for (TcpClient *c = tcp->tcp_clients; c != tcp->tcp_clients + ETHERCARD_TCP_CLIENTS; ++c)
+        if (c->state && c->srcPort == gPB[TCP_DST_PORT_L_P] && c->port == port &&
+                check_ip_message_is_from(iph, c->ip))
+            return c;
+    return 0;
+}
+
+static bool tcp_client_fd_used(uint8_t fd) {
+    for (const TcpClient *c = tcp->tcp_clients; c != tcp->tcp_clients + ETHERCARD_TCP_CLIENTS; ++c)
+        if (c->state && c->fd == fd)
+            return true;
+    return false;
+}
+
+// return a free entry; if there is none, the closed or else the
+// quietest session makes way like the single session used to
+static TcpClient *tcp_client_alloc() {
+    TcpClient *found = tcp->tcp_clients;
+    uint16_t now = millis();
+    for (TcpClient *c = tcp->tcp_clients; c != tcp->tcp_clients + ETHERCARD_TCP_CLIENTS; ++c) {
+        if (c->state == 0)
+            return c;
+        bool closed = c->state >= TCP_STATE_CLOSING;
+        bool foundClosed = found->state >= TCP_STATE_CLOSING;
+        if (closed > foundClosed || (closed == foundClosed &&
+                (uint16_t) (now - c->lastSeen) > (uint16_t) (now - found->lastSeen)))
+            found = c;
+    }
+    return found;
 }
 
 uint8_t EtherCard::clientTcpReq (uint8_t (*result_cb)(uint8_t,uint8_t,uint16_t,uint16_t),
-                                 uint16_t (*datafill_cb)(uint8_t),uint16_t port) {
-    client_tcp_result_cb = result_cb;
-    client_tcp_datafill_cb = datafill_cb;
-    tcp_client_port_h = port>>8;
-    tcp_client_port_l = port;
-    tcp_client_state = TCP_STATE_SENDSYN; // Flag to packetloop to initiate a TCP/IP session by send a syn
-    tcp_fd = (tcp_fd + 1) & 7;
-    return tcp_fd;
+                                 uint16_t (*datafill_cb)(uint8_t),uint16_t port,
+                                 const uint8_t *ip) {
+    TcpClient &c = *tcp_client_alloc();
+    c.state = 0;
+    tcp_copy_release(TCP_COPY_CLIENT | (&c - tcp->tcp_clients), 0, true);
+    // the id tells the sessions apart, in the callbacks and in our port
+    for (uint8_t i = 0; i < 8; ++i) {
+        tcp->tcp_fd = (tcp->tcp_fd + 1) & 7;
+        if (!tcp_client_fd_used(tcp->tcp_fd))
+            break;
+    }
+    c.fd = tcp->tcp_fd;
+    copyIp(c.ip, ip ? ip : gNIC.hisip);
+    c.port = port;
+    c.result_cb = result_cb;
+    c.datafill_cb = datafill_cb;
+    c.state = TCP_STATE_SENDSYN; // Flag to packetloop to initiate a TCP/IP session by send a syn
+    return c.fd;
+}
+
+uint8_t EtherCard::tcpClientSessions () {
+    uint8_t count = 0;
+    for (const TcpClient *c = tcp->tcp_clients; c != tcp->tcp_clients + ETHERCARD_TCP_CLIENTS; ++c)
+        if (c->state && c->state < TCP_STATE_CLOSING)
+            ++count;
+    return count;
 }
 
 static uint16_t www_client_internal_datafill_cb(uint8_t fd) {
     BufferFiller bfill = EtherCard::tcpOffset();
-    if (fd==www_fd) {
-        if (client_postval == 0) {
+    if (fd==tcp->www_fd) {
+        if (tcp->client_postval == 0) {
             bfill.emit_p(PSTR("GET $F$S HTTP/1.0\r\n"
                               "Host: $F\r\n"
                               "$F\r\n"
-                              "\r\n"), client_urlbuf,
-                         client_urlbuf_var,
-                         client_hoststr, client_additionalheaderline);
+                              "\r\n"), tcp->client_urlbuf,
+                         tcp->client_urlbuf_var,
+                         tcp->client_hoststr, tcp->client_additionalheaderline);
         } else {
-            const char* ahl = client_additionalheaderline;
+            const char* ahl = tcp->client_additionalheaderline;
             bfill.emit_p(PSTR("POST $F HTTP/1.0\r\n"
                               "Host: $F\r\n"
                               "$F$S"
@@ -567,23 +1101,23 @@ static uint16_t www_client_internal_datafill_cb(uint8_t fd) {
                               "Content-Length: $D\r\n"
                               "Content-Type: application/x-www-form-urlencoded\r\n"
                               "\r\n"
-                              "$S"), client_urlbuf,
-                         client_hoststr,
+                              "$S"), tcp->client_urlbuf,
+                         tcp->client_hoststr,
                          ahl != 0 ? ahl : PSTR(""),
                          ahl != 0 ? "\r\n" : "",
-                         strlen(client_postval),
-                         client_postval);
+                         strlen(tcp->client_postval),
+                         tcp->client_postval);
         }
     }
     return bfill.position();
 }
 
 static uint8_t www_client_internal_result_cb(uint8_t fd, uint8_t statuscode, uint16_t datapos, uint16_t len_of_data) {
-    if (fd!=www_fd)
-        (*client_browser_cb)(4,0,0);
-    else if (statuscode==0 && len_of_data>12 && client_browser_cb) {
+    if (fd!=tcp->www_fd)
+        (*tcp->client_browser_cb)(4,0,0);
+    else if (statuscode==0 && len_of_data>12 && tcp->client_browser_cb) {
         uint8_t f = strncmp("200",(char *)&(gPB[datapos+9]),3) != 0;
-        (*client_browser_cb)(f, ((uint16_t)TCP_SRC_PORT_H_P+(gPB[TCP_HEADER_LEN_P]>>4)*4),len_of_data);
+        (*tcp->client_browser_cb)(f, ((uint16_t)TCP_SRC_PORT_H_P+(gPB[TCP_HEADER_LEN_P]>>4)*4),len_of_data);
     }
     return 0;
 }
@@ -593,22 +1127,22 @@ void EtherCard::browseUrl (const char *urlbuf, const char *urlbuf_varpart, const
 }
 
 void EtherCard::browseUrl (const char *urlbuf, const char *urlbuf_varpart, const char *hoststr, const char *additionalheaderline, void (*callback)(uint8_t,uint16_t,uint16_t)) {
-    client_urlbuf = urlbuf;
-    client_urlbuf_var = urlbuf_varpart;
-    client_hoststr = hoststr;
-    client_additionalheaderline = additionalheaderline;
-    client_postval = 0;
-    client_browser_cb = callback;
-    www_fd = clientTcpReq(&www_client_internal_result_cb,&www_client_internal_datafill_cb,hisport);
+    tcp->client_urlbuf = urlbuf;
+    tcp->client_urlbuf_var = urlbuf_varpart;
+    tcp->client_hoststr = hoststr;
+    tcp->client_additionalheaderline = additionalheaderline;
+    tcp->client_postval = 0;
+    tcp->client_browser_cb = callback;
+    tcp->www_fd = clientTcpReq(&www_client_internal_result_cb,&www_client_internal_datafill_cb,gNIC.hisport);
 }
 
 void EtherCard::httpPost (const char *urlbuf, const char *hoststr, const char *additionalheaderline, const char *postval, void (*callback)(uint8_t,uint16_t,uint16_t)) {
-    client_urlbuf = urlbuf;
-    client_hoststr = hoststr;
-    client_additionalheaderline = additionalheaderline;
-    client_postval = postval;
-    client_browser_cb = callback;
-    www_fd = clientTcpReq(&www_client_internal_result_cb,&www_client_internal_datafill_cb,hisport);
+    tcp->client_urlbuf = urlbuf;
+    tcp->client_hoststr = hoststr;
+    tcp->client_additionalheaderline = additionalheaderline;
+    tcp->client_postval = postval;
+    tcp->client_browser_cb = callback;
+    tcp->www_fd = clientTcpReq(&www_client_internal_result_cb,&www_client_internal_datafill_cb,gNIC.hisport);
 }
 
 static uint16_t tcp_datafill_cb(uint8_t /* fd */) {
@@ -621,32 +1155,32 @@ static uint16_t tcp_datafill_cb(uint8_t /* fd */) {
     Serial.println(len);
     Serial.println((char*) EtherCard::tcpOffset());
 #endif
-    result_fd = 123; // bogus value
+    tcp->result_fd = 123; // bogus value
     return len;
 }
 
 static uint8_t tcp_result_cb(uint8_t fd, uint8_t status, uint16_t datapos, uint16_t /* datalen */) {
     if (status == 0) {
-        result_fd = fd; // a valid result has been received, remember its session id
-        result_ptr = (char*) ether.buffer + datapos;
+        tcp->result_fd = fd; // a valid result has been received, remember its session id
+        tcp->result_ptr = (char*) ether.buffer + datapos;
     }
     return 1;
 }
 
 uint8_t EtherCard::tcpSend () {
-    www_fd = clientTcpReq(&tcp_result_cb, &tcp_datafill_cb, hisport);
-    return www_fd;
+    tcp->www_fd = clientTcpReq(&tcp_result_cb, &tcp_datafill_cb, gNIC.hisport);
+    return tcp->www_fd;
 }
 
 const char* EtherCard::tcpReply (uint8_t fd) {
-    if (result_fd != fd)
+    if (tcp->result_fd != fd)
         return 0;
-    result_fd = 123; // set to a bogus value to prevent future match
-    return result_ptr;
+    tcp->result_fd = 123; // set to a bogus value to prevent future match
+    return tcp->result_ptr;
 }
 
 void EtherCard::registerPingCallback (const IcmpCallback callback) {
-    icmp_cb = callback;
+    tcp->icmp_cb = callback;
 }
 
 uint8_t EtherCard::packetLoopIcmpCheckReply (const uint8_t *ip_monitoredhost) {
@@ -657,23 +1191,465 @@ uint8_t EtherCard::packetLoopIcmpCheckReply (const uint8_t *ip_monitoredhost) {
            check_ip_message_is_from(iph, ip_monitoredhost);
 }
 
+#if ETHERCARD_TCPCLIENT || (ETHERCARD_TCPSERVER && ETHERCARD_TCP_CONNECTIONS)
+// the MSS option of the SYN in the data buffer, at most what a frame holds
+static uint16_t tcp_peer_mss() {
+    const uint8_t *opt = gPB + TCP_OPTIONS_P;
+    const uint8_t *last = gPB + TCP_SRC_PORT_H_P + (gPB[TCP_HEADER_LEN_P] >> 4) * 4;
+    while (opt < last && opt[0] != 0) { // up to the end of the list
+        if (opt[0] == 1) { // no-op
+            ++opt;
+            continue;
+        }
+        if (opt + 1 >= last || opt[1] < 2)
+            break;
+        if (opt[0] == 2 && opt[1] == 4 && opt + 4 <= last && (opt[2] || opt[3])) {
+            const uint16_t mss = opt[2] << 8 | opt[3];
+            return mss < TCP_MSS_MAX ? mss : TCP_MSS_MAX;
+        }
+        opt += opt[1];
+    }
+    return TCP_MSS_DEFAULT;
+}
+#endif
+
+#if ETHERCARD_TCPSERVER && ETHERCARD_TCP_CONNECTIONS
+// the receive window of the segment in the data buffer
+static uint16_t tcp_peer_window() {
+    return gPB[TCP_WIN_SIZE] << 8 | gPB[TCP_WIN_SIZE+1];
+}
+
+#if ETHERCARD_TCP_STREAM
+// sequence number following the FIN of the stream
+static uint32_t tcp_stream_end(const TcpConnection &c) {
+    return c.stream.start + c.stream.source.len + 1;
+}
+
+// true while the client has not acknowledged all of the stream
+static bool tcp_streaming(const TcpConnection &c) {
+    return c.state && (c.stream.source.len || c.stream.fill) &&
+           seq_before(c.sndUna, tcp_stream_end(c));
+}
+
+// the largest segment of the stream: the client's MSS, or what the data buffer
+// holds if the callback produces the bytes
+static uint16_t tcp_stream_mss(const TcpConnection &c) {
+    const uint16_t room = gNIC.bufferSize - (EtherCard::tcpOffset() - gPB);
+    return c.stream.fill && room < c.mss ? room : c.mss;
+}
+
+// Send the segment of the stream which starts at seq, with at most max bytes and
+// the FIN if it reaches the end; returns the sequence number following it
+static uint32_t tcp_stream_send(TcpConnection &c, uint32_t seq, uint16_t max) {
+    TcpStream &s = c.stream;
+    const uint16_t off = seq - s.start;
+    uint16_t dlen = off < s.source.len ? s.source.len - off : 0;
+    if (dlen > max)
+        dlen = max;
+    if (dlen > tcp_stream_mss(c))
+        dlen = tcp_stream_mss(c);
+    if (s.fill) {
+        const uint16_t got = dlen ? (*s.fill)(&c - tcp->tcp_conns, off, EtherCard::tcpOffset(), dlen) : 0;
+        if (got < dlen)
+            s.source.len = off + got; // the callback ended the reply
+        dlen = got;
+    }
+    uint8_t flags = TCP_FLAGS_ACK_V;
+    if (off + dlen == s.source.len)
+        flags |= TCP_FLAGS_PUSH_V|TCP_FLAGS_FIN_V;
+    const uint8_t hlen = tcp_segment_head(c.ip, ntohs(c.localPort), ntohs(c.port), seq, c.rcvNxt,
+                                          flags, dlen);
+    if (s.fill) {
+        send_with_checksum(TCP_CHECKSUM_H_P, (uint8_t *)&ip_header().spaddr - gPB, 8 + hlen + dlen, 2);
+    } else {
+        // straight from the source, a Stash is copied within the chip
+        const ENC28J60Segment piece = segment_slice(s.source, off, dlen);
+        send_segments(&piece, dlen ? 1 : 0, dlen);
+    }
+    return seq + dlen + ((flags & TCP_FLAGS_FIN_V) ? 1 : 0);
+}
+
+// send the segment of the stream at sndUna again, no further than sndNxt
+static void tcp_stream_resend(TcpConnection &c) {
+    const uint32_t flight = c.sndNxt - c.sndUna;
+    tcp_stream_send(c, c.sndUna, flight < c.mss ? flight : c.mss);
+}
+
+// Send as much of the stream as the client's window and ETHERCARD_TCP_STREAM_SEGMENTS
+// allow, in full segments; a short one only at the end
+static void tcp_stream_push(TcpConnection &c) {
+    const uint16_t mss = tcp_stream_mss(c);
+    if (c.stream.lost) {
+        c.stream.lost = false;
+        tcp_stream_resend(c);
+    }
+    if (c.state != TCP_SERVER_ESTABLISHED && c.state != TCP_SERVER_CLOSE_WAIT)
+        return; // our FIN is out, so is all of the stream
+    uint32_t limit = (uint32_t) ETHERCARD_TCP_STREAM_SEGMENTS * mss;
+    if (limit > c.window)
+        limit = c.window;
+    while (seq_before(c.sndNxt, tcp_stream_end(c))) {
+        const uint32_t flight = c.sndNxt - c.sndUna;
+        const uint32_t left = tcp_stream_end(c) - 1 - c.sndNxt;
+        uint32_t room = flight < limit ? limit - flight : 0;
+        if (room > mss)
+            room = mss;
+        if (!flight && !room && left) {
+            // the window is shut and nothing is out whose ACK would open it: probe it
+            // with one byte, which the retransmission timer sends again (RFC 1122 4.2.2.17)
+            c.stream.probe = true;
+            room = 1;
+        } else if (room < left && room < mss) {
+            return; // wait for the ACKs to make room for a full segment
+        }
+        if (c.sndUna == c.sndNxt)
+            tcp_timer_start(c.rtx);
+        c.sndNxt = tcp_stream_send(c, c.sndNxt, room);
+    }
+    c.state = c.state == TCP_SERVER_ESTABLISHED ? TCP_SERVER_FIN_WAIT : TCP_SERVER_LAST_ACK;
+}
+
+// start a stream on the connection of the request being answered
+static bool tcp_stream_start(const ENC28J60Segment &source, EtherCard::StreamFill fill) {
+    if (!tcp->tcp_conn || tcp_streaming(*tcp->tcp_conn) ||
+            (tcp->tcp_conn->state != TCP_SERVER_ESTABLISHED && tcp->tcp_conn->state != TCP_SERVER_CLOSE_WAIT))
+        return false;
+    TcpStream &s = tcp->tcp_conn->stream;
+    s.source = source;
+    s.fill = fill;
+    s.start = tcp->tcp_conn->sndNxt;
+    s.recover = s.start;
+    s.lost = false;
+    s.probe = false;
+    tcp_stream_push(*tcp->tcp_conn);
+    return true;
+}
+#else
+static bool tcp_streaming(const TcpConnection &) {
+    return false;
+}
+#endif
+
+// the table entry of the segment in the data buffer, or 0
+static TcpConnection *tcp_server_find() {
+    const IpHeader &iph = ip_header();
+    const uint16_t port = *(uint16_t *)(gPB + TCP_SRC_PORT_H_P);
+    const uint16_t localPort = *(uint16_t *)(gPB + TCP_DST_PORT_H_P);
+    for (uint8_t i = 0; i < ETHERCARD_TCP_CONNECTIONS; ++i) {
+        TcpConnection &c = tcp->tcp_conns[i];
+        if (c.state && c.port == port && c.localPort == localPort &&
+                memcmp(c.ip, iph.spaddr, IP_LEN) == 0)
+            return &c;
+    }
+    return 0;
+}
+
+// an entry for a new connection: a free one, else the quietest one which is
+// not established; 0 if all are established
+static TcpConnection *tcp_server_alloc() {
+    TcpConnection *victim = 0;
+    const uint16_t now = millis();
+    for (uint8_t i = 0; i < ETHERCARD_TCP_CONNECTIONS; ++i) {
+        TcpConnection &c = tcp->tcp_conns[i];
+        if (c.state == 0)
+            return &c;
+        if (c.state != TCP_SERVER_ESTABLISHED &&
+                (!victim || (uint16_t) (now - c.lastSeen) > (uint16_t) (now - victim->lastSeen)))
+            victim = &c;
+    }
+    if (victim)
+        tcp_copy_release(victim - tcp->tcp_conns, 0, true);
+    return victim;
+}
+
+// Track the segment in the data buffer; returns false if it needs no further
+// handling, else tcp_conn is its entry or 0 for a connection not in the table
+static bool tcp_server_segment() {
+    const uint8_t flags = gPB[TCP_FLAGS_P];
+    TcpConnection *conn = tcp_server_find();
+    tcp->tcp_conn = 0;
+
+    if (flags & TCP_FLAGS_RST_V) {
+        if (conn) {
+            conn->state = 0;
+            tcp_copy_release(conn - tcp->tcp_conns, 0, true);
+        }
+        return false;
+    }
+
+    if (flags & TCP_FLAGS_SYN_V) {
+        // a repeated SYN gets the same answer, a new one a new entry
+        if (!conn || conn->state != TCP_SERVER_SYN_RECEIVED) {
+            if (!conn)
+                conn = tcp_server_alloc();
+            if (conn) {
+                conn->state = TCP_SERVER_SYN_RECEIVED;
+                EtherCard::copyIp(conn->ip, ip_header().spaddr);
+                conn->port = *(uint16_t *)(gPB + TCP_SRC_PORT_H_P);
+                conn->localPort = *(uint16_t *)(gPB + TCP_DST_PORT_H_P);
+                conn->sndNxt = micros(); // clock driven like the ISN of RFC 793
+                conn->sndUna = conn->sndNxt;
+                conn->rcvNxt = EtherCard::getSequenceNumber() + 1;
+                EtherCard::packetFetch(); // the options may lie past the headers read so far
+                conn->mss = tcp_peer_mss();
+                conn->window = tcp_peer_window();
+#if ETHERCARD_TCP_STREAM
+                memset(&conn->stream, 0, sizeof conn->stream);
+#endif
+                tcp_timer_init(conn->rtx);
+                tcp_timer_start(conn->rtx); // for the SYN+ACK accept() sends
+            }
+        } else {
+            conn->rtx.timing = false; // the SYN+ACK goes out again
+        }
+    } else if (!conn) {
+        return true;
+    } else {
+        const uint32_t ack = getAcknowledgementNumber();
+        if (conn->state == TCP_SERVER_SYN_RECEIVED) {
+            if (!(flags & TCP_FLAGS_ACK_V) || ack != conn->sndNxt + 1)
+                return false;
+            ++conn->sndNxt;
+            conn->sndUna = conn->sndNxt;
+            tcp_timer_acked(conn->rtx);
+            conn->state = TCP_SERVER_ESTABLISHED;
+        } else if ((flags & TCP_FLAGS_ACK_V) && seq_before(conn->sndUna, ack) &&
+                   !seq_before(conn->sndNxt, ack)) {
+            conn->sndUna = ack;
+            tcp_copy_release(conn - tcp->tcp_conns, ack);
+            tcp_timer_acked(conn->rtx);
+#if ETHERCARD_TCP_STREAM
+            // after a timeout every segment sent before it may be lost, so one
+            // that is acknowledged only partly goes on with the next (RFC 6582)
+            if (tcp_streaming(*conn) && seq_before(ack, conn->stream.recover))
+                conn->stream.lost = true;
+#endif
+        }
+        if ((flags & TCP_FLAGS_ACK_V) && ack == conn->sndUna) {
+            conn->window = tcp_peer_window();
+#if ETHERCARD_TCP_STREAM
+            // a client which answers the probes keeps the connection while its
+            // window is shut; once it opens, the probe it dropped goes again at once
+            if (conn->stream.probe && !conn->window) {
+                conn->rtx.retries = 0;
+            } else if (conn->stream.probe) {
+                conn->stream.probe = false;
+                if (conn->sndUna != conn->sndNxt)
+                    conn->stream.lost = true;
+            }
+#endif
+        }
+        const uint16_t len = EtherCard::getTcpPayloadLength();
+        const uint32_t seq = EtherCard::getSequenceNumber();
+        if (seq != conn->rcvNxt && len && conn->sndUna != conn->sndNxt &&
+                seq + len + ((flags & TCP_FLAGS_FIN_V) ? 1 : 0) == conn->rcvNxt) {
+            // the client repeats its request as our reply got lost: send the copy of
+            // the reply, or else forget it, so that the sketch answers once more;
+            // a stream sends what got lost itself
+            if (!tcp_streaming(*conn) && !tcp_copy_resend(conn - tcp->tcp_conns, conn->sndUna)) {
+                tcp_copy_release(conn - tcp->tcp_conns, 0, true);
+                conn->rcvNxt = seq;
+                conn->sndNxt = conn->sndUna;
+                conn->state = TCP_SERVER_ESTABLISHED;
+            }
+        }
+        if (seq != conn->rcvNxt) {
+            // a retransmission or a segment out of order: tell where we are
+            if (len || (flags & TCP_FLAGS_FIN_V)) {
+                tcp->tcp_conn = conn;
+                make_tcp_ack_from_any(0, 0);
+            }
+            return false;
+        }
+        if ((flags & TCP_FLAGS_ACK_V) && ack == conn->sndNxt &&
+                conn->state == TCP_SERVER_LAST_ACK) {
+            conn->state = 0; // our FIN is acknowledged, all done
+            return false;
+        }
+        conn->rcvNxt += len;
+        if (flags & TCP_FLAGS_FIN_V) {
+            ++conn->rcvNxt;
+            if (conn->state == TCP_SERVER_ESTABLISHED)
+                conn->state = TCP_SERVER_CLOSE_WAIT;
+            else if (conn->state == TCP_SERVER_FIN_WAIT) {
+                conn->state = 0; // the ACK below is the last segment
+                tcp_copy_release(conn - tcp->tcp_conns, 0, true);
+            }
+        }
+    }
+    if (conn)
+        conn->lastSeen = millis();
+    tcp->tcp_conn = conn;
+    return true;
+}
+
+// Send the oldest segment the client did not acknowledge again, from its copy
+// or from what the entry knows; a lost reply without copy is left to the client
+static void tcp_server_resend(TcpConnection &c) {
+    const uint16_t localPort = ntohs(c.localPort);
+    const uint16_t port = ntohs(c.port);
+    if (c.state == TCP_SERVER_SYN_RECEIVED)
+        tcp_segment(c.ip, localPort, port, c.sndNxt, c.rcvNxt,
+                    TCP_FLAGS_SYNACK_V, 0);
+#if ETHERCARD_TCP_STREAM
+    else if (tcp_streaming(c) && !seq_before(c.sndUna, c.stream.start)) {
+        c.stream.recover = c.sndNxt;
+        tcp_stream_resend(c);
+    }
+#endif
+    else if (tcp_copy_resend(&c - tcp->tcp_conns, c.sndUna))
+        ; // straight from chip memory
+    else if (c.sndUna + 1 == c.sndNxt &&
+             (c.state == TCP_SERVER_FIN_WAIT || c.state == TCP_SERVER_LAST_ACK))
+        tcp_segment(c.ip, localPort, port, c.sndUna, c.rcvNxt,
+                    TCP_FLAGS_ACK_V|TCP_FLAGS_FIN_V, 0);
+}
+
+// Retransmit what the clients did not acknowledge in time, abort connections
+// which exceed ETHERCARD_TCP_RETRIES and drop those which have been quiet for
+// ETHERCARD_TCP_IDLE_TIMEOUT; true if a segment was sent
+static bool tcp_server_poll() {
+    const uint16_t now = millis();
+    bool sent = false;
+    for (uint8_t i = 0; i < ETHERCARD_TCP_CONNECTIONS; ++i) {
+        TcpConnection &c = tcp->tcp_conns[i];
+        if (c.state == 0)
+            continue;
+        if (c.state != TCP_SERVER_SYN_RECEIVED && c.sndUna == c.sndNxt) {
+            if ((uint16_t) (now - c.lastSeen) > ETHERCARD_TCP_IDLE_TIMEOUT)
+                c.state = 0;
+        } else if (tcp_timer_expired(c.rtx)) {
+            sent = true;
+            if (c.rtx.retries <= ETHERCARD_TCP_RETRIES) {
+                tcp_server_resend(c);
+                continue;
+            }
+            if (c.state != TCP_SERVER_SYN_RECEIVED)
+                tcp_segment(c.ip, ntohs(c.localPort), ntohs(c.port), c.sndNxt, c.rcvNxt,
+                            TCP_FLAGS_RST_V, 0);
+            tcp_copy_release(i, 0, true);
+            c.state = 0;
+        }
+    }
+    return sent;
+}
+
+#if ETHERCARD_TCP_STREAM
+// send what the streams have room for, e.g. once the transmit ring took their last segments
+static void tcp_server_push() {
+    for (TcpConnection *c = tcp->tcp_conns; c != tcp->tcp_conns + ETHERCARD_TCP_CONNECTIONS; ++c)
+        if (tcp_streaming(*c))
+            tcp_stream_push(*c);
+}
+#endif
+#endif
+
+uint8_t EtherCard::tcpServerConnection() {
+#if ETHERCARD_TCPSERVER && ETHERCARD_TCP_CONNECTIONS
+    if (tcp->tcp_conn)
+        return tcp->tcp_conn - tcp->tcp_conns;
+#endif
+    return 0xFF;
+}
+
+bool EtherCard::httpServerStream(const ENC28J60Segment& source) {
+#if ETHERCARD_TCPSERVER && ETHERCARD_TCP_CONNECTIONS && ETHERCARD_TCP_STREAM
+    if (source.len == 0 || source.len == 0xFFFF)
+        return false;
+#if ETHERCARD_STASH
+    if (source.source == ENC28J60Segment::STASH)
+        Stash::flush();
+#endif
+    return tcp_stream_start(source, 0);
+#else
+    (void) source;
+    return false;
+#endif
+}
+
+bool EtherCard::httpServerStream(StreamFill fill, uint16_t len) {
+#if ETHERCARD_TCPSERVER && ETHERCARD_TCP_CONNECTIONS && ETHERCARD_TCP_STREAM
+    const ENC28J60Segment source = { ENC28J60Segment::RAM, 0, len, 0 };
+    return fill && len && tcp_stream_start(source, fill);
+#else
+    (void) fill;
+    (void) len;
+    return false;
+#endif
+}
+
+bool EtherCard::httpServerStreaming(uint8_t conn) {
+#if ETHERCARD_TCPSERVER && ETHERCARD_TCP_CONNECTIONS
+    return conn < ETHERCARD_TCP_CONNECTIONS && tcp_streaming(tcp->tcp_conns[conn]);
+#else
+    (void) conn;
+    return false;
+#endif
+}
+
+uint8_t EtherCard::tcpServerConnections() {
+    uint8_t count = 0;
+#if ETHERCARD_TCPSERVER && ETHERCARD_TCP_CONNECTIONS
+    for (uint8_t i = 0; i < ETHERCARD_TCP_CONNECTIONS; ++i)
+        if (tcp->tcp_conns[i].state)
+            ++count;
+#endif
+    return count;
+}
+
 uint16_t EtherCard::accept(const uint16_t port, uint16_t plen) {
     uint16_t pos;
 
     if (gPB[TCP_DST_PORT_H_P] == (port >> 8) &&
             gPB[TCP_DST_PORT_L_P] == ((uint8_t) port))
     {   //Packet targeted at specified port
-        if (gPB[TCP_FLAGS_P] & TCP_FLAGS_SYN_V)
-            make_tcp_synack_from_syn(); //send SYN+ACK
+#if ETHERCARD_TCPSERVER && ETHERCARD_TCP_CONNECTIONS
+        if (!tcp_server_segment())
+            return 0;
+        if (gPB[TCP_FLAGS_P] & TCP_FLAGS_SYN_V) {
+            if (tcp->tcp_conn) {
+                make_tcp_synack_from_syn(tcp->tcp_conn->sndNxt);
+                return 0;
+            }
+        } else if (tcp->tcp_conn) {
+            tcp->info_data_len = getTcpPayloadLength();
+            if (tcp->info_data_len > 0) {
+                pos = TCP_DATA_START; // TCP_DATA_START is a formula
+                if (pos <= plen) {
+                    packetFetch();
+                    return pos;
+                }
+            } else if (gPB[TCP_FLAGS_P] & TCP_FLAGS_FIN_V) {
+                // nothing left to say either: acknowledge with our own FIN,
+                // unless a stream is still under way which ends with it
+                bool closing = tcp->tcp_conn->state == TCP_SERVER_CLOSE_WAIT && !tcp_streaming(*tcp->tcp_conn);
+                make_tcp_ack_from_any(0, closing ? TCP_FLAGS_FIN_V : 0);
+                if (closing)
+                    server_sent(0, TCP_FLAGS_FIN_V);
+            }
+#if ETHERCARD_TCP_STREAM
+            else if (tcp_streaming(*tcp->tcp_conn))
+                tcp_stream_push(*tcp->tcp_conn); // the ACK may have made room for more
+#endif
+            return 0;
+        }
+        // not in the table: answer from the segment alone
+#endif
+        if (gPB[TCP_FLAGS_P] & TCP_FLAGS_SYN_V) {
+            make_tcp_synack_from_syn((uint32_t) tcp->seqnum << 8); //send SYN+ACK
+            tcp->seqnum += 3;
+        }
         else if (gPB[TCP_FLAGS_P] & TCP_FLAGS_ACK_V)
         {   //This is an acknowledgement to our SYN+ACK so let's start processing that payload
-            info_data_len = getTcpPayloadLength();
-            if (info_data_len > 0)
+            tcp->info_data_len = getTcpPayloadLength();
+            if (tcp->info_data_len > 0)
             {   //Got some data
                 pos = TCP_DATA_START; // TCP_DATA_START is a formula
                 //!@todo no idea what this check pos<=plen-8 does; changed this to pos<=plen as otw. perfectly valid tcp packets are ignored; still if anybody has any idea please leave a comment
-                if (pos <= plen)
+                if (pos <= plen) {
+                    packetFetch();
                     return pos;
+                }
             }
             else if (gPB[TCP_FLAGS_P] & TCP_FLAGS_FIN_V)
                 make_tcp_ack_from_any(0, 0); //No data so close connection
@@ -682,13 +1658,64 @@ uint16_t EtherCard::accept(const uint16_t port, uint16_t plen) {
     return 0;
 }
 
+#if ETHERCARD_INTERFACES > 1
+// true if the subnet of the interface holds the host dst, which is not the interface itself
+static bool route_holds(const EtherCard &r, const uint8_t *dst) {
+    if (r.myip[0] == 0 || dst[0] == 0)
+        return false;
+    for (uint8_t i = 0; i < IP_LEN; ++i)
+        if ((r.myip[i] & r.netmask[i]) != (dst[i] & r.netmask[i]))
+            return false;
+    return memcmp(dst, r.myip, IP_LEN) != 0 && memcmp(dst, r.broadcastip, IP_LEN) != 0 &&
+           memcmp(dst, allOnes, IP_LEN) != 0;
+}
+
+// Send a packet addressed to our MAC but not to our IP on to the interface
+// which has a route to its destination, whose instance is read without selecting
+// it; the current interface is selected again afterwards
+static void forward_packet() {
+    IpHeader &iph = ip_header();
+    uint16_t len = sizeof(EthHeader) + ntohs(iph.totalLen);
+    uint8_t from = EtherCard::currentInterface();
+    uint8_t to = from;
+    if (iph.ttl > 1 && len <= EtherCard::packetFetch() && (iph.tpaddr[0] & 0xF0) != 0xE0) {
+        // the interface whose subnet holds the destination, else one with a gateway
+        for (uint8_t i = 0; i < ETHERCARD_INTERFACES && to == from; ++i)
+            if (i != from && route_holds(EtherCard::instance(i), iph.tpaddr))
+                to = i;
+        for (uint8_t i = 0; i < ETHERCARD_INTERFACES && to == from; ++i)
+            if (i != from && EtherCard::instance(i).gwip[0] != 0)
+                to = i;
+    }
+
+    if (to != from) {
+        EtherCard::selectInterface(to); // moves the state pointers only
+        const uint8_t *nexthop = is_lan(gNIC.myip, iph.tpaddr) ? iph.tpaddr : gNIC.gwip;
+        if (client_arp_ready(nexthop)) {
+            --iph.ttl;
+            fill_ip_hdr_checksum(iph);
+            init_eth_header(EtherCard::arpStoreGetMac(nexthop));
+            EtherCard::packetSend(len);
+            ++EtherCard::forwardStats.forwarded;
+            EtherCard::selectInterface(from);
+            return;
+        }
+        // the sender retransmits, by then the next hop may be known
+        if (!EtherCard::arpStoreHasMac(nexthop))
+            client_arp_whohas(nexthop);
+    }
+    ++EtherCard::forwardStats.dropped;
+    EtherCard::selectInterface(from);
+}
+#endif
+
 void EtherCard::packetLoopArp(const uint8_t *first, const uint8_t *last)
 {
     // security: check if received data has expected size, only htype
     // "ethernet" and ptype "IPv4" is supported for the moment.
     // '<' and not '==' because Ethernet II require padding if ethernet frame
     // size is less than 60 bytes includes Ethernet II header
-    if ((uint8_t)(last - first) < sizeof(ArpHeader))
+    if ((uint16_t)(last - first) < sizeof(ArpHeader))
         return;
 
     const ArpHeader &arp = *(const ArpHeader *)first;
@@ -706,8 +1733,11 @@ void EtherCard::packetLoopArp(const uint8_t *first, const uint8_t *last)
         return;
 
     // ignore if not for us
-    if (memcmp(arp.tpaddr, myip, IP_LEN) != 0)
+    if (memcmp(arp.tpaddr, gNIC.myip, IP_LEN) != 0) {
+        ++gNIC.filterStats.misses;
         return;
+    }
+    ++gNIC.filterStats.hits;
 
     // add sender to cache...
     arpStoreSet(arp.spaddr, arp.shaddr);
@@ -719,39 +1749,142 @@ void EtherCard::packetLoopArp(const uint8_t *first, const uint8_t *last)
     }
 }
 
+#if ETHERCARD_TCPCLIENT
+static void tcp_client_abort(TcpClient &c);
+
+// the server has not acknowledged sndUna: send it the oldest outstanding segment again
+static void tcp_client_resend(TcpClient &c) {
+    const uint16_t localPort = TCPCLIENT_SRC_PORT_H << 8 | c.srcPort;
+    if (c.state == TCP_STATE_SYNSENT)
+        client_syn(c);
+    else if (tcp_copy_resend(TCP_COPY_CLIENT | (&c - tcp->tcp_clients), c.sndUna))
+        ; // straight from chip memory
+    else if (c.state == TCP_STATE_CLOSED && c.sndUna + 1 == c.sndNxt)
+        tcp_segment(c.ip, localPort, c.port, c.sndUna, c.rcvNxt,
+                    TCP_FLAGS_ACK_V|TCP_FLAGS_FIN_V, 0);
+    else if (c.state == TCP_STATE_ESTABLISHED && c.datafill_cb == &tcp_datafill_cb)
+        tcp_client_abort(c); // tcpSend() released its Stash once the request was filled in
+    else if (c.state == TCP_STATE_ESTABLISHED && c.datafill_cb) {
+        // fill in the request again, it ends at sndNxt
+        const uint16_t len = (*c.datafill_cb)(c.fd);
+        const uint16_t left = c.sndNxt - c.sndUna;
+        const uint16_t n = left < c.mss ? left : c.mss;
+        if (left <= len)
+            client_segment(c, c.sndUna, len - left, n, TCP_FLAGS_ACK_V | (n == left ? TCP_FLAGS_PUSH_V : 0));
+    }
+}
+
+// our FIN went out, the first one takes a sequence number
+static void client_fin_sent(TcpClient &c) {
+    if (c.state == TCP_STATE_CLOSED)
+        return;
+    c.state = TCP_STATE_CLOSED;
+    if (c.sndUna == c.sndNxt)
+        tcp_timer_start(c.rtx);
+    ++c.sndNxt;
+}
+
+// give up on a session whose segments were retransmitted too often
+static void tcp_client_abort(TcpClient &c) {
+    if (c.state != TCP_STATE_SYNSENT)
+        tcp_segment(c.ip, TCPCLIENT_SRC_PORT_H << 8 | c.srcPort, c.port, c.sndNxt, c.rcvNxt,
+                    TCP_FLAGS_RST_V, 0);
+    tcp_copy_release(TCP_COPY_CLIENT | (&c - tcp->tcp_clients), 0, true);
+    const bool waiting = c.state <= TCP_STATE_ESTABLISHED;
+    c.state = 0;
+    if (waiting && c.result_cb)
+        (*c.result_cb)(c.fd,3,0,0); // like a reset
+}
+
+// initiate pending sessions, retransmit what the servers did not acknowledge
+// in time and drop sessions gone quiet; true if a frame was sent
+static bool tcp_client_poll() {
+    const uint16_t now = millis();
+    bool sent = false;
+    for (TcpClient *c = tcp->tcp_clients; c != tcp->tcp_clients + ETHERCARD_TCP_CLIENTS; ++c) {
+        if (c->state == TCP_STATE_SENDSYN) {
+            sent = true; // an ARP request or the SYN
+            if (EtherCard::isLinkUp())
+                client_arp_refresh(c->ip);
+            if (client_arp_waiting(c->ip))
+                continue;
+            c->state = TCP_STATE_SYNSENT;
+            tcp->tcpclient_src_port_l++; // allocate a new port
+            c->srcPort = (c->fd<<5) | (0x1f & tcp->tcpclient_src_port_l);
+            c->sndUna = (uint32_t) tcp->seqnum << 8;
+            c->sndNxt = c->sndUna + 1;
+            tcp->seqnum += 3;
+            c->lastSeen = now;
+            tcp_timer_init(c->rtx);
+            tcp_timer_start(c->rtx);
+            client_syn(*c);
+        } else if (c->state && c->sndUna != c->sndNxt) {
+            if (!tcp_timer_expired(c->rtx))
+                continue;
+            sent = true;
+            if (c->rtx.retries > ETHERCARD_TCP_RETRIES)
+                tcp_client_abort(*c);
+            else
+                tcp_client_resend(*c);
+        } else if (c->state && (uint16_t) (now - c->lastSeen) >= ETHERCARD_TCP_IDLE_TIMEOUT) {
+            c->state = 0;
+        }
+    }
+    return sent;
+}
+#endif
+
+// Run the timers of the TCP server connections and client sessions; true if they
+// sent a frame, which they build in the data buffer
+static bool tcp_timers() {
+    tcp->tcp_timers_run = millis();
+    bool sent = false;
+#if ETHERCARD_TCPSERVER && ETHERCARD_TCP_CONNECTIONS
+    sent |= tcp_server_poll();
+#endif
+#if ETHERCARD_TCPCLIENT
+    sent |= tcp_client_poll();
+#endif
+    return sent;
+}
+
 void EtherCard::packetLoopIdle()
 {
     if (isLinkUp())
     {
-        client_arp_refresh(gwip);
-        client_arp_refresh(dnsip);
-        client_arp_refresh(hisip);
-    }
-    delaycnt++;
-
-#if ETHERCARD_TCPCLIENT
-    //Initiate TCP/IP session if pending
-    if (tcp_client_state==TCP_STATE_SENDSYN && client_arp_ready(gwip)) { // send a syn
-        tcp_client_state = TCP_STATE_SYNSENT;
-        tcpclient_src_port_l++; // allocate a new port
-        client_syn(((tcp_fd<<5) | (0x1f & tcpclient_src_port_l)),tcp_client_port_h,tcp_client_port_l);
+        client_arp_refresh(gNIC.gwip);
+        client_arp_refresh(gNIC.dnsip);
+        client_arp_refresh(gNIC.hisip);
     }
+    gNIC.delaycnt++;
+#if ETHERCARD_TCPSERVER && ETHERCARD_TCP_CONNECTIONS && ETHERCARD_TCP_STREAM
+    tcp_server_push();
 #endif
+    tcp_timers();
 }
 
 uint16_t EtherCard::packetLoop (uint16_t plen) {
     uint16_t len;
 
 #if ETHERCARD_DHCP
-    if(using_dhcp) {
+    if(gNIC.using_dhcp) {
         ether.DhcpStateMachine(plen);
     }
 #endif
 
+#if ETHERCARD_TCPSERVER && ETHERCARD_TCP_CONNECTIONS
+    tcp->tcp_conn = 0; // replies to the previous segment are done
+#endif
+    tcp->tcp_window = 0; // the ring has changed since the last pass
+
     if (plen < sizeof(EthHeader)) {
         packetLoopIdle();
         return 0;
     }
+    // steady traffic must not hold up retransmissions and timeouts, so the timers
+    // also run between frames, at most once a millisecond
+    if ((uint16_t) millis() != tcp->tcp_timers_run && tcp_timers())
+        packetRefetch();
 
     const uint8_t *iter = gPB;
     const uint8_t *last = gPB + plen;
@@ -769,10 +1902,11 @@ uint16_t EtherCard::packetLoop (uint16_t plen) {
 
     if (eh.etype != ETHTYPE_IP_V)
     {   //Not IP so ignoring
+        ++gNIC.filterStats.misses;
         return 0;
     }
 
-    if ((uint8_t)(last - iter) < sizeof(IpHeader))
+    if ((uint16_t)(last - iter) < sizeof(IpHeader))
     {   // not enough data for IP packet
         return 0;
     }
@@ -780,12 +1914,21 @@ uint16_t EtherCard::packetLoop (uint16_t plen) {
     const IpHeader &iph = ip_header();
     iter += sizeof(IpHeader);
 
-    if (is_my_ip(iph)==0)
+    if (is_my_ip(iph)==0) {
+#if ETHERCARD_INTERFACES > 1
+        if (forwarding_enabled && memcmp(eh.thaddr, gNIC.mymac, ETH_LEN) == 0) {
+            forward_packet();
+            return 0;
+        }
+#endif
+        ++gNIC.filterStats.misses;
         return 0;
+    }
+    ++gNIC.filterStats.hits;
 
     // refresh arp store
-    if (memcmp(eh.thaddr, mymac, ETH_LEN) == 0)
-        arpStoreSet(is_lan(myip, iph.spaddr) ? iph.spaddr : gwip, eh.shaddr);
+    if (memcmp(eh.thaddr, gNIC.mymac, ETH_LEN) == 0)
+        arpStoreSet(is_lan(gNIC.myip, iph.spaddr) ? iph.spaddr : gNIC.gwip, eh.shaddr);
 
 #if ETHERCARD_ICMP
     if (iph.protocol == IP_PROTO_ICMP_V)
@@ -793,9 +1936,9 @@ uint16_t EtherCard::packetLoop (uint16_t plen) {
         const IcmpHeader &ih = icmp_header();
         if (ih.type == ICMP_TYPE_ECHOREQUEST_V)
         {   //Service ICMP echo request (ping)
-            if (icmp_cb)
-                (*icmp_cb)(iph.spaddr);
-            make_echo_reply_from_request(plen);
+            if (tcp->icmp_cb)
+                (*tcp->icmp_cb)(iph.spaddr);
+            make_echo_reply_from_request();
         }
         return 0;
     }
@@ -814,32 +1957,64 @@ uint16_t EtherCard::packetLoop (uint16_t plen) {
 #if ETHERCARD_TCPCLIENT
     if (gPB[TCP_DST_PORT_H_P]==TCPCLIENT_SRC_PORT_H)
     {   //Source port is in range reserved (by EtherCard) for client TCP/IP connections
-        if (check_ip_message_is_from(iph, hisip)==0)
-            return 0; //Not current TCP/IP connection (only handle one at a time)
+        TcpClient *c = tcp_client_find(iph);
+        if (c == 0)
+            return 0; //Not one of our TCP/IP sessions
+        const uint8_t owner = TCP_COPY_CLIENT | (c - tcp->tcp_clients);
+        c->lastSeen = millis();
         if (gPB[TCP_FLAGS_P] & TCP_FLAGS_RST_V)
         {   //TCP reset flagged
-            if (client_tcp_result_cb)
-                (*client_tcp_result_cb)((gPB[TCP_DST_PORT_L_P]>>5)&0x7,3,0,0);
-            tcp_client_state = TCP_STATE_CLOSING;
+            if (c->result_cb)
+                (*c->result_cb)(c->fd,3,0,0);
+            c->state = TCP_STATE_CLOSING;
+            c->sndUna = c->sndNxt; // nothing left to send again
+            tcp_copy_release(owner, 0, true);
             return 0;
         }
         len = getTcpPayloadLength();
-        if (tcp_client_state==TCP_STATE_SYNSENT)
+        const uint32_t ack = getAcknowledgementNumber();
+        if ((gPB[TCP_FLAGS_P] & TCP_FLAGS_ACK_V) && seq_before(c->sndUna, ack) &&
+                !seq_before(c->sndNxt, ack))
+        {   //New data acknowledged
+            c->sndUna = ack;
+            tcp_copy_release(owner, ack);
+            tcp_timer_acked(c->rtx);
+        }
+        if (c->state != TCP_STATE_SYNSENT)
+        {   //Note how far the server got for segments built from scratch
+            uint32_t end = getSequenceNumber() + len + ((gPB[TCP_FLAGS_P] & TCP_FLAGS_FIN_V) ? 1 : 0);
+            if (seq_before(c->rcvNxt, end))
+                c->rcvNxt = end;
+        }
+        if (c->state==TCP_STATE_SYNSENT)
         {   //Waiting for SYN-ACK
             if ((gPB[TCP_FLAGS_P] & TCP_FLAGS_SYN_V) && (gPB[TCP_FLAGS_P] &TCP_FLAGS_ACK_V))
             {   //SYN and ACK flags set so this is an acknowledgement to our SYN
+                c->rcvNxt = getSequenceNumber() + 1;
+                packetFetch(); // the options may lie past the headers read so far
+                c->mss = tcp_peer_mss();
                 make_tcp_ack_from_any(0,0);
-                gPB[TCP_FLAGS_P] = TCP_FLAGS_ACK_V|TCP_FLAGS_PUSH_V;
-                if (client_tcp_datafill_cb)
-                    len = (*client_tcp_datafill_cb)((gPB[TCP_SRC_PORT_L_P]>>5)&0x7);
+                if (c->datafill_cb)
+                    len = (*c->datafill_cb)(c->fd);
                 else
                     len = 0;
-                tcp_client_state = TCP_STATE_ESTABLISHED;
-                make_tcp_ack_with_data_noflags(len);
+                c->state = TCP_STATE_ESTABLISHED;
+                // the SYN is acknowledged, the request is all that is outstanding;
+                // it goes in segments of the server's MSS
+                for (uint16_t off = 0; off < len; ) {
+                    const uint16_t n = len - off < c->mss ? len - off : c->mss;
+                    off += n;
+                    client_segment(*c, c->sndNxt, off - n, n,
+                                   TCP_FLAGS_ACK_V | (off == len ? TCP_FLAGS_PUSH_V : 0));
+                    if (c->sndUna == c->sndNxt)
+                        tcp_timer_start(c->rtx);
+                    c->sndNxt += n;
+                    tcp_copy_keep(owner, c->sndNxt);
+                }
             }
             else
             {   //Expecting SYN+ACK so reset and resend SYN
-                tcp_client_state = TCP_STATE_SENDSYN; // retry
+                c->state = TCP_STATE_SENDSYN; // retry
                 len++;
                 if (gPB[TCP_FLAGS_P] & TCP_FLAGS_ACK_V)
                     len = 0;
@@ -847,37 +2022,38 @@ uint16_t EtherCard::packetLoop (uint16_t plen) {
             }
             return 0;
         }
-        if (tcp_client_state==TCP_STATE_ESTABLISHED && len>0)
+        if (c->state==TCP_STATE_ESTABLISHED && len>0)
         {   //TCP connection established so read data
-            if (client_tcp_result_cb) {
+            if (c->result_cb) {
+                packetFetch();
                 uint16_t tcpstart = TCP_DATA_START; // TCP_DATA_START is a formula
                 if (tcpstart>plen-8)
                     tcpstart = plen-8; // dummy but save
                 uint16_t save_len = len;
                 if (tcpstart+len>plen)
                     save_len = plen-tcpstart;
-                (*client_tcp_result_cb)((gPB[TCP_DST_PORT_L_P]>>5)&0x7,0,tcpstart,save_len); //Call TCP handler (callback) function
+                (*c->result_cb)(c->fd,0,tcpstart,save_len); //Call TCP handler (callback) function
 
-                if(persist_tcp_connection)
+                if(gNIC.persist_tcp_connection)
                 {   //Keep connection alive by sending ACK
                     make_tcp_ack_from_any(len,TCP_FLAGS_PUSH_V);
                 }
                 else
                 {   //Close connection
                     make_tcp_ack_from_any(len,TCP_FLAGS_PUSH_V|TCP_FLAGS_FIN_V);
-                    tcp_client_state = TCP_STATE_CLOSED;
+                    client_fin_sent(*c);
                 }
                 return 0;
             }
         }
-        if (tcp_client_state != TCP_STATE_CLOSING)
+        if (c->state != TCP_STATE_CLOSING)
         {   //
             if (gPB[TCP_FLAGS_P] & TCP_FLAGS_FIN_V) {
-                if(tcp_client_state == TCP_STATE_ESTABLISHED) {
+                if(c->state == TCP_STATE_ESTABLISHED) {
                     return 0; // In some instances FIN is received *before* DATA.  If that is the case, we just return here and keep looking for the data packet
                 }
                 make_tcp_ack_from_any(len+1,TCP_FLAGS_PUSH_V|TCP_FLAGS_FIN_V);
-                tcp_client_state = TCP_STATE_CLOSED; // connection terminated
+                client_fin_sent(*c); // connection terminated
             } else if (len>0) {
                 make_tcp_ack_from_any(len,0);
             }
@@ -888,10 +2064,39 @@ uint16_t EtherCard::packetLoop (uint16_t plen) {
 
 #if ETHERCARD_TCPSERVER
     //If we are here then this is a TCP/IP packet targeted at us and not related to our client connection so accept
-    return accept(hisport, plen);
+    return accept(gNIC.hisport, plen);
 #endif
 }
 
+uint16_t EtherCard::packetLoopDrain (uint8_t maxFrames, uint16_t budget) {
+    uint16_t start = micros();
+    uint16_t overflows = gNIC.rxStats.overflows;
+    uint16_t pos = 0;
+    gNIC.drainProcessed = 0;
+
+    while (gNIC.drainProcessed < maxFrames) {
+        const uint16_t taken = gNIC.rxStats.frames + gNIC.rxStats.errors + gNIC.rxStats.resets;
+        uint16_t plen = packetReceive();
+        if (plen == 0 && (uint16_t) (gNIC.rxStats.frames + gNIC.rxStats.errors + gNIC.rxStats.resets) != taken) {
+            // a frame with a receive error, or a corrupt ring which got reset:
+            // it took the place of a frame, the ones behind it still wait
+            ++gNIC.drainProcessed;
+        } else {
+            pos = packetLoop(plen); // with plen 0 this does the idle work
+            if (plen == 0)
+                break;
+            ++gNIC.drainProcessed;
+            if (pos)
+                break;
+        }
+        if (budget && (uint16_t) micros() - start >= budget)
+            break;
+    }
+
+    gNIC.drainOverflows = gNIC.rxStats.overflows - overflows; // packetReceive checks
+    return pos;
+}
+
 void EtherCard::persistTcpConnection(bool persist) {
-    persist_tcp_connection = persist;
+    gNIC.persist_tcp_connection = persist;
 }
@@ -17,22 +17,26 @@ typedef struct {
     bool listening;
 } UdpServerListener;
 
-UdpServerListener listeners[UDPSERVER_MAXLISTENERS];
-byte numListeners = 0;
+struct UdpState {
+    UdpServerListener listeners[UDPSERVER_MAXLISTENERS] = {};
+    byte numListeners = 0;
+};
+
+ETHERCARD_INTERFACE_STATE(UdpState, udp)
 
 void EtherCard::udpServerListenOnPort(UdpServerCallback callback, uint16_t port) {
-    if(numListeners < UDPSERVER_MAXLISTENERS)
+    if(udp->numListeners < UDPSERVER_MAXLISTENERS)
     {
-        listeners[numListeners] = (UdpServerListener) {
+        udp->listeners[udp->numListeners] = (UdpServerListener) {
             callback, port, true
         };
-        numListeners++;
+        udp->numListeners++;
     }
 }
 
 static void udp_listen_on_port(const uint16_t port, const bool listen)
 {
-    for (UdpServerListener *iter = listeners, *last = listeners + numListeners;
+    for (UdpServerListener *iter = udp->listeners, *last = udp->listeners + udp->numListeners;
             iter != last; ++iter)
     {
         UdpServerListener &l = *iter;
@@ -53,20 +57,24 @@ void EtherCard::udpServerResumeListenOnPort(uint16_t port) {
 }
 
 bool EtherCard::udpServerListening() {
-    return numListeners > 0;
+    return udp->numListeners > 0;
 }
 
 bool EtherCard::udpServerHasProcessedPacket(const IpHeader &iph, const uint8_t *iter, const uint8_t *last) {
     bool packetProcessed = false;
     UdpHeader &udph = udp_header();
     const uint16_t dport = ntohs(udph.dport);
-    for (UdpServerListener *iter = listeners, *last = listeners + numListeners;
+    for (UdpServerListener *iter = udp->listeners, *last = udp->listeners + udp->numListeners;
             iter != last; ++iter)
     {
         UdpServerListener &l = *iter;
         if (l.listening && l.port == dport)
         {
-            const uint16_t datalen = udph.length - sizeof(UdpHeader);
+            // the rest of a datagram longer than the buffer is left to udpPayloadReader()
+            const uint16_t buffered = packetFetch() - (udp_payload() - gPB);
+            uint16_t datalen = ntohs(udph.length) - sizeof(UdpHeader);
+            if (datalen > buffered)
+                datalen = buffered;
             l.callback(
                 l.port,
                 (uint8_t *)iph.spaddr, // TODO: change definition of UdpServerCallback to const uint8_t *